@@ -0,0 +1,191 @@
+#include "access_log.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_operations.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define BATCH_CAPACITY (256 * 1024)
+#define FLUSH_THRESHOLD (64 * 1024)
+#define MAX_RECORD_SIZE (1024)
+#define NS_PER_US (1000ULL)
+
+static const char *CLOSE_REASONS[CLOSE_REASONS_COUNT] = {
+        [CLOSE_CLIENT_CLOSED] = "client_closed",
+        [CLOSE_UPSTREAM_CLOSED] = "upstream_closed",
+        [CLOSE_READ_ERROR] = "read_error",
+        [CLOSE_WRITE_ERROR] = "write_error",
+        [CLOSE_HANDSHAKE_FAILED] = "handshake_failed",
+        [CLOSE_REQUEST_FAILED] = "request_failed",
+        [CLOSE_CONNECT_FAILED] = "connect_failed",
+        [CLOSE_DENIED] = "denied",
+        [CLOSE_HANDSHAKE_TIMEOUT] = "handshake_timeout",
+        [CLOSE_OVERLOADED] = "overloaded",
+        [CLOSE_SHUTDOWN] = "shutdown",
+        [CLOSE_OUT_OF_MEMORY] = "out_of_memory",
+};
+
+/*
+ * The event loop appends to active, the writer swaps it with spare
+ * and writes spare out without holding the lock.
+ */
+static int log_fd = FAIL;
+static pthread_t writer_thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_ready = PTHREAD_COND_INITIALIZER;
+static char *active = NULL;
+static size_t active_len = 0;
+static char *spare = NULL;
+static bool writer_signaled = false;
+static bool stop_requested = false;
+static uint64_t dropped = 0;
+
+static void *run_writer(__attribute__((unused)) void *arg) {
+    pthread_mutex_lock(&lock);
+    while (true) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += ACCESS_LOG_FLUSH_INTERVAL_SEC;
+        while (!stop_requested && active_len < FLUSH_THRESHOLD) {
+            if (pthread_cond_timedwait(&batch_ready, &lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        bool stopping = stop_requested;
+        char *full = active;
+        size_t full_len = active_len;
+        active = spare;
+        active_len = 0;
+        writer_signaled = false;
+        pthread_mutex_unlock(&lock);
+        if (full_len > 0) {
+            message_t batch = {
+                    .data = full,
+                    .len = full_len
+            };
+            if (!write_all(log_fd, &batch)) {
+                perror("[PROXY] Error in access log write");
+            }
+        }
+        pthread_mutex_lock(&lock);
+        spare = full;
+        if (stopping) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+int access_log_open(const char *path) {
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd == FAIL) {
+        return FAIL;
+    }
+    active = malloc(BATCH_CAPACITY);
+    spare = malloc(BATCH_CAPACITY);
+    if (active == NULL || spare == NULL) {
+        free(active);
+        free(spare);
+        close(log_fd);
+        log_fd = FAIL;
+        return FAIL;
+    }
+    int return_value = pthread_create(&writer_thread, NULL, run_writer, NULL);
+    if (return_value != SUCCESS) {
+        free(active);
+        free(spare);
+        close(log_fd);
+        log_fd = FAIL;
+        errno = return_value;
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+bool access_log_enabled() {
+    return log_fd != FAIL;
+}
+
+static size_t append_json_string(char *buffer, size_t capacity, const char *value) {
+    size_t len = 0;
+    for (const char *c = value; *c != '\0' && len + 7 < capacity; c++) {
+        unsigned char symbol = (unsigned char) *c;
+        if (symbol == '"' || symbol == '\\') {
+            buffer[len++] = '\\';
+            buffer[len++] = (char) symbol;
+        } else if (symbol < 0x20) {
+            len += snprintf(buffer + len, capacity - len, "\\u%04x", symbol);
+        } else {
+            buffer[len++] = (char) symbol;
+        }
+    }
+    return len;
+}
+
+void access_log_write(const access_record_t *record, close_reason_t reason, uint64_t closed_ns) {
+    if (log_fd == FAIL) {
+        return;
+    }
+    char line[MAX_RECORD_SIZE];
+    char client[INET_ADDRSTRLEN] = "";
+    inet_ntop(AF_INET, &record->client_address.sin_addr, client, sizeof(client));
+    uint64_t setup_us = 0;
+    if (record->established_ns != 0) {
+        setup_us = (record->established_ns - record->accepted_ns) / NS_PER_US;
+    }
+    int len = snprintf(line, sizeof(line), "{\"start_ms\": %llu, \"client\": \"%s:%d\", \"destination\": \"",
+                       (unsigned long long) record->start_wall_ms, client, ntohs(record->client_address.sin_port));
+    len += (int) append_json_string(line + len, sizeof(line) / 2, record->dest_address);
+    len += snprintf(line + len, sizeof(line) - len,
+                    "\", \"port\": %d, \"bytes_up\": %llu, \"bytes_down\": %llu, \"setup_us\": %llu, "
+                    "\"duration_us\": %llu, \"close_reason\": \"%s\"}\n",
+                    record->dest_port, (unsigned long long) record->bytes_up,
+                    (unsigned long long) record->bytes_down, (unsigned long long) setup_us,
+                    (unsigned long long) ((closed_ns - record->accepted_ns) / NS_PER_US), CLOSE_REASONS[reason]);
+    pthread_mutex_lock(&lock);
+    if (len >= MAX_RECORD_SIZE || active_len + len > BATCH_CAPACITY) {
+        dropped++;
+    } else {
+        memcpy(active + active_len, line, len);
+        active_len += len;
+        if (active_len >= FLUSH_THRESHOLD && !writer_signaled) {
+            writer_signaled = true;
+            pthread_cond_signal(&batch_ready);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+void access_log_close() {
+    if (log_fd == FAIL) {
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    stop_requested = true;
+    pthread_cond_signal(&batch_ready);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer_thread, NULL);
+    free(active);
+    free(spare);
+    active = NULL;
+    spare = NULL;
+    close(log_fd);
+    log_fd = FAIL;
+}
+
+uint64_t access_log_dropped_count() {
+    pthread_mutex_lock(&lock);
+    uint64_t result = dropped;
+    pthread_mutex_unlock(&lock);
+    return result;
+}
@@ -0,0 +1,70 @@
+#ifndef PROXY_SERVER_ACCESS_LOG_H
+#define PROXY_SERVER_ACCESS_LOG_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "socks_messages.h"
+
+/*
+ * One JSON line per tunnel, written when the tunnel is closed.
+ * The event loop only copies the formatted line into a memory batch,
+ * a background thread writes full batches (or whatever is there after
+ * ACCESS_LOG_FLUSH_INTERVAL_SEC) to the file.
+ */
+
+#define ACCESS_LOG_FLUSH_INTERVAL_SEC (1)
+
+typedef enum close_reason_t {
+    CLOSE_CLIENT_CLOSED,
+    CLOSE_UPSTREAM_CLOSED,
+    CLOSE_READ_ERROR,
+    CLOSE_WRITE_ERROR,
+    CLOSE_HANDSHAKE_FAILED,
+    CLOSE_REQUEST_FAILED,
+    CLOSE_CONNECT_FAILED,
+    CLOSE_DENIED,
+    CLOSE_HANDSHAKE_TIMEOUT,
+    CLOSE_OVERLOADED,
+    CLOSE_SHUTDOWN,
+    CLOSE_OUT_OF_MEMORY,
+    CLOSE_REASONS_COUNT
+} close_reason_t;
+
+/*
+ * Statistics of a tunnel, kept by the proxy for the client descriptor
+ */
+typedef struct access_record_t {
+    bool active;
+    struct sockaddr_in client_address;
+    char dest_address[ADDR_BUFFER_SIZE];
+    int dest_port;
+    uint64_t start_wall_ms;
+    uint64_t accepted_ns;
+    uint64_t established_ns;
+    uint64_t bytes_up;   // client -> destination
+    uint64_t bytes_down; // destination -> client
+} access_record_t;
+
+int access_log_open(const char *path);
+
+bool access_log_enabled();
+
+/*
+ * Never blocks on I/O. If the writer is so far behind that the batch
+ * is full, or the record does not fit a line, it is dropped and counted.
+ */
+void access_log_write(const access_record_t *record, close_reason_t reason, uint64_t closed_ns);
+
+/*
+ * Writes everything that is buffered and stops the writer
+ */
+void access_log_close();
+
+/*
+ * Records dropped since the log was opened, it is kept after the close
+ */
+uint64_t access_log_dropped_count();
+
+#endif //PROXY_SERVER_ACCESS_LOG_H
@@ -0,0 +1,504 @@
+#include "acl.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define ROOT_SIZE (1 << ACL_ROOT_BITS)
+#define NODE_SIZE (1 << ACL_STRIDE)
+#define IS_NODE (1U << 31) // a root entry that is a node, the rest is the index of the node
+#define KEY_SIZE (18)      // the longest address and the bytes a stride reaches past it
+#define IPV4_INDEX (0)
+#define IPV6_INDEX (1)
+#define MAX_PORT (65535)
+#define SEPARATORS " \t\r\n"
+#define INITIAL_CAPACITY (1024)
+
+typedef enum line_kind_t {
+    LINE_EMPTY,
+    LINE_RULE,
+    LINE_DEFAULT
+} line_kind_t;
+
+typedef struct prefix_t {
+    uint8_t key[KEY_SIZE]; // the address with the bits after the prefix cleared
+    uint8_t family_index;
+    uint8_t bits;
+    uint32_t line;   // rules of one prefix are tried in the order of lines
+    uint32_t policy; // given when the rules of the prefix are joined
+    acl_rule_t rule;
+} prefix_t;
+
+typedef struct builder_t {
+    acl_t *acl;
+    prefix_t *prefixes;
+    size_t nodes_capacity;
+    size_t leaves_capacity;
+} builder_t;
+
+static bool grow(void **array, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity == 0 ? INITIAL_CAPACITY : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(*array, new_capacity * item_size);
+    if (grown == NULL) {
+        return false;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+/*
+ * The stride bits of the key that start at offset, the root is at offset 0
+ */
+static uint32_t chunk_at(const uint8_t *key, unsigned offset, unsigned stride) {
+    if (stride == ACL_ROOT_BITS) {
+        return (uint32_t) key[0] << 8 | key[1];
+    }
+    unsigned byte = offset >> 3;
+    uint32_t word = (uint32_t) key[byte] << 8 | key[byte + 1];
+    return (word >> (16 - stride - (offset & 7))) & ((1U << stride) - 1);
+}
+
+int acl_parse_number(const char *text, long max, long *value) {
+    char *end = NULL;
+    *value = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || *value < 0 || *value > max) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * So that rules of one prefix are sorted together
+ */
+static void clear_host_bits(prefix_t *prefix) {
+    unsigned max_bits = prefix->family_index == IPV4_INDEX ? 32 : 128;
+    for (unsigned bit = prefix->bits; bit < max_bits; bit++) {
+        prefix->key[bit >> 3] &= (uint8_t) ~(0x80 >> (bit & 7));
+    }
+}
+
+static void prefix_of(const acl_entry_t *entry, uint32_t line, prefix_t *prefix) {
+    prefix->family_index = entry->family == AF_INET6 ? IPV6_INDEX : IPV4_INDEX;
+    memcpy(prefix->key, entry->address, entry->family == AF_INET6 ? 16 : 4);
+    prefix->bits = entry->bits;
+    clear_host_bits(prefix);
+    prefix->line = line;
+    prefix->rule = entry->rule;
+}
+
+int acl_parse_prefix(char *text, acl_entry_t *entry) {
+    char *slash = strchr(text, '/');
+    if (slash != NULL) {
+        *slash = '\0';
+    }
+    memset(entry->address, 0, sizeof(entry->address));
+    long max_bits;
+    if (inet_pton(AF_INET, text, entry->address) == 1) {
+        entry->family = AF_INET;
+        max_bits = 32;
+    } else if (inet_pton(AF_INET6, text, entry->address) == 1) {
+        entry->family = AF_INET6;
+        max_bits = 128;
+    } else {
+        max_bits = 0;
+    }
+    long bits = max_bits;
+    if (max_bits == 0 || (slash != NULL && acl_parse_number(slash + 1, max_bits, &bits) == FAIL)) {
+        // a domain of the routes is told from a wrong prefix by its slash
+        if (slash != NULL) {
+            *slash = '/';
+        }
+        return FAIL;
+    }
+    entry->bits = (uint8_t) bits;
+    return SUCCESS;
+}
+
+int acl_parse_ports(char *text, acl_rule_t *rule) {
+    long first = 0;
+    long last = MAX_PORT;
+    if (text != NULL) {
+        char *dash = strchr(text, '-');
+        if (dash != NULL) {
+            *dash = '\0';
+        }
+        if (acl_parse_number(text, MAX_PORT, &first) == FAIL) {
+            return FAIL;
+        }
+        last = first;
+        if (dash != NULL && (acl_parse_number(dash + 1, MAX_PORT, &last) == FAIL || last < first)) {
+            return FAIL;
+        }
+    }
+    rule->first_port = (uint16_t) first;
+    rule->last_port = (uint16_t) last;
+    return SUCCESS;
+}
+
+static int parse_action(const char *text, uint32_t *value) {
+    if (strcmp(text, "allow") == 0) {
+        *value = 1;
+    } else if (strcmp(text, "deny") == 0) {
+        *value = 0;
+    } else {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+static int parse_line(char *line, acl_entry_t *entry, uint32_t *default_value) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    char *position = NULL;
+    char *first = strtok_r(line, SEPARATORS, &position);
+    if (first == NULL) {
+        return LINE_EMPTY;
+    }
+    char *second = strtok_r(NULL, SEPARATORS, &position);
+    char *third = second == NULL ? NULL : strtok_r(NULL, SEPARATORS, &position);
+    if (second == NULL || strtok_r(NULL, SEPARATORS, &position) != NULL) {
+        return FAIL;
+    }
+    if (strcmp(first, "default") == 0) {
+        if (third != NULL || parse_action(second, default_value) == FAIL) {
+            return FAIL;
+        }
+        return LINE_DEFAULT;
+    }
+    if (parse_action(first, &entry->rule.value) == FAIL || acl_parse_prefix(second, entry) == FAIL
+        || acl_parse_ports(third, &entry->rule) == FAIL) {
+        return FAIL;
+    }
+    return LINE_RULE;
+}
+
+/*
+ * A prefix is sorted before the prefixes it contains
+ */
+static int compare_prefixes(const void *a, const void *b) {
+    const prefix_t *first = (const prefix_t *) a;
+    const prefix_t *second = (const prefix_t *) b;
+    if (first->family_index != second->family_index) {
+        return first->family_index < second->family_index ? -1 : 1;
+    }
+    int difference = memcmp(first->key, second->key, sizeof(first->key));
+    if (difference != 0) {
+        return difference;
+    }
+    if (first->bits != second->bits) {
+        return first->bits < second->bits ? -1 : 1;
+    }
+    return first->line < second->line ? -1 : first->line > second->line;
+}
+
+static bool same_prefix(const prefix_t *first, const prefix_t *second) {
+    return first->family_index == second->family_index && first->bits == second->bits
+           && memcmp(first->key, second->key, sizeof(first->key)) == 0;
+}
+
+/*
+ * Fills the entries of a node that starts at offset with the policy of
+ * the longest prefix that ends in the node and covers the entry, with
+ * inherited if none does. A prefix comes after the prefixes containing
+ * it, so it overwrites them. The prefixes longer than the node are left
+ * to its children, those of entry i are [group_start[i], group_end[i]).
+ */
+static void expand(builder_t *builder, size_t start, size_t end, unsigned offset, unsigned stride,
+                   uint32_t inherited, uint32_t *values, uint32_t *group_start, uint32_t *group_end) {
+    size_t count = (size_t) 1 << stride;
+    for (size_t i = 0; i < count; i++) {
+        values[i] = inherited;
+        group_start[i] = 0;
+        group_end[i] = 0;
+    }
+    size_t i = start;
+    while (i < end) {
+        const prefix_t *prefix = &builder->prefixes[i];
+        uint32_t index = chunk_at(prefix->key, offset, stride);
+        if (prefix->bits > offset + stride) {
+            size_t group_last = i + 1;
+            while (group_last < end && chunk_at(builder->prefixes[group_last].key, offset, stride) == index) {
+                group_last++;
+            }
+            group_start[index] = (uint32_t) i;
+            group_end[index] = (uint32_t) group_last;
+            i = group_last;
+            continue;
+        }
+        uint32_t spread = offset + stride - prefix->bits;
+        index &= ~((1U << spread) - 1);
+        builder->acl->policies[prefix->policy].parent = values[index];
+        for (uint32_t j = 0; j < (1U << spread); j++) {
+            values[index + j] = prefix->policy;
+        }
+        i++;
+    }
+}
+
+static int build_node(builder_t *builder, size_t node_index, size_t start, size_t end, unsigned offset,
+                      uint32_t inherited) {
+    uint32_t values[NODE_SIZE];
+    uint32_t group_start[NODE_SIZE];
+    uint32_t group_end[NODE_SIZE];
+    expand(builder, start, end, offset, ACL_STRIDE, inherited, values, group_start, group_end);
+    acl_t *acl = builder->acl;
+    acl_node_t node = {
+            .vector = 0,
+            .leafvec = 0,
+            .first_leaf = (uint32_t) acl->leaves_count,
+            .first_child = (uint32_t) acl->nodes_count
+    };
+    bool has_leaf = false;
+    for (int i = 0; i < NODE_SIZE; i++) {
+        if (group_end[i] > group_start[i]) {
+            node.vector |= 1ULL << i;
+            continue;
+        }
+        if (has_leaf && values[i] == acl->leaves[acl->leaves_count - 1]) {
+            continue;
+        }
+        if (!grow((void **) &acl->leaves, &builder->leaves_capacity, acl->leaves_count + 1, sizeof(uint32_t))) {
+            return FAIL;
+        }
+        acl->leaves[acl->leaves_count++] = values[i];
+        node.leafvec |= 1ULL << i;
+        has_leaf = true;
+    }
+    // the children are taken in a row before any of them is built
+    size_t children_count = (size_t) __builtin_popcountll(node.vector);
+    if (!grow((void **) &acl->nodes, &builder->nodes_capacity, acl->nodes_count + children_count,
+              sizeof(acl_node_t))) {
+        return FAIL;
+    }
+    acl->nodes_count += children_count;
+    acl->nodes[node_index] = node;
+    size_t child = node.first_child;
+    for (int i = 0; i < NODE_SIZE; i++) {
+        if ((node.vector & (1ULL << i)) != 0
+            && build_node(builder, child++, group_start[i], group_end[i], offset + ACL_STRIDE, values[i]) == FAIL) {
+            return FAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+static int build_root(builder_t *builder, int family_index, size_t start, size_t end) {
+    acl_t *acl = builder->acl;
+    uint32_t *root = (uint32_t *) malloc(ROOT_SIZE * sizeof(uint32_t));
+    uint32_t *group_start = (uint32_t *) malloc(ROOT_SIZE * sizeof(uint32_t));
+    uint32_t *group_end = (uint32_t *) malloc(ROOT_SIZE * sizeof(uint32_t));
+    int return_value = root != NULL && group_start != NULL && group_end != NULL ? SUCCESS : FAIL;
+    if (return_value == SUCCESS) {
+        expand(builder, start, end, 0, ACL_ROOT_BITS, 0, root, group_start, group_end);
+    }
+    for (size_t i = 0; i < ROOT_SIZE && return_value == SUCCESS; i++) {
+        if (group_end[i] == group_start[i]) {
+            continue;
+        }
+        if (!grow((void **) &acl->nodes, &builder->nodes_capacity, acl->nodes_count + 1, sizeof(acl_node_t))) {
+            return_value = FAIL;
+            break;
+        }
+        size_t node_index = acl->nodes_count++;
+        return_value = build_node(builder, node_index, group_start[i], group_end[i], ACL_ROOT_BITS, root[i]);
+        root[i] = IS_NODE | (uint32_t) node_index;
+    }
+    free(group_start);
+    free(group_end);
+    if (return_value == FAIL) {
+        free(root);
+        return FAIL;
+    }
+    acl->roots[family_index] = root;
+    return SUCCESS;
+}
+
+/*
+ * The rules of a prefix are joined into one policy and the prefix is kept once
+ */
+static int compile(acl_t *acl, prefix_t *prefixes, size_t count) {
+    qsort(prefixes, count, sizeof(*prefixes), compare_prefixes);
+    acl->rules = (acl_rule_t *) malloc((count + 1) * sizeof(acl_rule_t));
+    acl->policies = (acl_policy_t *) malloc((count + 1) * sizeof(acl_policy_t));
+    if (acl->rules == NULL || acl->policies == NULL) {
+        return FAIL;
+    }
+    memset(&acl->policies[0], 0, sizeof(acl->policies[0]));
+    acl->policies_count = 1;
+    size_t distinct = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (distinct == 0 || !same_prefix(&prefixes[distinct - 1], &prefixes[i])) {
+            prefixes[distinct] = prefixes[i];
+            prefixes[distinct].policy = (uint32_t) acl->policies_count;
+            acl->policies[acl->policies_count].first_rule = (uint32_t) acl->rules_count;
+            acl->policies[acl->policies_count].rules_count = 0;
+            acl->policies[acl->policies_count].parent = 0;
+            acl->policies_count++;
+            distinct++;
+        }
+        acl->rules[acl->rules_count++] = prefixes[i].rule;
+        acl->policies[acl->policies_count - 1].rules_count++;
+    }
+    builder_t builder = {
+            .acl = acl,
+            .prefixes = prefixes,
+            .nodes_capacity = 0,
+            .leaves_capacity = 0
+    };
+    size_t start = 0;
+    for (int family_index = IPV4_INDEX; family_index <= IPV6_INDEX; family_index++) {
+        size_t end = start;
+        while (end < distinct && prefixes[end].family_index == family_index) {
+            end++;
+        }
+        if (end > start && build_root(&builder, family_index, start, end) == FAIL) {
+            return FAIL;
+        }
+        start = end;
+    }
+    return SUCCESS;
+}
+
+acl_t *acl_load(const char *path, int *error_line) {
+    *error_line = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    acl_t *acl = (acl_t *) calloc(1, sizeof(*acl));
+    prefix_t *prefixes = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    bool failed = acl == NULL;
+    if (!failed) {
+        acl->default_value = 1;
+    }
+    char line[ACL_MAX_LINE];
+    int line_number = 0;
+    while (!failed && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        acl_entry_t entry;
+        memset(&entry, 0, sizeof(entry));
+        bool too_long = strchr(line, '\n') == NULL && !feof(file);
+        int kind = too_long ? FAIL : parse_line(line, &entry, &acl->default_value);
+        if (kind == FAIL) {
+            *error_line = line_number;
+            failed = true;
+        } else if (kind == LINE_RULE) {
+            if (!grow((void **) &prefixes, &capacity, count + 1, sizeof(prefix_t))) {
+                failed = true;
+                break;
+            }
+            memset(&prefixes[count], 0, sizeof(prefix_t));
+            prefix_of(&entry, (uint32_t) line_number, &prefixes[count++]);
+        }
+    }
+    failed = failed || ferror(file);
+    fclose(file);
+    if (!failed && compile(acl, prefixes, count) == FAIL) {
+        failed = true;
+    }
+    free(prefixes);
+    if (failed) {
+        acl_free(acl);
+        return NULL;
+    }
+    return acl;
+}
+
+acl_t *acl_compile(const acl_entry_t *entries, size_t count, uint32_t default_value) {
+    acl_t *acl = (acl_t *) calloc(1, sizeof(*acl));
+    prefix_t *prefixes = (prefix_t *) calloc(count + 1, sizeof(prefix_t));
+    if (acl == NULL || prefixes == NULL) {
+        free(acl);
+        free(prefixes);
+        return NULL;
+    }
+    acl->default_value = default_value;
+    for (size_t i = 0; i < count; i++) {
+        prefix_of(&entries[i], (uint32_t) i + 1, &prefixes[i]);
+    }
+    int return_value = compile(acl, prefixes, count);
+    free(prefixes);
+    if (return_value == FAIL) {
+        acl_free(acl);
+        return NULL;
+    }
+    return acl;
+}
+
+static uint32_t find_policy(const acl_t *acl, int family_index, const uint8_t *key) {
+    const uint32_t *root = acl->roots[family_index];
+    if (root == NULL) {
+        return 0;
+    }
+    uint32_t entry = root[chunk_at(key, 0, ACL_ROOT_BITS)];
+    if ((entry & IS_NODE) == 0) {
+        return entry;
+    }
+    const acl_node_t *node = &acl->nodes[entry & ~IS_NODE];
+    for (unsigned offset = ACL_ROOT_BITS;; offset += ACL_STRIDE) {
+        uint32_t index = chunk_at(key, offset, ACL_STRIDE);
+        uint64_t up_to_index = (2ULL << index) - 1;
+        if ((node->vector & (1ULL << index)) == 0) {
+            return acl->leaves[node->first_leaf + __builtin_popcountll(node->leafvec & up_to_index) - 1];
+        }
+        node = &acl->nodes[node->first_child + __builtin_popcountll(node->vector & up_to_index) - 1];
+    }
+}
+
+uint32_t acl_lookup(const acl_t *acl, int family, const void *address, uint16_t port) {
+    uint8_t key[KEY_SIZE] = {0};
+    int family_index = family == AF_INET6 ? IPV6_INDEX : IPV4_INDEX;
+    memcpy(key, address, family == AF_INET6 ? 16 : 4);
+    // a prefix whose rules do not cover the port leaves it to the prefix containing it
+    for (uint32_t id = find_policy(acl, family_index, key); id != 0; id = acl->policies[id].parent) {
+        const acl_policy_t *policy = &acl->policies[id];
+        for (uint32_t i = 0; i < policy->rules_count; i++) {
+            const acl_rule_t *rule = &acl->rules[policy->first_rule + i];
+            if (port >= rule->first_port && port <= rule->last_port) {
+                return rule->value;
+            }
+        }
+    }
+    return acl->default_value;
+}
+
+bool acl_allows(const acl_t *acl, int family, const void *address, uint16_t port) {
+    return acl_lookup(acl, family, address, port) != 0;
+}
+
+size_t acl_memory_size(const acl_t *acl) {
+    size_t size = sizeof(*acl) + acl->nodes_count * sizeof(acl_node_t) + acl->leaves_count * sizeof(uint32_t)
+                  + acl->rules_count * sizeof(acl_rule_t) + acl->policies_count * sizeof(acl_policy_t);
+    for (int i = IPV4_INDEX; i <= IPV6_INDEX; i++) {
+        size += acl->roots[i] != NULL ? ROOT_SIZE * sizeof(uint32_t) : 0;
+    }
+    return size;
+}
+
+void acl_free(acl_t *acl) {
+    if (acl == NULL) {
+        return;
+    }
+    free(acl->roots[IPV4_INDEX]);
+    free(acl->roots[IPV6_INDEX]);
+    free(acl->nodes);
+    free(acl->leaves);
+    free(acl->rules);
+    free(acl->policies);
+    free(acl);
+}
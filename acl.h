@@ -0,0 +1,119 @@
+#ifndef PROXY_SERVER_ACL_H
+#define PROXY_SERVER_ACL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Destination rules compiled into a longest prefix match table. A file
+ * of rules, one per line:
+ *
+ *     allow|deny <ipv4>|<ipv6>[/<bits>] [<port>[-<port>]]
+ *     default allow|deny
+ *
+ * The most specific prefix whose rules cover the port decides, rules of
+ * one prefix are tried in the order of the file. Without a default the
+ * rest is allowed. '#' starts a comment. A name that goes to a parent
+ * proxy by a domain route of routes.h is checked by its local address.
+ *
+ * The table is a poptrie: the first 16 bits of the address index a
+ * root array, every next 6 bits index a node. A node keeps a bitmap of
+ * its entries that are nodes and a bitmap of where runs of equal leaves
+ * start, the entry is found by counting the bits below it, so a node
+ * takes 24 bytes whatever it holds. An IPv4 lookup reads four nodes at
+ * most. The table is never changed after it is compiled, a reload
+ * compiles a new one.
+ *
+ * A rule picks a value, allow and deny are 1 and 0. Other tables of
+ * prefixes, as the routes, give their own values to acl_compile().
+ */
+
+#define ACL_ROOT_BITS (16)
+#define ACL_STRIDE (6)
+#define ACL_MAX_LINE (256)
+
+typedef struct acl_rule_t {
+    uint16_t first_port;
+    uint16_t last_port;
+    uint32_t value;
+} acl_rule_t;
+
+typedef struct acl_entry_t {
+    int family; // AF_INET or AF_INET6
+    uint8_t address[16];
+    uint8_t bits;
+    acl_rule_t rule;
+} acl_entry_t;
+
+/*
+ * The rules of one prefix, and the policy of the prefix that contains it
+ */
+typedef struct acl_policy_t {
+    uint32_t first_rule;
+    uint32_t rules_count;
+    uint32_t parent; // 0 is the policy of no prefix, it has no rules
+} acl_policy_t;
+
+typedef struct acl_node_t {
+    uint64_t vector;      // entries that are nodes
+    uint64_t leafvec;     // entries where a run of equal leaves starts
+    uint32_t first_leaf;  // the leaves of a node are in a row
+    uint32_t first_child; // and so are its children
+} acl_node_t;
+
+typedef struct acl_t {
+    uint32_t default_value;
+    uint32_t *roots[2]; // of IPv4 and IPv6, NULL if there are no prefixes of the family
+    acl_node_t *nodes;
+    size_t nodes_count;
+    uint32_t *leaves; // policies
+    size_t leaves_count;
+    acl_rule_t *rules;
+    size_t rules_count;
+    acl_policy_t *policies;
+    size_t policies_count;
+} acl_t;
+
+/*
+ * Returns NULL if the file cannot be read or a line is wrong,
+ * *error_line is the number of the line then, 0 if it is not about a line
+ */
+acl_t *acl_load(const char *path, int *error_line);
+
+/*
+ * Rules of one prefix are tried in the order of entries. Returns NULL without memory.
+ */
+acl_t *acl_compile(const acl_entry_t *entries, size_t count, uint32_t default_value);
+
+/*
+ * The value of the rule that decides. address is 4 bytes for AF_INET
+ * and 16 for AF_INET6, in network order.
+ */
+uint32_t acl_lookup(const acl_t *acl, int family, const void *address, uint16_t port);
+
+bool acl_allows(const acl_t *acl, int family, const void *address, uint16_t port);
+
+size_t acl_memory_size(const acl_t *acl);
+
+/*
+ * The parsers of rules files, the routes use them too. They may change text.
+ *
+ * A decimal number from 0 to max.
+ */
+int acl_parse_number(const char *text, long max, long *value);
+
+/*
+ * <ipv4>|<ipv6>[/<bits>] into the family, address and bits of entry.
+ * Returns FAIL with text unchanged if it is not one.
+ */
+int acl_parse_prefix(char *text, acl_entry_t *entry);
+
+/*
+ * <port>[-<port>] into the ports of rule, all ports if text is NULL
+ */
+int acl_parse_ports(char *text, acl_rule_t *rule);
+
+void acl_free(acl_t *acl);
+
+#endif //PROXY_SERVER_ACL_H
@@ -0,0 +1,263 @@
+#include <arpa/inet.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../acl.h"
+
+#define USAGE_GUIDE "usage: ./acl_check [check [<rounds>]|speed]"
+#define FAIL (-1)
+#define SUCCESS (0)
+#define NS_PER_SEC (1000000000ULL)
+#define DEFAULT_ROUNDS (200)
+#define MAX_RULES (60)
+#define LOOKUPS_PER_ROUND (5000)
+#define CHECKED_PORTS (12)
+#define SPEED_RULES (300000)
+#define SPEED_LOOKUPS (1000000)
+#define SPEED_DISTINCT_LOOKUPS (4096)
+#define SPEED_REPEATS (10)
+#define SPEED_PORT (443)
+#define TEMPLATE "/tmp/acl_check.XXXXXX"
+
+/*
+ * Checks the poptrie of acl.c against a brute force search. Every round
+ * writes a random rules file, loads it with acl_load() and compares its
+ * lookups with the longest prefix whose rules cover the port, the first
+ * in the file among prefixes of equal length. Addresses are drawn from a
+ * few values per byte, so prefixes nest and share nodes. With "speed" a
+ * large file is loaded and IPv4 lookups are timed instead.
+ */
+
+typedef struct rule_t {
+    int family;
+    uint8_t address[16];
+    int bits;
+    int first_port;
+    int last_port;
+    bool allow;
+} rule_t;
+
+static uint64_t random_state = 88172645463325252ULL;
+
+static uint64_t next_random() {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+static int address_size(int family) {
+    return family == AF_INET6 ? 16 : 4;
+}
+
+static void random_address(uint8_t *address) {
+    for (int i = 0; i < 16; i++) {
+        address[i] = i < 2 ? next_random() % 2 : next_random() % 4;
+    }
+}
+
+static bool covers(const rule_t *rule, int family, const uint8_t *address, int port) {
+    if (rule->family != family || port < rule->first_port || port > rule->last_port) {
+        return false;
+    }
+    for (int bit = 0; bit < rule->bits; bit++) {
+        if (((rule->address[bit / 8] ^ address[bit / 8]) >> (7 - bit % 8)) & 1) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool brute_force_allows(const rule_t *rules, int count, bool default_allow, int family,
+                               const uint8_t *address, int port) {
+    const rule_t *best = NULL;
+    for (int i = 0; i < count; i++) {
+        if (covers(&rules[i], family, address, port) && (best == NULL || rules[i].bits > best->bits)) {
+            best = &rules[i];
+        }
+    }
+    return best == NULL ? default_allow : best->allow;
+}
+
+static void random_rule(rule_t *rule) {
+    rule->family = next_random() % 4 == 0 ? AF_INET6 : AF_INET;
+    int max_bits = address_size(rule->family) * 8;
+    rule->bits = (int) (next_random() % (max_bits + 1));
+    random_address(rule->address);
+    memset(rule->address + address_size(rule->family), 0, 16 - address_size(rule->family));
+    for (int bit = rule->bits; bit < max_bits; bit++) {
+        rule->address[bit / 8] &= ~(0x80 >> (bit % 8));
+    }
+    rule->allow = next_random() % 2 == 0;
+    rule->first_port = 0;
+    rule->last_port = UINT16_MAX;
+    int ports_kind = (int) (next_random() % 3);
+    if (ports_kind == 1) {
+        rule->first_port = (int) (next_random() % 8);
+        rule->last_port = rule->first_port;
+    } else if (ports_kind == 2) {
+        rule->first_port = (int) (next_random() % 8);
+        rule->last_port = rule->first_port + (int) (next_random() % 4);
+    }
+}
+
+static int write_rules(const char *path, const rule_t *rules, int count, bool default_allow) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("[ACL] Error in fopen");
+        return FAIL;
+    }
+    fprintf(file, "# generated by acl_check\n\ndefault %s\n", default_allow ? "allow" : "deny");
+    for (int i = 0; i < count; i++) {
+        char text[INET6_ADDRSTRLEN];
+        inet_ntop(rules[i].family, rules[i].address, text, sizeof(text));
+        fprintf(file, "%s %s/%d", rules[i].allow ? "allow" : "deny", text, rules[i].bits);
+        if (rules[i].first_port != 0 || rules[i].last_port != UINT16_MAX) {
+            fprintf(file, rules[i].first_port == rules[i].last_port ? " %d" : " %d-%d",
+                    rules[i].first_port, rules[i].last_port);
+        }
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0 ? SUCCESS : FAIL;
+}
+
+/*
+ * Half of the lookups go to the address of a rule, some of them with one bit flipped
+ */
+static int check_round(const char *path, int round) {
+    rule_t rules[MAX_RULES];
+    int count = 1 + (int) (next_random() % MAX_RULES);
+    bool default_allow = next_random() % 2 == 0;
+    for (int i = 0; i < count; i++) {
+        random_rule(&rules[i]);
+    }
+    if (write_rules(path, rules, count, default_allow) == FAIL) {
+        return FAIL;
+    }
+    int error_line = 0;
+    acl_t *acl = acl_load(path, &error_line);
+    if (acl == NULL) {
+        fprintf(stderr, "[ACL] Round %d: rules not loaded, line %d of %s\n", round, error_line, path);
+        return FAIL;
+    }
+    int return_value = SUCCESS;
+    for (int i = 0; i < LOOKUPS_PER_ROUND && return_value == SUCCESS; i++) {
+        int family = next_random() % 4 == 0 ? AF_INET6 : AF_INET;
+        uint8_t address[16];
+        random_address(address);
+        if (next_random() % 2 == 0) {
+            const rule_t *rule = &rules[next_random() % count];
+            family = rule->family;
+            memcpy(address, rule->address, sizeof(address));
+            if (next_random() % 2 == 0) {
+                address[next_random() % address_size(family)] ^= 1 << (next_random() % 8);
+            }
+        }
+        int port = (int) (next_random() % CHECKED_PORTS);
+        bool expected = brute_force_allows(rules, count, default_allow, family, address, port);
+        if (acl_allows(acl, family, address, (uint16_t) port) != expected) {
+            char text[INET6_ADDRSTRLEN];
+            inet_ntop(family, address, text, sizeof(text));
+            fprintf(stderr, "[ACL] Round %d: %s port %d should be %s, the rules are kept in %s\n",
+                    round, text, port, expected ? "allowed" : "denied", path);
+            return_value = FAIL;
+        }
+    }
+    acl_free(acl);
+    return return_value;
+}
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (double) ((to->tv_sec - from->tv_sec) * (int64_t) NS_PER_SEC + (to->tv_nsec - from->tv_nsec)) / 1e6;
+}
+
+static int measure_speed(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror("[ACL] Error in fopen");
+        return FAIL;
+    }
+    for (int i = 0; i < SPEED_RULES; i++) {
+        struct in_addr address = {.s_addr = htonl((uint32_t) next_random())};
+        int bits = i % 3 == 0 ? 32 : i % 3 == 1 ? 24 : 16 + (int) (next_random() % 17);
+        fprintf(file, "%s %s/%d%s\n", i % 2 ? "allow" : "deny", inet_ntoa(address), bits, i % 5 == 0 ? " 443" : "");
+    }
+    if (fclose(file) != 0) {
+        return FAIL;
+    }
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int error_line = 0;
+    acl_t *acl = acl_load(path, &error_line);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (acl == NULL) {
+        fprintf(stderr, "[ACL] Rules not loaded, line %d\n", error_line);
+        return FAIL;
+    }
+    printf("load: %d rules in %.1f ms, %zu KiB\n", SPEED_RULES, elapsed_ms(&start, &end),
+           acl_memory_size(acl) / 1024);
+    uint32_t *addresses = malloc(sizeof(uint32_t) * SPEED_LOOKUPS);
+    if (addresses == NULL) {
+        acl_free(acl);
+        return FAIL;
+    }
+    // a few thousand distinct addresses, so the lookups mostly hit the cache as hot clients would
+    for (int i = 0; i < SPEED_LOOKUPS; i++) {
+        addresses[i] = i < SPEED_DISTINCT_LOOKUPS ? (uint32_t) next_random() : addresses[i % SPEED_DISTINCT_LOOKUPS];
+    }
+    long allowed = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int repeat = 0; repeat < SPEED_REPEATS; repeat++) {
+        for (int i = 0; i < SPEED_LOOKUPS; i++) {
+            allowed += acl_allows(acl, AF_INET, &addresses[i], SPEED_PORT);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("lookup: %.1f ns, %ld allowed\n",
+           elapsed_ms(&start, &end) * 1e6 / ((double) SPEED_LOOKUPS * SPEED_REPEATS), allowed);
+    free(addresses);
+    acl_free(acl);
+    return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    bool speed = argc > 1 && strcmp(argv[1], "speed") == 0;
+    if (argc > 1 && !speed && strcmp(argv[1], "check") != 0) {
+        fprintf(stderr, "%s\n", USAGE_GUIDE);
+        return EXIT_FAILURE;
+    }
+    int rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_ROUNDS;
+    if (rounds < 1) {
+        fprintf(stderr, "%s\n", USAGE_GUIDE);
+        return EXIT_FAILURE;
+    }
+    char path[] = TEMPLATE;
+    int fd = mkstemp(path);
+    if (fd == FAIL) {
+        perror("[ACL] Error in mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    int return_value = SUCCESS;
+    if (speed) {
+        return_value = measure_speed(path);
+    } else {
+        for (int round = 0; round < rounds && return_value == SUCCESS; round++) {
+            return_value = check_round(path, round);
+        }
+        if (return_value == SUCCESS) {
+            printf("acl: %d rounds of %d lookups match the brute force search\n", rounds, LOOKUPS_PER_ROUND);
+        }
+    }
+    // a failed check keeps its rules for a look
+    if (return_value == SUCCESS) {
+        unlink(path);
+    }
+    return return_value == SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
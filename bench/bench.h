@@ -0,0 +1,37 @@
+#ifndef PROXY_SERVER_BENCH_H
+#define PROXY_SERVER_BENCH_H
+
+#include "../io_operations.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+
+#define MAX_SCENARIO_NAME (64)
+#define METRICS_COUNT (10)
+
+/*
+ * Every scenario produces one JSON object per line:
+ * {"scenario": "<name>", "<metric>": <value>, ...}
+ * The order of metrics is fixed by this table so that bench_compare
+ * can parse results with a plain sscanf.
+ */
+typedef struct bench_metric_t {
+    const char *name;
+    /* true if bigger values are better (throughput), false for costs (latency, cpu) */
+    bool higher_is_better;
+} bench_metric_t;
+
+static const bench_metric_t BENCH_METRICS[METRICS_COUNT] = {
+        {"ops_per_sec",          true},
+        {"throughput_mib_per_sec", true},
+        {"latency_p50_us",       false},
+        {"latency_p90_us",       false},
+        {"latency_p99_us",       false},
+        {"latency_p999_us",      false},
+        {"proxy_cpu_sec",        false},
+        {"proxy_rss_kib",        false},
+        {"proxy_rw_syscalls_per_kib", false}, // read and write family only, from /proc/<pid>/io
+        {"errors",               false},
+};
+
+#endif //PROXY_SERVER_BENCH_H
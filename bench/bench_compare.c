@@ -0,0 +1,124 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define USAGE_GUIDE "usage: ./bench_compare <baseline.json> <results.json> [threshold_percent]"
+#define REQUIRED_ARGC (2 + 1)
+#define DEFAULT_THRESHOLD_PERCENT (10.0)
+#define MAX_SCENARIOS (32)
+#define LINE_SIZE (1024)
+
+typedef struct scenario_result_t {
+    char name[MAX_SCENARIO_NAME];
+    double values[METRICS_COUNT];
+    bool present[METRICS_COUNT]; // a baseline of an older build may lack a metric
+} scenario_result_t;
+
+static bool parse_metric(const char *line, const char *metric, double *value) {
+    char key[MAX_SCENARIO_NAME + 4];
+    snprintf(key, sizeof(key), "\"%s\":", metric);
+    const char *found = strstr(line, key);
+    if (found == NULL) {
+        return false;
+    }
+    *value = strtod(found + strlen(key), NULL);
+    return true;
+}
+
+/*
+ * Results are written by run_bench.sh one scenario per line,
+ * so a line scanner is enough to read them back.
+ */
+static int load_results(const char *path, scenario_result_t *results) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror("[BENCH] Error in fopen");
+        return FAIL;
+    }
+    int count = 0;
+    char line[LINE_SIZE];
+    while (count < MAX_SCENARIOS && fgets(line, sizeof(line), file) != NULL) {
+        const char *name = strstr(line, "\"scenario\": \"");
+        if (name == NULL) {
+            continue;
+        }
+        name += strlen("\"scenario\": \"");
+        const char *name_end = strchr(name, '"');
+        if (name_end == NULL || name_end - name >= MAX_SCENARIO_NAME) {
+            continue;
+        }
+        memset(&results[count], 0, sizeof(results[count]));
+        memcpy(results[count].name, name, name_end - name);
+        for (int i = 0; i < METRICS_COUNT; i++) {
+            results[count].present[i] = parse_metric(line, BENCH_METRICS[i].name, &results[count].values[i]);
+        }
+        count++;
+    }
+    fclose(file);
+    return count;
+}
+
+static const scenario_result_t *find_scenario(const scenario_result_t *results, int count, const char *name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(results[i].name, name) == 0) {
+            return &results[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < REQUIRED_ARGC) {
+        fprintf(stderr, "%s\n", USAGE_GUIDE);
+        return EXIT_FAILURE;
+    }
+    double threshold = DEFAULT_THRESHOLD_PERCENT;
+    if (argc > REQUIRED_ARGC) {
+        threshold = strtod(argv[3], NULL);
+    }
+    scenario_result_t baseline[MAX_SCENARIOS];
+    scenario_result_t current[MAX_SCENARIOS];
+    int baseline_count = load_results(argv[1], baseline);
+    int current_count = load_results(argv[2], current);
+    if (baseline_count == FAIL || current_count == FAIL) {
+        return EXIT_FAILURE;
+    }
+    int regressions = 0;
+    for (int s = 0; s < current_count; s++) {
+        const scenario_result_t *old = find_scenario(baseline, baseline_count, current[s].name);
+        if (old == NULL) {
+            printf("%-16s no baseline\n", current[s].name);
+            continue;
+        }
+        for (int i = 0; i < METRICS_COUNT; i++) {
+            if (!old->present[i]) {
+                printf("%-16s %-26s not in baseline\n", current[s].name, BENCH_METRICS[i].name);
+                continue;
+            }
+            double before = old->values[i];
+            double after = current[s].values[i];
+            double change_percent = 0;
+            if (before != 0) {
+                change_percent = (after - before) / before * 100.0;
+            } else if (after != 0) {
+                change_percent = after > 0 ? 100.0 : -100.0;
+            }
+            double worse_percent = BENCH_METRICS[i].higher_is_better ? -change_percent : change_percent;
+            bool regressed = worse_percent > threshold;
+            if (regressed) {
+                regressions++;
+            }
+            printf("%-16s %-26s %14.3f -> %14.3f %+8.1f%%%s\n", current[s].name, BENCH_METRICS[i].name,
+                   before, after, change_percent, regressed ? "  REGRESSION" : "");
+        }
+    }
+    if (regressions > 0) {
+        printf("%d regression(s) over %.1f%% threshold\n", regressions, threshold);
+        return EXIT_FAILURE;
+    }
+    printf("no regressions over %.1f%% threshold\n", threshold);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,759 @@
+#define _GNU_SOURCE // ppoll()
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "../socks_messages.h"
+#include "../trace.h"
+
+#define USAGE_GUIDE "usage: ./load_generator <scenario> <proxy_port> <target_port> <proxy_pid> <duration_sec>\n" \
+                    "                        [<trace_path>]\n" \
+                    "scenarios: connection_rate, small_rpc, bulk_stream, idle_tunnels, replay\n" \
+                    "replay plays a trace recorded by proxy -T, it listens on <target_port> as the target itself"
+#define REQUIRED_ARGC (5 + 1)
+#define LOOPBACK_ADDRESS "127.0.0.1"
+#define IO_TIMEOUT_SEC (5)
+#define CHOICE_LENGTH (2)
+#define IPV4_RESPONSE_LENGTH (10)
+#define RPC_SIZE (64)
+#define BULK_CHUNK_SIZE (16 * 1024)
+#define CONNECTION_RATE_THREADS (4)
+#define SMALL_RPC_THREADS (16)
+#define BULK_STREAM_THREADS (4)
+#define IDLE_TUNNELS_ACTIVE_THREADS (4)
+#define IDLE_TUNNELS_COUNT (200)
+#define REPLAY_THREADS (64)
+#define REPLAY_BUFFER_SIZE (64 * 1024)
+#define REPLAY_POLL_INTERVAL_NS (10 * 1000 * 1000ULL)
+#define INITIAL_SAMPLES_CAPACITY (1024)
+#define NS_PER_SEC (1000000000ULL)
+#define NS_PER_US (1000ULL)
+#define KIB (1024.0)
+#define MIB (1024.0 * 1024.0)
+
+typedef enum scenario_t {
+    CONNECTION_RATE,
+    SMALL_RPC,
+    BULK_STREAM,
+    IDLE_TUNNELS,
+    REPLAY
+} scenario_t;
+
+typedef struct worker_t {
+    pthread_t thread;
+    scenario_t scenario;
+    uint64_t *samples;
+    size_t samples_count;
+    size_t samples_capacity;
+    uint64_t ops;
+    uint64_t bytes;
+    uint64_t errors;
+} worker_t;
+
+/*
+ * One side of a replayed tunnel sends size bytes, as many as the proxy
+ * read from it at that moment of the trace. Size 0 closes the tunnel.
+ */
+typedef struct replay_step_t {
+    uint64_t at_ns; // since the trace was opened
+    uint32_t size;
+    uint8_t side;   // trace_side_t of who sends
+} replay_step_t;
+
+typedef struct replay_tunnel_t {
+    uint64_t start_ns;
+    bool requested; // tunnels that failed the handshake are not replayed
+    replay_step_t *steps;
+    size_t steps_count;
+} replay_tunnel_t;
+
+typedef struct proc_stats_t {
+    double cpu_sec;
+    long rss_kib;
+    unsigned long long rw_syscalls;
+} proc_stats_t;
+
+static int proxy_port;
+static int target_port;
+static bool stop_flag = false;
+/* the replay scenario */
+static replay_tunnel_t *replay_tunnels = NULL;
+static size_t replay_tunnels_count = 0;
+static size_t next_replay_tunnel = 0;
+static uint64_t replay_origin_ns = 0; // when the first tunnel of the trace is started again
+static int replay_running = 0;
+/* the replay is the target itself, the proxy connects to this socket */
+static int target_socket = FAIL;
+/* the next connection to the target belongs to the tunnel that holds it */
+static pthread_mutex_t pairing_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static bool should_stop() {
+    return __atomic_load_n(&stop_flag, __ATOMIC_RELAXED);
+}
+
+static void add_sample(worker_t *worker, uint64_t sample) {
+    if (worker->samples_count == worker->samples_capacity) {
+        size_t capacity = worker->samples_capacity == 0 ? INITIAL_SAMPLES_CAPACITY : worker->samples_capacity * 2;
+        uint64_t *temp = realloc(worker->samples, capacity * sizeof(*temp));
+        if (temp == NULL) {
+            return;
+        }
+        worker->samples = temp;
+        worker->samples_capacity = capacity;
+    }
+    worker->samples[worker->samples_count++] = sample;
+}
+
+static bool read_exact(int fd, char *buffer, size_t len) {
+    size_t offset = 0;
+    while (offset < len) {
+        ssize_t read_bytes = read(fd, buffer + offset, len - offset);
+        if (read_bytes == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes <= 0) {
+            return false;
+        }
+        offset += read_bytes;
+    }
+    return true;
+}
+
+static bool send_message_and_free(int fd, message_t *message) {
+    if (message == NULL) {
+        return false;
+    }
+    bool written = write_all(fd, message);
+    free(message->data);
+    free(message);
+    return written;
+}
+
+/*
+ * Opens a blocking socket to the proxy and makes a full SOCKS5 handshake
+ * to the target. Returns the tunnel descriptor or FAIL.
+ */
+static int open_tunnel(uint64_t *handshake_bytes) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == FAIL) {
+        return FAIL;
+    }
+    struct timeval timeout = {
+            .tv_sec = IO_TIMEOUT_SEC,
+            .tv_usec = 0
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in proxy_sockaddr;
+    memset(&proxy_sockaddr, 0, sizeof(proxy_sockaddr));
+    proxy_sockaddr.sin_family = AF_INET;
+    proxy_sockaddr.sin_port = htons(proxy_port);
+    inet_pton(AF_INET, LOOPBACK_ADDRESS, &proxy_sockaddr.sin_addr);
+    if (connect(fd, (struct sockaddr *) &proxy_sockaddr, sizeof(proxy_sockaddr)) == FAIL) {
+        close(fd);
+        return FAIL;
+    }
+    message_t *greeting = create_default_client_greeting_message();
+    size_t greeting_len = greeting == NULL ? 0 : greeting->len;
+    char choice[CHOICE_LENGTH];
+    if (!send_message_and_free(fd, greeting) || !read_exact(fd, choice, CHOICE_LENGTH)
+        || choice[1] != WITHOUT_AUTH) {
+        close(fd);
+        return FAIL;
+    }
+    conn_request_info_t request = {
+            .address_type = IPV4_TYPE,
+            .dest_port = target_port,
+            .command_code = 1,
+            .dest_address = LOOPBACK_ADDRESS
+    };
+    message_t *request_message = create_conn_request_message(&request);
+    size_t request_len = request_message == NULL ? 0 : request_message->len;
+    char response[IPV4_RESPONSE_LENGTH];
+    if (!send_message_and_free(fd, request_message) || !read_exact(fd, response, IPV4_RESPONSE_LENGTH)
+        || response[1] != 0) {
+        close(fd);
+        return FAIL;
+    }
+    *handshake_bytes += greeting_len + CHOICE_LENGTH + request_len + IPV4_RESPONSE_LENGTH;
+    return fd;
+}
+
+static void run_connection_rate(worker_t *worker) {
+    while (!should_stop()) {
+        uint64_t start = now_ns();
+        int fd = open_tunnel(&worker->bytes);
+        if (fd == FAIL) {
+            worker->errors++;
+            continue;
+        }
+        add_sample(worker, now_ns() - start);
+        worker->ops++;
+        close(fd);
+    }
+}
+
+/*
+ * Sends a chunk and waits for it to be echoed back, so every sample
+ * is a full round trip through the proxy in both directions.
+ */
+static void run_echo_loop(worker_t *worker, size_t chunk_size) {
+    int fd = open_tunnel(&worker->bytes);
+    if (fd == FAIL) {
+        worker->errors++;
+        return;
+    }
+    char *chunk = malloc(chunk_size);
+    char *reply = malloc(chunk_size);
+    if (chunk == NULL || reply == NULL) {
+        free(chunk);
+        free(reply);
+        close(fd);
+        worker->errors++;
+        return;
+    }
+    memset(chunk, 'x', chunk_size);
+    while (!should_stop()) {
+        message_t message = {
+                .data = chunk,
+                .len = chunk_size
+        };
+        uint64_t start = now_ns();
+        if (!write_all(fd, &message) || !read_exact(fd, reply, chunk_size)) {
+            worker->errors++;
+            break;
+        }
+        add_sample(worker, now_ns() - start);
+        worker->ops++;
+        worker->bytes += 2 * chunk_size;
+    }
+    free(chunk);
+    free(reply);
+    close(fd);
+}
+
+static uint64_t replay_time(uint64_t at_ns) {
+    return replay_origin_ns + (at_ns - replay_tunnels[0].start_ns);
+}
+
+static bool sleep_until(uint64_t until_ns) {
+    while (!should_stop()) {
+        uint64_t current = now_ns();
+        if (current >= until_ns) {
+            return true;
+        }
+        uint64_t wait_ns = until_ns - current < REPLAY_POLL_INTERVAL_NS ? until_ns - current : REPLAY_POLL_INTERVAL_NS;
+        struct timespec pause = {
+                .tv_sec = (time_t) (wait_ns / NS_PER_SEC),
+                .tv_nsec = (long) (wait_ns % NS_PER_SEC)
+        };
+        nanosleep(&pause, NULL);
+    }
+    return false;
+}
+
+/*
+ * Writes len bytes to fds[side] and waits until until_ns, whichever is
+ * longer. What the proxy sends to either side meanwhile is read and dropped.
+ */
+static bool exchange(worker_t *worker, const int fds[2], int side, size_t len, uint64_t until_ns, char *buffer) {
+    while (!should_stop()) {
+        // the payload does not matter, what was read last is sent
+        while (len > 0) {
+            ssize_t written = write(fds[side], buffer, len < REPLAY_BUFFER_SIZE ? len : REPLAY_BUFFER_SIZE);
+            if (written == FAIL && errno != EAGAIN) {
+                return false;
+            }
+            if (written <= 0) {
+                break;
+            }
+            len -= written;
+            worker->bytes += written;
+        }
+        uint64_t current = now_ns();
+        if (len == 0 && current >= until_ns) {
+            return true;
+        }
+        // the stop flag is checked even in a long pause
+        uint64_t wait_ns = until_ns > current ? until_ns - current : 0;
+        if (len > 0 || wait_ns > REPLAY_POLL_INTERVAL_NS) {
+            wait_ns = REPLAY_POLL_INTERVAL_NS;
+        }
+        struct timespec timeout = {
+                .tv_sec = (time_t) (wait_ns / NS_PER_SEC),
+                .tv_nsec = (long) (wait_ns % NS_PER_SEC)
+        };
+        struct pollfd polled[2] = {
+                {.fd = fds[TRACE_CLIENT], .events = POLLIN},
+                {.fd = fds[TRACE_UPSTREAM], .events = POLLIN}
+        };
+        if (len > 0) {
+            polled[side].events |= POLLOUT;
+        }
+        if (ppoll(polled, 2, &timeout, NULL) == FAIL) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        for (int i = 0; i < 2; i++) {
+            if (polled[i].revents & POLLIN) {
+                ssize_t read_bytes = read(fds[i], buffer, REPLAY_BUFFER_SIZE);
+                // only the replay closes a tunnel
+                if (read_bytes == 0 || (read_bytes == FAIL && errno != EAGAIN)) {
+                    return false;
+                }
+            } else if (polled[i].revents & (POLLERR | POLLHUP)) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+/*
+ * Opens the tunnel when it was accepted in the trace, and both of its
+ * sides send as much as the proxy read from them when it was read.
+ * Every sample is how late a step was started.
+ */
+static void replay_tunnel(worker_t *worker, const replay_tunnel_t *tunnel, char *buffer) {
+    uint64_t start = replay_time(tunnel->start_ns);
+    if (!sleep_until(start)) {
+        return;
+    }
+    add_sample(worker, now_ns() - start);
+    int fds[2];
+    pthread_mutex_lock(&pairing_lock);
+    fds[TRACE_CLIENT] = open_tunnel(&worker->bytes);
+    fds[TRACE_UPSTREAM] = fds[TRACE_CLIENT] == FAIL ? FAIL : accept(target_socket, NULL, NULL);
+    pthread_mutex_unlock(&pairing_lock);
+    if (fds[TRACE_UPSTREAM] == FAIL) {
+        if (fds[TRACE_CLIENT] != FAIL) {
+            close(fds[TRACE_CLIENT]);
+        }
+        worker->errors++;
+        return;
+    }
+    fcntl(fds[TRACE_CLIENT], F_SETFL, O_NONBLOCK);
+    fcntl(fds[TRACE_UPSTREAM], F_SETFL, O_NONBLOCK);
+    bool replayed = true;
+    int closing_side = TRACE_CLIENT;
+    for (size_t i = 0; i < tunnel->steps_count && replayed; i++) {
+        const replay_step_t *step = &tunnel->steps[i];
+        uint64_t at = replay_time(step->at_ns);
+        replayed = exchange(worker, fds, step->side, 0, at, buffer);
+        if (!replayed) {
+            break;
+        }
+        add_sample(worker, now_ns() - at);
+        if (step->size == 0) {
+            closing_side = step->side;
+            break;
+        }
+        replayed = exchange(worker, fds, step->side, step->size, 0, buffer);
+    }
+    close(fds[closing_side]);
+    close(fds[1 - closing_side]);
+    if (replayed) {
+        worker->ops++;
+    } else if (!should_stop()) {
+        worker->errors++;
+    }
+}
+
+static void run_replay(worker_t *worker) {
+    char *buffer = calloc(1, REPLAY_BUFFER_SIZE);
+    if (buffer == NULL) {
+        worker->errors++;
+    }
+    while (buffer != NULL && !should_stop()) {
+        size_t index = __atomic_fetch_add(&next_replay_tunnel, 1, __ATOMIC_RELAXED);
+        if (index >= replay_tunnels_count) {
+            break;
+        }
+        replay_tunnel(worker, &replay_tunnels[index], buffer);
+    }
+    free(buffer);
+    __atomic_sub_fetch(&replay_running, 1, __ATOMIC_RELAXED);
+}
+
+static void *run_worker(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    switch (worker->scenario) {
+        case CONNECTION_RATE:
+            run_connection_rate(worker);
+            break;
+        case SMALL_RPC:
+        case IDLE_TUNNELS:
+            run_echo_loop(worker, RPC_SIZE);
+            break;
+        case BULK_STREAM:
+            run_echo_loop(worker, BULK_CHUNK_SIZE);
+            break;
+        case REPLAY:
+            run_replay(worker);
+            break;
+    }
+    return NULL;
+}
+
+/*
+ * CPU time, resident memory and the number of read/write family
+ * syscalls of the proxy process, taken from procfs.
+ */
+static proc_stats_t read_proc_stats(int pid) {
+    proc_stats_t stats = {
+            .cpu_sec = 0,
+            .rss_kib = 0,
+            .rw_syscalls = 0
+    };
+    char path[64];
+    char line[256];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE *file = fopen(path, "r");
+    if (file != NULL) {
+        unsigned long utime = 0;
+        unsigned long stime = 0;
+        if (fgets(line, sizeof(line), file) != NULL) {
+            char *after_comm = strrchr(line, ')');
+            if (after_comm != NULL) {
+                sscanf(after_comm + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime);
+            }
+        }
+        stats.cpu_sec = (double) (utime + stime) / (double) sysconf(_SC_CLK_TCK);
+        fclose(file);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    file = fopen(path, "r");
+    if (file != NULL) {
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "VmRSS: %ld", &stats.rss_kib) == 1) {
+                break;
+            }
+        }
+        fclose(file);
+    }
+    snprintf(path, sizeof(path), "/proc/%d/io", pid);
+    file = fopen(path, "r");
+    if (file != NULL) {
+        unsigned long long value;
+        while (fgets(line, sizeof(line), file) != NULL) {
+            if (sscanf(line, "syscr: %llu", &value) == 1 || sscanf(line, "syscw: %llu", &value) == 1) {
+                stats.rw_syscalls += value;
+            }
+        }
+        fclose(file);
+    }
+    return stats;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t first = *(const uint64_t *) a;
+    uint64_t second = *(const uint64_t *) b;
+    return (first > second) - (first < second);
+}
+
+static double percentile_us(const uint64_t *samples, size_t count, double fraction) {
+    if (count == 0) {
+        return 0;
+    }
+    size_t idx = (size_t) (fraction * (double) (count - 1));
+    return (double) samples[idx] / NS_PER_US;
+}
+
+static bool add_step(replay_tunnel_t *tunnel, const trace_record_t *record, uint32_t size) {
+    if ((tunnel->steps_count & (tunnel->steps_count - 1)) == 0) {
+        // the count is a power of two, or zero, when the array is full
+        size_t capacity = tunnel->steps_count == 0 ? 4 : tunnel->steps_count * 2;
+        replay_step_t *temp = realloc(tunnel->steps, capacity * sizeof(*temp));
+        if (temp == NULL) {
+            return false;
+        }
+        tunnel->steps = temp;
+    }
+    replay_step_t *step = &tunnel->steps[tunnel->steps_count++];
+    step->at_ns = record->at_ns;
+    step->size = size;
+    step->side = record->side;
+    return true;
+}
+
+static int compare_tunnels(const void *a, const void *b) {
+    uint64_t first = ((const replay_tunnel_t *) a)->start_ns;
+    uint64_t second = ((const replay_tunnel_t *) b)->start_ns;
+    return (first > second) - (first < second);
+}
+
+static void free_replay_tunnels() {
+    for (size_t i = 0; i < replay_tunnels_count; i++) {
+        free(replay_tunnels[i].steps);
+    }
+    free(replay_tunnels);
+    replay_tunnels = NULL;
+    replay_tunnels_count = 0;
+}
+
+/*
+ * Takes the steps of every tunnel from a trace of proxy -T. What a client
+ * read before its request belongs to the handshake, which the replay does
+ * on its own. Tunnels are ordered by the time they were accepted.
+ * Fails without memory, a replay of a part of the trace would mislead.
+ */
+static int load_trace(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return FAIL;
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0
+        || header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t)) {
+        fclose(file);
+        return FAIL;
+    }
+    trace_record_t record;
+    bool failed = false;
+    while (!failed && fread(&record, sizeof(record), 1, file) == 1) {
+        if (record.tunnel >= replay_tunnels_count) {
+            // ids are given in turn, so the array grows a little at a time
+            size_t count = (size_t) record.tunnel + 1;
+            replay_tunnel_t *temp = realloc(replay_tunnels, count * sizeof(*temp));
+            if (temp == NULL) {
+                failed = true;
+                break;
+            }
+            memset(temp + replay_tunnels_count, 0, (count - replay_tunnels_count) * sizeof(*temp));
+            replay_tunnels = temp;
+            replay_tunnels_count = count;
+        }
+        replay_tunnel_t *tunnel = &replay_tunnels[record.tunnel];
+        if (record.event == TRACE_ACCEPT) {
+            tunnel->start_ns = record.at_ns;
+        } else if (record.event == TRACE_REQUEST) {
+            tunnel->requested = true;
+        } else if (record.event == TRACE_READ && tunnel->requested) {
+            failed = !add_step(tunnel, &record, record.value);
+        } else if (record.event == TRACE_CLOSE && tunnel->requested) {
+            failed = !add_step(tunnel, &record, 0);
+        }
+    }
+    failed = failed || ferror(file);
+    fclose(file);
+    if (failed) {
+        free_replay_tunnels();
+        return FAIL;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < replay_tunnels_count; i++) {
+        if (replay_tunnels[i].requested) {
+            replay_tunnels[kept++] = replay_tunnels[i];
+        } else {
+            free(replay_tunnels[i].steps);
+        }
+    }
+    replay_tunnels_count = kept;
+    qsort(replay_tunnels, replay_tunnels_count, sizeof(*replay_tunnels), compare_tunnels);
+    return SUCCESS;
+}
+
+/*
+ * The replay is the target: the proxy connects here, and the side of
+ * a tunnel that was upstream in the trace sends from here
+ */
+static int listen_as_target(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == FAIL) {
+        return FAIL;
+    }
+    int enable = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+    // a tunnel whose connect never comes fails instead of holding the pairing
+    struct timeval timeout = {
+            .tv_sec = IO_TIMEOUT_SEC,
+            .tv_usec = 0
+    };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    inet_pton(AF_INET, LOOPBACK_ADDRESS, &address.sin_addr);
+    if (bind(fd, (struct sockaddr *) &address, sizeof(address)) == FAIL || listen(fd, SOMAXCONN) == FAIL) {
+        close(fd);
+        return FAIL;
+    }
+    return fd;
+}
+
+/*
+ * The replay lasts as long as the trace, duration_sec at most
+ */
+static void wait_for_replay(int duration_sec) {
+    uint64_t deadline = now_ns() + (uint64_t) duration_sec * NS_PER_SEC;
+    struct timespec pause = {
+            .tv_sec = 0,
+            .tv_nsec = REPLAY_POLL_INTERVAL_NS
+    };
+    while (now_ns() < deadline && __atomic_load_n(&replay_running, __ATOMIC_RELAXED) > 0) {
+        nanosleep(&pause, NULL);
+    }
+}
+
+static bool parse_scenario(const char *name, scenario_t *scenario) {
+    static const char *names[] = {"connection_rate", "small_rpc", "bulk_stream", "idle_tunnels", "replay"};
+    for (int i = 0; i < (int) (sizeof(names) / sizeof(names[0])); i++) {
+        if (strcmp(name, names[i]) == 0) {
+            *scenario = (scenario_t) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int threads_for(scenario_t scenario) {
+    switch (scenario) {
+        case CONNECTION_RATE:
+            return CONNECTION_RATE_THREADS;
+        case SMALL_RPC:
+            return SMALL_RPC_THREADS;
+        case BULK_STREAM:
+            return BULK_STREAM_THREADS;
+        case IDLE_TUNNELS:
+            return IDLE_TUNNELS_ACTIVE_THREADS;
+        case REPLAY:
+            return REPLAY_THREADS;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    scenario_t scenario;
+    if (argc < REQUIRED_ARGC || !parse_scenario(argv[1], &scenario)
+        || (scenario == REPLAY && argc < REQUIRED_ARGC + 1)) {
+        fprintf(stderr, "%s\n", USAGE_GUIDE);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    proxy_port = atoi(argv[2]);
+    target_port = atoi(argv[3]);
+    int proxy_pid = atoi(argv[4]);
+    int duration_sec = atoi(argv[5]);
+    if (scenario == REPLAY) {
+        if (load_trace(argv[6]) == FAIL) {
+            fprintf(stderr, "[BENCH] Could not read the trace %s\n", argv[6]);
+            return EXIT_FAILURE;
+        }
+        target_socket = listen_as_target(target_port);
+        if (target_socket == FAIL) {
+            perror("[BENCH] Error in listening on the target port");
+            return EXIT_FAILURE;
+        }
+    }
+    uint64_t idle_handshake_bytes = 0;
+    int idle_fds[IDLE_TUNNELS_COUNT];
+    int idle_count = 0;
+    if (scenario == IDLE_TUNNELS) {
+        for (int i = 0; i < IDLE_TUNNELS_COUNT; i++) {
+            int fd = open_tunnel(&idle_handshake_bytes);
+            if (fd != FAIL) {
+                idle_fds[idle_count++] = fd;
+            }
+        }
+    }
+    int threads_count = threads_for(scenario);
+    worker_t *workers = calloc(threads_count, sizeof(*workers));
+    if (workers == NULL) {
+        perror("[BENCH] Error in calloc");
+        return EXIT_FAILURE;
+    }
+    proc_stats_t before = read_proc_stats(proxy_pid);
+    uint64_t start = now_ns();
+    replay_origin_ns = start;
+    replay_running = threads_count;
+    for (int i = 0; i < threads_count; i++) {
+        workers[i].scenario = scenario;
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+    if (scenario == REPLAY) {
+        wait_for_replay(duration_sec);
+    } else {
+        sleep(duration_sec);
+    }
+    __atomic_store_n(&stop_flag, true, __ATOMIC_RELAXED);
+    size_t total_samples = 0;
+    uint64_t ops = 0;
+    uint64_t bytes = 0;
+    uint64_t errors = (uint64_t) (IDLE_TUNNELS_COUNT - idle_count) * (scenario == IDLE_TUNNELS);
+    for (int i = 0; i < threads_count; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total_samples += workers[i].samples_count;
+        ops += workers[i].ops;
+        bytes += workers[i].bytes;
+        errors += workers[i].errors;
+    }
+    double elapsed_sec = (double) (now_ns() - start) / NS_PER_SEC;
+    proc_stats_t after = read_proc_stats(proxy_pid);
+    for (int i = 0; i < idle_count; i++) {
+        close(idle_fds[i]);
+    }
+    if (target_socket != FAIL) {
+        close(target_socket);
+    }
+    for (size_t i = 0; i < replay_tunnels_count; i++) {
+        free(replay_tunnels[i].steps);
+    }
+    free(replay_tunnels);
+    uint64_t *samples = malloc((total_samples + 1) * sizeof(*samples));
+    size_t offset = 0;
+    for (int i = 0; i < threads_count; i++) {
+        if (samples != NULL) {
+            memcpy(samples + offset, workers[i].samples, workers[i].samples_count * sizeof(*samples));
+            offset += workers[i].samples_count;
+        }
+        free(workers[i].samples);
+    }
+    free(workers);
+    if (samples == NULL) {
+        total_samples = 0;
+    }
+    qsort(samples, total_samples, sizeof(*samples), compare_samples);
+    double kib = (double) bytes / KIB;
+    double values[METRICS_COUNT] = {
+            (double) ops / elapsed_sec,
+            (double) bytes / MIB / elapsed_sec,
+            percentile_us(samples, total_samples, 0.50),
+            percentile_us(samples, total_samples, 0.90),
+            percentile_us(samples, total_samples, 0.99),
+            percentile_us(samples, total_samples, 0.999),
+            after.cpu_sec - before.cpu_sec,
+            (double) after.rss_kib,
+            kib > 0 ? (double) (after.rw_syscalls - before.rw_syscalls) / kib : 0,
+            (double) errors
+    };
+    free(samples);
+    printf("{\"scenario\": \"%s\"", argv[1]);
+    for (int i = 0; i < METRICS_COUNT; i++) {
+        printf(", \"%s\": %.3f", BENCH_METRICS[i].name, values[i]);
+    }
+    printf("}\n");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Brings up the proxy and an echo target on loopback, runs the fixed
+# scenario matrix through the load generator and writes the results as JSON.
+# If a baseline file is given and exists, results are compared against it.
+#
+# usage: run_bench.sh <bin_dir> <results.json> [baseline.json]
+# environment: BENCH_DURATION (seconds per scenario), BENCH_PROXY_PORT,
+#              BENCH_TARGET_PORT, BENCH_THRESHOLD (percent)
+
+BIN_DIR=$1
+RESULTS=$2
+BASELINE=$3
+DURATION=${BENCH_DURATION:-5}
+PROXY_PORT=${BENCH_PROXY_PORT:-15080}
+TARGET_PORT=${BENCH_TARGET_PORT:-15010}
+THRESHOLD=${BENCH_THRESHOLD:-10}
+SCENARIOS="connection_rate small_rpc bulk_stream idle_tunnels"
+
+if [ -z "$BIN_DIR" ] || [ -z "$RESULTS" ]; then
+    echo "usage: run_bench.sh <bin_dir> <results.json> [baseline.json]" >&2
+    exit 1
+fi
+
+"$BIN_DIR/bench/bench_target" "$TARGET_PORT" &
+TARGET_PID=$!
+"$BIN_DIR/proxy" "$PROXY_PORT" > /dev/null &
+PROXY_PID=$!
+trap 'kill -KILL $PROXY_PID $TARGET_PID 2> /dev/null' EXIT
+sleep 1
+if ! kill -0 $PROXY_PID 2> /dev/null || ! kill -0 $TARGET_PID 2> /dev/null; then
+    echo "[BENCH] Failed to start the proxy or the target" >&2
+    exit 1
+fi
+
+echo '{"results": [' > "$RESULTS"
+SEPARATOR=""
+for SCENARIO in $SCENARIOS; do
+    echo "[BENCH] Running $SCENARIO for ${DURATION}s..." >&2
+    LINE=$("$BIN_DIR/bench/load_generator" "$SCENARIO" "$PROXY_PORT" "$TARGET_PORT" "$PROXY_PID" "$DURATION")
+    if [ -z "$LINE" ]; then
+        echo "[BENCH] $SCENARIO produced no result" >&2
+        exit 1
+    fi
+    printf '%s%s' "$SEPARATOR" "$LINE" >> "$RESULTS"
+    SEPARATOR=$',\n'
+done
+printf '\n]}\n' >> "$RESULTS"
+echo "[BENCH] Results written to $RESULTS" >&2
+
+if [ -n "$BASELINE" ] && [ -f "$BASELINE" ]; then
+    "$BIN_DIR/bench/bench_compare" "$BASELINE" "$RESULTS" "$THRESHOLD"
+    exit $?
+fi
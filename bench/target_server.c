@@ -0,0 +1,103 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "../io_operations.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define MAX_PENDING_CONNECTIONS (1024)
+#define ECHO_BUFFER_SIZE (64 * 1024)
+#define THREAD_STACK_SIZE (64 * 1024)
+
+/*
+ * Target for the benchmark: echoes everything it receives.
+ * Unlike server.c it never prints or transforms the payload,
+ * so it does not become the bottleneck of a measurement.
+ */
+static void *serve_connection(void *arg) {
+    int fd = (int) (long) arg;
+    char buffer[ECHO_BUFFER_SIZE];
+    while (true) {
+        ssize_t read_bytes = read(fd, buffer, sizeof(buffer));
+        if (read_bytes == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (read_bytes <= 0) {
+            break;
+        }
+        message_t reply = {
+                .data = buffer,
+                .len = (size_t) read_bytes
+        };
+        if (!write_all(fd, &reply)) {
+            break;
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: ./bench_target <port> [<ipv4>]\n");
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    int port = atoi(argv[1]);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == FAIL) {
+        perror("[TARGET] Error in socket");
+        return EXIT_FAILURE;
+    }
+    int option_value = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &option_value, sizeof(option_value));
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (argc > 2 && inet_pton(AF_INET, argv[2], &address.sin_addr) != 1) {
+        fprintf(stderr, "[TARGET] Wrong address %s\n", argv[2]);
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+    if (bind(listen_fd, (struct sockaddr *) &address, sizeof(address)) == FAIL) {
+        perror("[TARGET] Error in bind");
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+    if (listen(listen_fd, MAX_PENDING_CONNECTIONS) == FAIL) {
+        perror("[TARGET] Error in listen");
+        close(listen_fd);
+        return EXIT_FAILURE;
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE + ECHO_BUFFER_SIZE);
+    while (true) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd == FAIL) {
+            if (errno == EINTR || errno == ECONNABORTED || errno == EMFILE) {
+                continue;
+            }
+            perror("[TARGET] Error in accept");
+            break;
+        }
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, serve_connection, (void *) (long) fd) != SUCCESS) {
+            close(fd);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    close(listen_fd);
+    return EXIT_FAILURE;
+}
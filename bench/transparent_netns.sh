@@ -0,0 +1,97 @@
+#!/bin/bash
+# Checks the transparent listeners in network namespaces: a client routes
+# through the proxy namespace, where iptables hands its connections to the
+# proxy with REDIRECT and with TPROXY, and the proxy relays them to an echo
+# target. A client that connects to a listener directly must be refused.
+#
+# usage: transparent_netns.sh <bin_dir>
+# needs root, ip and iptables, exits with 77 (skipped) without them
+
+BIN_DIR=$1
+REDIRECT_PORT=15012
+REDIRECT_LISTENER=15090
+TPROXY_PORT=15011 # the listener has the port of the target, as in a proxy of port 80
+PREFIX=pxtest$$
+
+if [ -z "$BIN_DIR" ]; then
+    echo "usage: transparent_netns.sh <bin_dir>" >&2
+    exit 1
+fi
+if [ "$(id -u)" != 0 ] || ! command -v ip > /dev/null || ! command -v iptables > /dev/null; then
+    echo "[NETNS] Skipped: needs root, ip and iptables" >&2
+    exit 77
+fi
+
+CLIENT=${PREFIX}c
+PROXY=${PREFIX}p
+TARGET=${PREFIX}t
+PIDS=""
+cleanup() {
+    [ -n "$PIDS" ] && kill -KILL $PIDS 2> /dev/null
+    ip netns delete $CLIENT 2> /dev/null
+    ip netns delete $PROXY 2> /dev/null
+    ip netns delete $TARGET 2> /dev/null
+}
+trap cleanup EXIT
+set -e
+
+ip netns add $CLIENT
+ip netns add $PROXY
+ip netns add $TARGET
+ip link add ${PREFIX}a type veth peer name ${PREFIX}b
+ip link add ${PREFIX}x type veth peer name ${PREFIX}y
+ip link set ${PREFIX}a netns $CLIENT
+ip link set ${PREFIX}b netns $PROXY
+ip link set ${PREFIX}x netns $PROXY
+ip link set ${PREFIX}y netns $TARGET
+
+ip -n $CLIENT addr add 10.99.0.2/24 dev ${PREFIX}a
+ip -n $CLIENT link set ${PREFIX}a up
+ip -n $CLIENT link set lo up
+ip -n $CLIENT route add default via 10.99.0.1
+ip -n $PROXY addr add 10.99.0.1/24 dev ${PREFIX}b
+ip -n $PROXY addr add 10.99.2.254/24 dev ${PREFIX}x
+ip -n $PROXY link set ${PREFIX}b up
+ip -n $PROXY link set ${PREFIX}x up
+ip -n $PROXY link set lo up
+ip netns exec $PROXY sysctl -q -w net.ipv4.ip_forward=1
+ip -n $TARGET addr add 10.99.2.1/24 dev ${PREFIX}y
+ip -n $TARGET link set ${PREFIX}y up
+ip -n $TARGET link set lo up
+ip -n $TARGET route add default via 10.99.2.254
+
+ip netns exec $PROXY iptables -t nat -A PREROUTING -i ${PREFIX}b -p tcp --dport $REDIRECT_PORT \
+    -j REDIRECT --to-ports $REDIRECT_LISTENER
+ip netns exec $PROXY iptables -t mangle -A PREROUTING -i ${PREFIX}b -p tcp --dport $TPROXY_PORT \
+    -j TPROXY --on-port $TPROXY_PORT --tproxy-mark 0x1/0x1
+ip -n $PROXY rule add fwmark 1 lookup 100
+ip -n $PROXY route add local 0.0.0.0/0 dev lo table 100
+
+ip netns exec $TARGET "$BIN_DIR/bench/bench_target" $REDIRECT_PORT 10.99.2.1 &
+PIDS="$PIDS $!"
+ip netns exec $TARGET "$BIN_DIR/bench/bench_target" $TPROXY_PORT 10.99.2.1 &
+PIDS="$PIDS $!"
+ip netns exec $PROXY "$BIN_DIR/proxy" -L transparent:$REDIRECT_LISTENER -L transparent:$TPROXY_PORT > /dev/null &
+PIDS="$PIDS $!"
+set +e
+sleep 1
+
+# prints the echo of a line sent to <address> <port> from the client, nothing if it is closed
+echo_through() {
+    ip netns exec $CLIENT timeout 5 bash -c \
+        "exec 3<> /dev/tcp/$1/$2 && echo ping-$2 >&3 && head -n 1 <&3" 2> /dev/null
+}
+
+STATUS=0
+check() {
+    if [ "$2" = "$3" ]; then
+        echo "[NETNS] $1: ok" >&2
+    else
+        echo "[NETNS] $1: expected '$3', got '$2'" >&2
+        STATUS=1
+    fi
+}
+check "REDIRECT relays" "$(echo_through 10.99.2.1 $REDIRECT_PORT)" "ping-$REDIRECT_PORT"
+check "TPROXY relays" "$(echo_through 10.99.2.1 $TPROXY_PORT)" "ping-$TPROXY_PORT"
+check "direct connection is refused" "$(echo_through 10.99.0.1 $REDIRECT_LISTENER)" ""
+exit $STATUS
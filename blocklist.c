@@ -0,0 +1,144 @@
+#include "blocklist.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define FNV_OFFSET_BASIS (0xCBF29CE484222325ULL)
+#define FNV_PRIME (0x100000001B3ULL)
+#define MAX_SUFFIXES ((BLOCKLIST_MAX_NAME + 1) / 2) // of single letter labels
+
+uint64_t blocklist_hash(const char *name, size_t len) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t) name[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+/*
+ * The lower half of the hash scaled to the table, the upper half is the tag
+ */
+uint32_t blocklist_slot_of(uint64_t hash, uint32_t slots_count) {
+    return (uint32_t) (((hash & UINT32_MAX) * slots_count) >> 32);
+}
+
+static bool find(const blocklist_t *blocklist, const char *name, size_t len, uint64_t hash) {
+    uint32_t slots_count = blocklist->header->slots_count;
+    uint64_t names_size = blocklist->header->names_size;
+    uint32_t tag = (uint32_t) (hash >> 32);
+    uint32_t slot = blocklist_slot_of(hash, slots_count);
+    while (blocklist->slots[slot].offset != 0) {
+        const blocklist_slot_t *entry = &blocklist->slots[slot];
+        // a broken file must not make us read past the names
+        if (entry->tag == tag && entry->offset + 1 + (uint64_t) len <= names_size) {
+            const uint8_t *stored = blocklist->names + entry->offset;
+            if (stored[0] == len && memcmp(stored + 1, name, len) == 0) {
+                return true;
+            }
+        }
+        slot = slot + 1 == slots_count ? 0 : slot + 1;
+    }
+    return false;
+}
+
+/*
+ * Every name of a slot must be among the names, and a probe ends only
+ * at an empty slot, so there must be one
+ */
+static bool slots_valid(const blocklist_slot_t *slots, uint32_t slots_count, uint64_t names_size) {
+    bool has_empty = false;
+    for (uint32_t i = 0; i < slots_count; i++) {
+        if (slots[i].offset >= names_size) {
+            return false;
+        }
+        has_empty = has_empty || slots[i].offset == 0;
+    }
+    return has_empty;
+}
+
+int blocklist_open(blocklist_t *blocklist, const char *path) {
+    memset(blocklist, 0, sizeof(*blocklist));
+    int fd = open(path, O_RDONLY);
+    if (fd == FAIL) {
+        return FAIL;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == FAIL || (size_t) file_stat.st_size < sizeof(blocklist_header_t)) {
+        close(fd);
+        return FAIL;
+    }
+    size_t size = (size_t) file_stat.st_size;
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return FAIL;
+    }
+    const blocklist_header_t *header = (const blocklist_header_t *) mapped;
+    size_t slots_size = (size_t) header->slots_count * sizeof(blocklist_slot_t);
+    // the sizes are compared before they are added, so a broken header cannot wrap them around
+    if (memcmp(header->magic, BLOCKLIST_MAGIC, sizeof(header->magic)) != 0 || header->version != BLOCKLIST_VERSION
+        || header->slots_count <= header->names_count || slots_size > size - sizeof(*header)
+        || header->names_size != size - sizeof(*header) - slots_size
+        || !slots_valid((const blocklist_slot_t *) (header + 1), header->slots_count, header->names_size)) {
+        munmap(mapped, size);
+        return FAIL;
+    }
+    // probes jump around the table, reading ahead would only evict it
+    madvise(mapped, size, MADV_RANDOM);
+    blocklist->header = header;
+    blocklist->slots = (const blocklist_slot_t *) (header + 1);
+    blocklist->names = (const uint8_t *) blocklist->slots + slots_size;
+    blocklist->mapped_size = size;
+    return SUCCESS;
+}
+
+bool blocklist_contains(const blocklist_t *blocklist, const char *host) {
+    size_t len = strlen(host);
+    if (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+    // a name the builder would not take cannot be checked, it is blocked
+    if (len == 0 || len > BLOCKLIST_MAX_NAME) {
+        return true;
+    }
+    char name[BLOCKLIST_MAX_NAME];
+    for (size_t i = 0; i < len; i++) {
+        name[i] = (char) tolower((unsigned char) host[i]);
+        if (name[i] == '.' && (i == 0 || i == len - 1 || name[i - 1] == '.')) {
+            return true;
+        }
+    }
+    // the host and every suffix after a dot, without empty labels there are MAX_SUFFIXES at most
+    size_t starts[MAX_SUFFIXES];
+    uint64_t hashes[MAX_SUFFIXES];
+    int count = 0;
+    for (size_t start = 0; start < len; start++) {
+        if (start == 0 || name[start - 1] == '.') {
+            starts[count] = start;
+            hashes[count] = blocklist_hash(name + start, len - start);
+            // the probes miss the cache, so they are all started before the first one waits
+            __builtin_prefetch(&blocklist->slots[blocklist_slot_of(hashes[count], blocklist->header->slots_count)]);
+            count++;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (find(blocklist, name + starts[i], len - starts[i], hashes[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void blocklist_close(blocklist_t *blocklist) {
+    if (blocklist->mapped_size != 0) {
+        munmap((void *) blocklist->header, blocklist->mapped_size);
+    }
+    memset(blocklist, 0, sizeof(*blocklist));
+}
@@ -0,0 +1,64 @@
+#ifndef PROXY_SERVER_BLOCKLIST_H
+#define PROXY_SERVER_BLOCKLIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Domains blocked with all their subdomains. The file is built offline
+ * by blocklist_builder and mapped read only, so it is loaded without
+ * parsing, only its slots are checked, and it is shared by the workers. It is a hash table of the blocked names:
+ * a host is looked up once for itself and once for every suffix that
+ * starts after a dot, "a.example.com" is blocked by "example.com".
+ *
+ * The file is a blocklist_header_t, slots_count blocklist_slot_t and
+ * names_size bytes of names, each a length byte and the name in lower
+ * case. A slot keeps a tag of the hash of its name, so a probe reads a
+ * name only when the tags are equal. Names covered by a shorter blocked
+ * suffix are left out by the builder.
+ */
+
+#define BLOCKLIST_MAGIC "PXBL"
+#define BLOCKLIST_VERSION (1)
+#define BLOCKLIST_MAX_NAME (253)
+
+typedef struct blocklist_header_t {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t names_count;
+    uint32_t slots_count; // more than names_count, so every probe ends at an empty slot
+    uint64_t names_size;
+} blocklist_header_t;
+
+typedef struct blocklist_slot_t {
+    uint32_t tag;    // the upper half of the hash
+    uint32_t offset; // of the name among the names, 0 for an empty slot
+} blocklist_slot_t;
+
+typedef struct blocklist_t {
+    const blocklist_header_t *header;
+    const blocklist_slot_t *slots;
+    const uint8_t *names;
+    size_t mapped_size; // 0 if the table is not mapped from a file
+} blocklist_t;
+
+uint64_t blocklist_hash(const char *name, size_t len);
+
+uint32_t blocklist_slot_of(uint64_t hash, uint32_t slots_count);
+
+/*
+ * Returns FAIL if the file cannot be mapped or is not a blocklist
+ */
+int blocklist_open(blocklist_t *blocklist, const char *path);
+
+/*
+ * host is a name in any case, it may end with a dot. A host that is
+ * longer than BLOCKLIST_MAX_NAME or has an empty label is blocked.
+ */
+bool blocklist_contains(const blocklist_t *blocklist, const char *host);
+
+void blocklist_close(blocklist_t *blocklist);
+
+#endif //PROXY_SERVER_BLOCKLIST_H
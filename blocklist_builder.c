@@ -0,0 +1,246 @@
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "blocklist.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define USAGE_GUIDE "usage: ./blocklist_builder <names_path> <blocklist_path>\n" \
+                    "a line of the names is a domain, or an address and a domain as in a hosts file"
+#define MAX_LINE (1024)
+#define SEPARATORS " \t\r\n"
+#define INITIAL_CAPACITY (1024)
+/* the table has this many slots per 100 names */
+#define SLOTS_PERCENT (150)
+#define TEMPORARY_SUFFIX ".tmp"
+
+typedef struct name_t {
+    size_t offset; // in the text
+    uint8_t len;
+    uint8_t labels;
+} name_t;
+
+typedef struct names_t {
+    char *text;
+    size_t text_size;
+    size_t text_capacity;
+    name_t *names;
+    size_t count;
+    size_t capacity;
+} names_t;
+
+static bool grow(void **array, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity == 0 ? INITIAL_CAPACITY : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(*array, new_capacity * item_size);
+    if (grown == NULL) {
+        return false;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+/*
+ * Lower case, no trailing dot, no empty labels
+ */
+static int normalize(char *name, size_t *len, uint8_t *labels) {
+    *len = strlen(name);
+    if (*len > 0 && name[*len - 1] == '.') {
+        (*len)--;
+    }
+    if (*len == 0 || *len > BLOCKLIST_MAX_NAME) {
+        return FAIL;
+    }
+    *labels = 1;
+    for (size_t i = 0; i < *len; i++) {
+        unsigned char c = (unsigned char) name[i];
+        if (c == '.') {
+            if (i == 0 || name[i - 1] == '.') {
+                return FAIL;
+            }
+            (*labels)++;
+        } else if (!isalnum(c) && c != '-' && c != '_') {
+            return FAIL;
+        }
+        name[i] = (char) tolower(c);
+    }
+    return SUCCESS;
+}
+
+static int read_names(const char *path, names_t *names, size_t *skipped) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return FAIL;
+    }
+    char line[MAX_LINE];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        char *comment = strchr(line, '#');
+        if (comment != NULL) {
+            *comment = '\0';
+        }
+        char *position = NULL;
+        char *name = strtok_r(line, SEPARATORS, &position);
+        char *second = name == NULL ? NULL : strtok_r(NULL, SEPARATORS, &position);
+        if (name == NULL) {
+            continue;
+        }
+        if (second != NULL) {
+            name = second;
+        }
+        size_t len;
+        uint8_t labels;
+        if (normalize(name, &len, &labels) == FAIL) {
+            (*skipped)++;
+            continue;
+        }
+        if (!grow((void **) &names->text, &names->text_capacity, names->text_size + len, 1)
+            || !grow((void **) &names->names, &names->capacity, names->count + 1, sizeof(name_t))) {
+            fclose(file);
+            return FAIL;
+        }
+        memcpy(names->text + names->text_size, name, len);
+        name_t *entry = &names->names[names->count++];
+        entry->offset = names->text_size;
+        entry->len = (uint8_t) len;
+        entry->labels = labels;
+        names->text_size += len;
+    }
+    bool failed = ferror(file);
+    fclose(file);
+    return failed ? FAIL : SUCCESS;
+}
+
+static int compare_labels(const void *a, const void *b) {
+    const name_t *first = (const name_t *) a;
+    const name_t *second = (const name_t *) b;
+    return (int) first->labels - (int) second->labels;
+}
+
+/*
+ * Names with fewer labels go in first, so a name already blocked by
+ * one of its suffixes, or given twice, is found and left out
+ */
+static int build_table(names_t *names, blocklist_header_t *header, blocklist_slot_t **slots, uint8_t **table_names,
+                       size_t *kept) {
+    qsort(names->names, names->count, sizeof(name_t), compare_labels);
+    uint64_t slots_count = (uint64_t) names->count * SLOTS_PERCENT / 100 + 1;
+    if (slots_count > UINT32_MAX) {
+        return FAIL;
+    }
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, BLOCKLIST_MAGIC, sizeof(header->magic));
+    header->version = BLOCKLIST_VERSION;
+    header->slots_count = (uint32_t) slots_count;
+    // offset 0 marks an empty slot, so the names start at 1
+    size_t capacity = 0;
+    header->names_size = 1;
+    *slots = (blocklist_slot_t *) calloc(slots_count, sizeof(blocklist_slot_t));
+    if (*slots == NULL || !grow((void **) table_names, &capacity, 1, 1)) {
+        return FAIL;
+    }
+    (*table_names)[0] = 0;
+    blocklist_t table = {.header = header, .slots = *slots, .names = *table_names, .mapped_size = 0};
+    for (size_t i = 0; i < names->count; i++) {
+        const name_t *name = &names->names[i];
+        table.names = *table_names;
+        const char *text = names->text + name->offset;
+        char host[BLOCKLIST_MAX_NAME + 1];
+        memcpy(host, text, name->len);
+        host[name->len] = '\0';
+        if (blocklist_contains(&table, host)) {
+            continue;
+        }
+        if (header->names_size + 1 + name->len > UINT32_MAX
+            || !grow((void **) table_names, &capacity, header->names_size + 1 + name->len, 1)) {
+            return FAIL;
+        }
+        uint32_t offset = (uint32_t) header->names_size;
+        (*table_names)[offset] = name->len;
+        memcpy(*table_names + offset + 1, text, name->len);
+        header->names_size += 1 + name->len;
+        uint64_t hash = blocklist_hash(text, name->len);
+        uint32_t slot = blocklist_slot_of(hash, header->slots_count);
+        while ((*slots)[slot].offset != 0) {
+            slot = slot + 1 == header->slots_count ? 0 : slot + 1;
+        }
+        (*slots)[slot].tag = (uint32_t) (hash >> 32);
+        (*slots)[slot].offset = offset;
+        header->names_count++;
+    }
+    *kept = header->names_count;
+    return SUCCESS;
+}
+
+/*
+ * A running proxy maps the blocklist, truncating it in place would fault
+ * its lookups. The table is written aside and renamed over the old one,
+ * the proxy keeps the old file until it maps the new one.
+ */
+static int write_table(const char *path, const blocklist_header_t *header, const blocklist_slot_t *slots,
+                       const uint8_t *table_names) {
+    char temporary_path[PATH_MAX];
+    if (snprintf(temporary_path, sizeof(temporary_path), "%s%s", path, TEMPORARY_SUFFIX)
+        >= (int) sizeof(temporary_path)) {
+        errno = ENAMETOOLONG;
+        return FAIL;
+    }
+    FILE *file = fopen(temporary_path, "wb");
+    if (file == NULL) {
+        return FAIL;
+    }
+    bool written = fwrite(header, sizeof(*header), 1, file) == 1
+                   && fwrite(slots, sizeof(blocklist_slot_t), header->slots_count, file) == header->slots_count
+                   && fwrite(table_names, 1, header->names_size, file) == header->names_size
+                   && fflush(file) == SUCCESS && fsync(fileno(file)) == SUCCESS;
+    if (fclose(file) != SUCCESS || !written || rename(temporary_path, path) == FAIL) {
+        int error_code = errno;
+        unlink(temporary_path);
+        errno = error_code;
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "%s\n", USAGE_GUIDE);
+        return EXIT_FAILURE;
+    }
+    names_t names;
+    memset(&names, 0, sizeof(names));
+    size_t skipped = 0;
+    if (read_names(argv[1], &names, &skipped) == FAIL) {
+        perror("[BLOCKLIST] Error in reading the names");
+        return EXIT_FAILURE;
+    }
+    blocklist_header_t header;
+    blocklist_slot_t *slots = NULL;
+    uint8_t *table_names = NULL;
+    size_t kept = 0;
+    int return_value = build_table(&names, &header, &slots, &table_names, &kept);
+    if (return_value == FAIL) {
+        fprintf(stderr, "[BLOCKLIST] Too many names\n");
+    } else if ((return_value = write_table(argv[2], &header, slots, table_names)) == FAIL) {
+        perror("[BLOCKLIST] Error in writing the blocklist");
+    } else {
+        size_t size = sizeof(header) + header.slots_count * sizeof(blocklist_slot_t) + header.names_size;
+        printf("[BLOCKLIST] %zu names read, %zu skipped as invalid, %zu kept, %zu bytes\n",
+               names.count, skipped, kept, size);
+    }
+    free(names.text);
+    free(names.names);
+    free(slots);
+    free(table_names);
+    return return_value == FAIL ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,6 +3,8 @@ clang -Wall -pedantic -fsanitize=address server.c socket_operations.c io_operati
 echo "Program server compiled successfully"
 clang -Wall -pedantic -fsanitize=address client.c socket_operations.c io_operations.c socks_messages.c -o build/client
 echo "Program client compiled successfully"
-clang -Wall -pedantic -fsanitize=address socks_proxy.c socket_operations.c io_operations.c socks_messages.c -o build/proxy
+clang -Wall -pedantic -fsanitize=address -pthread socks_proxy.c socket_operations.c io_operations.c socks_messages.c logger.c access_log.c hot_restart.c rate_limit.c shaper.c timer_heap.c relay_buffer.c egress_pool.c memory_budget.c cpu_affinity.c listener.c http_connect.c task_pool.c handoff_queue.c trace.c overload.c tenants.c acl.c blocklist.c routes.c -o build/proxy
 echo "Program proxy compiled successfully"
+clang -Wall -pedantic -fsanitize=address blocklist_builder.c blocklist.c -o build/blocklist_builder
+echo "Program blocklist_builder compiled successfully"
 
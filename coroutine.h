@@ -0,0 +1,64 @@
+#ifndef PROXY_SERVER_COROUTINE_H
+#define PROXY_SERVER_COROUTINE_H
+
+#include <stdint.h>
+
+/*
+ * Stackless coroutines in the style of protothreads. A handler is one
+ * function that the event loop calls again on every event it waits for,
+ * the switch jumps back to the line where it stopped. Locals are not kept
+ * across a wait, what must survive one lives in the frame of the
+ * connection. There may be only one wait on a line and no switch of the
+ * handler's own around a wait.
+ */
+
+/*
+ * What the loop wakes a waiting handler on. A wait with a deadline also
+ * ends when the deadline passes.
+ */
+typedef enum co_wait_t {
+    CO_WAIT_NONE,
+    CO_WAIT_READ, // the next message of the connection
+    CO_WAIT_TASK, // a task given to the task pool
+    CO_WAIT_TIMER // only the deadline
+} co_wait_t;
+
+typedef enum co_status_t {
+    CO_PENDING, // waits, called again by the loop
+    CO_DONE,
+    CO_FAILED
+} co_status_t;
+
+typedef struct coroutine_t {
+    uint64_t deadline_ns; // 0 if no wait may last longer than it
+    uint16_t line;        // where to continue, 0 before the first call
+    uint8_t waiting;      // co_wait_t
+} coroutine_t;
+
+#define CO_FINISHED_LINE (UINT16_MAX)
+
+#define CO_BEGIN(co) switch ((co)->line) { case 0:
+
+/*
+ * Returns to the loop, the next call continues right after the wait
+ */
+#define CO_AWAIT(co, what) do { \
+    (co)->waiting = (what); \
+    (co)->line = __LINE__; \
+    return CO_PENDING; \
+    case __LINE__: \
+    (co)->waiting = CO_WAIT_NONE; \
+} while (0)
+
+#define CO_RETURN(co, status) do { \
+    (co)->waiting = CO_WAIT_NONE; \
+    (co)->line = CO_FINISHED_LINE; \
+    return (status); \
+} while (0)
+
+#define CO_END(co) default: break; } \
+    (co)->waiting = CO_WAIT_NONE; \
+    (co)->line = CO_FINISHED_LINE; \
+    return CO_FAILED
+
+#endif //PROXY_SERVER_COROUTINE_H
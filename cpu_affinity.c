@@ -0,0 +1,72 @@
+#define _GNU_SOURCE
+
+#include "cpu_affinity.h"
+
+#include <linux/filter.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU (49)
+#endif
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF (51)
+#endif
+
+int parse_cpu_list(const char *list, int *cpus, int max_count) {
+    int count = 0;
+    const char *start = list;
+    while (true) {
+        char *end = NULL;
+        long cpu = strtol(start, &end, 10);
+        if (end == start || cpu < 0 || cpu >= CPU_SETSIZE || count == max_count) {
+            return FAIL;
+        }
+        cpus[count++] = (int) cpu;
+        if (*end == '\0') {
+            return count;
+        }
+        if (*end != ',') {
+            return FAIL;
+        }
+        start = end + 1;
+    }
+}
+
+int pin_current_thread(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    // 0 is the calling thread
+    return sched_setaffinity(0, sizeof(set), &set);
+}
+
+int steer_by_incoming_cpu(int listen_socket, int cpu) {
+    return setsockopt(listen_socket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+}
+
+int steer_by_bpf(int listen_socket, const int *cpus, int count) {
+    // load the CPU, one comparison and return per listed CPU, anything else by modulo
+    struct sock_filter code[2 * MAX_WORKERS + 3];
+    int len = 0;
+    if (count <= 0 || count > MAX_WORKERS) {
+        return FAIL;
+    }
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < count; i++) {
+        code[len++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned) cpus[i], 0, 1);
+        code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, (unsigned) i);
+    }
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (unsigned) count);
+    code[len++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_A, 0);
+    struct sock_fprog program = {
+            .len = (unsigned short) len,
+            .filter = code
+    };
+    return setsockopt(listen_socket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+}
@@ -0,0 +1,33 @@
+#ifndef PROXY_SERVER_CPU_AFFINITY_H
+#define PROXY_SERVER_CPU_AFFINITY_H
+
+/*
+ * Pinning of workers to CPUs and steering of new connections to the
+ * worker whose CPU received them. Memory a pinned worker allocates and
+ * touches first is placed by the kernel on the NUMA node of its CPU.
+ */
+
+#define MAX_WORKERS (64)
+
+typedef enum steering_t {
+    STEERING_NONE,
+    STEERING_INCOMING_CPU, // every listening socket prefers connections that arrive on its CPU
+    STEERING_BPF           // a reuseport program picks the listening socket by the CPU
+} steering_t;
+
+/*
+ * Parses comma separated CPU numbers, returns their count or FAIL
+ */
+int parse_cpu_list(const char *list, int *cpus, int max_count);
+
+int pin_current_thread(int cpu);
+
+int steer_by_incoming_cpu(int listen_socket, int cpu);
+
+/*
+ * Attaches to the reuseport group of listen_socket a program that sends a
+ * connection received on cpus[i] to the i-th socket added to the group
+ */
+int steer_by_bpf(int listen_socket, const int *cpus, int count);
+
+#endif //PROXY_SERVER_CPU_AFFINITY_H
@@ -0,0 +1,125 @@
+#include "egress_pool.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define HASH_MULTIPLIER (0x9E3779B1U)
+#define HASH_BITS (10) // log2(EGRESS_TABLE_SIZE)
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT (24)
+#endif
+
+int egress_pool_add(egress_pool_t *pool, const char *addresses) {
+    char address[INET_ADDRSTRLEN];
+    const char *start = addresses;
+    while (true) {
+        const char *end = strchr(start, ',');
+        size_t len = end == NULL ? strlen(start) : (size_t) (end - start);
+        if (len == 0 || len >= sizeof(address) || pool->addresses_count == EGRESS_MAX_ADDRESSES) {
+            return FAIL;
+        }
+        memcpy(address, start, len);
+        address[len] = '\0';
+        if (inet_pton(AF_INET, address, &pool->addresses[pool->addresses_count]) != 1) {
+            return FAIL;
+        }
+        pool->addresses_count++;
+        if (end == NULL) {
+            return SUCCESS;
+        }
+        start = end + 1;
+    }
+}
+
+static uint32_t slot_of(uint32_t address, uint16_t port) {
+    return ((address ^ ((uint32_t) port << 16)) * HASH_MULTIPLIER) >> (32 - HASH_BITS);
+}
+
+/*
+ * Destinations without connections are expired and their slots are reused
+ */
+static egress_destination_t *find_destination(egress_pool_t *pool, uint32_t address, uint16_t port) {
+    egress_destination_t *reusable = NULL;
+    uint32_t slot = slot_of(address, port);
+    for (int probe = 0; probe < EGRESS_MAX_PROBES; probe++) {
+        egress_destination_t *destination = &pool->destinations[(slot + probe) & (EGRESS_TABLE_SIZE - 1)];
+        if (destination->address == address && destination->port == port) {
+            return destination;
+        }
+        if (destination->address == 0 && destination->port == 0) {
+            if (reusable == NULL) {
+                reusable = destination;
+            }
+            break;
+        }
+        if (reusable == NULL && destination->connections == 0) {
+            reusable = destination;
+        }
+    }
+    if (reusable != NULL) {
+        memset(reusable, 0, sizeof(*reusable));
+        reusable->address = address;
+        reusable->port = port;
+    }
+    return reusable;
+}
+
+egress_lease_t egress_pool_acquire(egress_pool_t *pool, const struct sockaddr_in *destination, uint32_t excluded) {
+    egress_lease_t lease;
+    memset(&lease, 0, sizeof(lease));
+    if (pool->addresses_count == 0) {
+        return lease;
+    }
+    egress_destination_t *usage = find_destination(pool, destination->sin_addr.s_addr, destination->sin_port);
+    int best = FAIL;
+    for (int i = 0; i < pool->addresses_count; i++) {
+        int source = (pool->next_source + i) % pool->addresses_count;
+        if (excluded & (1U << source)) {
+            continue;
+        }
+        if (best == FAIL || (usage != NULL && usage->per_source[source] < usage->per_source[best])) {
+            best = source;
+        }
+    }
+    if (best == FAIL) {
+        return lease;
+    }
+    pool->next_source = (best + 1) % pool->addresses_count;
+    lease.leased = true;
+    lease.source = (uint8_t) best;
+    if (usage != NULL) {
+        lease.tracked = true;
+        lease.destination = (uint16_t) (usage - pool->destinations);
+        usage->per_source[best]++;
+        usage->connections++;
+    }
+    return lease;
+}
+
+int egress_pool_bind(const egress_pool_t *pool, int sd, egress_lease_t lease) {
+    int option_value = 1;
+    int return_value = setsockopt(sd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &option_value, sizeof(option_value));
+    if (return_value == FAIL) {
+        return FAIL;
+    }
+    struct sockaddr_in source;
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr = pool->addresses[lease.source];
+    source.sin_port = 0;
+    return bind(sd, (struct sockaddr *) &source, sizeof(source));
+}
+
+void egress_pool_release(egress_pool_t *pool, egress_lease_t lease) {
+    if (!lease.leased || !lease.tracked) {
+        return;
+    }
+    egress_destination_t *usage = &pool->destinations[lease.destination];
+    if (usage->per_source[lease.source] > 0) {
+        usage->per_source[lease.source]--;
+        usage->connections--;
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef PROXY_SERVER_EGRESS_POOL_H
+#define PROXY_SERVER_EGRESS_POOL_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Local addresses upstream connections leave from. For every destination
+ * the pool counts connections per source address and binds a new socket
+ * to the least used one. The socket is bound with IP_BIND_ADDRESS_NO_PORT,
+ * so the kernel picks the port at connect time for the whole 4-tuple and
+ * every source address has its own ports to each destination.
+ */
+
+#define EGRESS_MAX_ADDRESSES (16)
+#define EGRESS_TABLE_SIZE (1024) // must be a power of two
+#define EGRESS_MAX_PROBES (16)
+
+typedef struct egress_destination_t {
+    uint32_t address; // network order, 0 with port 0 for a never used slot
+    uint16_t port;
+    uint16_t connections;
+    uint16_t per_source[EGRESS_MAX_ADDRESSES];
+} egress_destination_t;
+
+typedef struct egress_pool_t {
+    int addresses_count;
+    struct in_addr addresses[EGRESS_MAX_ADDRESSES];
+    int next_source; // breaks ties, so equally used addresses take turns
+    egress_destination_t destinations[EGRESS_TABLE_SIZE];
+} egress_pool_t;
+
+typedef struct egress_lease_t {
+    bool leased;
+    bool tracked; // false if the destination table had no free slot
+    uint8_t source;
+    uint16_t destination;
+} egress_lease_t;
+
+/*
+ * Adds comma separated IPv4 addresses, returns FAIL on a malformed one or if there are too many
+ */
+int egress_pool_add(egress_pool_t *pool, const char *addresses);
+
+/*
+ * Picks a source for destination, skipping sources whose bit is set in excluded.
+ * Returns a lease that is not leased if the pool is empty or every source is excluded.
+ */
+egress_lease_t egress_pool_acquire(egress_pool_t *pool, const struct sockaddr_in *destination, uint32_t excluded);
+
+/*
+ * Binds sd to the source of lease without taking a port
+ */
+int egress_pool_bind(const egress_pool_t *pool, int sd, egress_lease_t lease);
+
+void egress_pool_release(egress_pool_t *pool, egress_lease_t lease);
+
+#endif //PROXY_SERVER_EGRESS_POOL_H
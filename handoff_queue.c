@@ -0,0 +1,83 @@
+#include "handoff_queue.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+
+int handoff_queue_init(handoff_queue_t *queue) {
+    queue->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->doorbell == FAIL) {
+        perror("[PROXY] Error in eventfd()");
+        return FAIL;
+    }
+    // a slot is free for the push whose position equals its sequence
+    for (size_t i = 0; i < HANDOFF_QUEUE_CAPACITY; i++) {
+        queue->slots[i].sequence = i;
+    }
+    queue->push_position = 0;
+    queue->pop_position = 0;
+    return SUCCESS;
+}
+
+bool handoff_queue_push(handoff_queue_t *queue, const handoff_t *item) {
+    size_t position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+    handoff_slot_t *slot;
+    while (true) {
+        slot = &queue->slots[position & (HANDOFF_QUEUE_CAPACITY - 1)];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t lag = (intptr_t) (sequence - position);
+        if (lag == 0) {
+            // on failure position is reloaded and the next slot is tried
+            if (__atomic_compare_exchange_n(&queue->push_position, &position, position + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lag < 0) {
+            // the consumer has not taken the item of the previous round
+            return false;
+        } else {
+            position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+        }
+    }
+    slot->item = *item;
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+    uint64_t one = 1;
+    if (write(queue->doorbell, &one, sizeof(one)) == FAIL) {
+        perror("[PROXY] Error in write to eventfd");
+    }
+    return true;
+}
+
+bool handoff_queue_pop(handoff_queue_t *queue, handoff_t *item) {
+    size_t position = queue->pop_position;
+    handoff_slot_t *slot = &queue->slots[position & (HANDOFF_QUEUE_CAPACITY - 1)];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+        return false;
+    }
+    *item = slot->item;
+    // free for the push one round later
+    __atomic_store_n(&slot->sequence, position + HANDOFF_QUEUE_CAPACITY, __ATOMIC_RELEASE);
+    queue->pop_position = position + 1;
+    return true;
+}
+
+void handoff_queue_answer(handoff_queue_t *queue) {
+    uint64_t count;
+    // EAGAIN if nothing was rung since the last answer
+    if (read(queue->doorbell, &count, sizeof(count)) == FAIL && errno != EAGAIN) {
+        perror("[PROXY] Error in read from eventfd");
+    }
+}
+
+void handoff_queue_destroy(handoff_queue_t *queue) {
+    handoff_t item;
+    while (handoff_queue_pop(queue, &item)) {
+        close(item.fd);
+    }
+    close(queue->doorbell);
+}
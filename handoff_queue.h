@@ -0,0 +1,56 @@
+#ifndef PROXY_SERVER_HANDOFF_QUEUE_H
+#define PROXY_SERVER_HANDOFF_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/socket.h>
+
+/*
+ * Bounded lock-free queue of accepted connections for one worker.
+ * Any number of threads may push, only the worker pops. Every slot has a
+ * sequence number that tells whose turn it is, so a producer claims a
+ * slot with one compare-and-swap and nobody waits for a lock. After
+ * pushing, the producer rings the doorbell, an eventfd the worker selects on.
+ */
+
+#define HANDOFF_QUEUE_CAPACITY (1024) // must be a power of two
+
+typedef struct handoff_t {
+    int fd;
+    int listen_socket;
+    int listen_mode; // listener_mode_t of the socket it was accepted from
+    struct sockaddr_storage address;
+} handoff_t;
+
+typedef struct handoff_slot_t {
+    size_t sequence;
+    handoff_t item;
+} handoff_slot_t;
+
+typedef struct handoff_queue_t {
+    int doorbell;
+    size_t push_position; // shared by the producers
+    size_t pop_position;  // only used by the consumer
+    handoff_slot_t slots[HANDOFF_QUEUE_CAPACITY];
+} handoff_queue_t;
+
+int handoff_queue_init(handoff_queue_t *queue);
+
+/*
+ * Returns false if the queue is full, the doorbell is rung otherwise
+ */
+bool handoff_queue_push(handoff_queue_t *queue, const handoff_t *item);
+
+bool handoff_queue_pop(handoff_queue_t *queue, handoff_t *item);
+
+/*
+ * Quiets the doorbell before the queue is drained
+ */
+void handoff_queue_answer(handoff_queue_t *queue);
+
+/*
+ * Closes the connections still queued
+ */
+void handoff_queue_destroy(handoff_queue_t *queue);
+
+#endif //PROXY_SERVER_HANDOFF_QUEUE_H
@@ -0,0 +1,82 @@
+#include "hot_restart.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "socket_operations.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define CONTROL_BACKLOG (4)
+
+static int make_unix_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        fprintf(stderr, "[PROXY] control socket path is too long: %s\n", path);
+        return FAIL;
+    }
+    strcpy(address->sun_path, path);
+    return SUCCESS;
+}
+
+int hot_restart_listen(const char *path) {
+    struct sockaddr_un address;
+    if (make_unix_address(path, &address) == FAIL) {
+        return FAIL;
+    }
+    int control_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control_socket == FAIL) {
+        perror("[PROXY] Error in socket");
+        return FAIL;
+    }
+    // the path may be left by the previous process we have taken over
+    unlink(path);
+    if (bind(control_socket, (struct sockaddr *) &address, sizeof(address)) == FAIL) {
+        perror("[PROXY] Error in bind of the control socket");
+        close(control_socket);
+        return FAIL;
+    }
+    if (listen(control_socket, CONTROL_BACKLOG) == FAIL || set_nonblocking(control_socket) == FAIL) {
+        perror("[PROXY] Error in listen of the control socket");
+        close(control_socket);
+        return FAIL;
+    }
+    return control_socket;
+}
+
+int hot_restart_hand_over(int control_socket, const int *fds, int count) {
+    int connection = accept(control_socket, NULL, NULL);
+    if (connection == FAIL) {
+        return FAIL;
+    }
+    int return_value = send_descriptors(connection, fds, count);
+    close(connection);
+    return return_value;
+}
+
+int hot_restart_take_over(const char *path, int *fds, int max_count) {
+    struct sockaddr_un address;
+    if (make_unix_address(path, &address) == FAIL) {
+        return FAIL;
+    }
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection == FAIL) {
+        perror("[PROXY] Error in socket");
+        return FAIL;
+    }
+    if (connect(connection, (struct sockaddr *) &address, sizeof(address)) == FAIL) {
+        perror("[PROXY] Error in connect to the running proxy");
+        close(connection);
+        return FAIL;
+    }
+    int count = receive_descriptors(connection, fds, max_count);
+    if (count == FAIL) {
+        perror("[PROXY] Error in receive of listening sockets");
+    }
+    close(connection);
+    return count;
+}
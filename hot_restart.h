@@ -0,0 +1,28 @@
+#ifndef PROXY_SERVER_HOT_RESTART_H
+#define PROXY_SERVER_HOT_RESTART_H
+
+/*
+ * Hot restart: a running proxy listens on a unix control socket.
+ * A new process connects to it and receives the listening sockets,
+ * after that the old process stops accepting and drains its tunnels.
+ */
+
+#define DEFAULT_DRAIN_TIME (30)
+
+/*
+ * returns nonblocking listening unix socket bound to path
+ */
+int hot_restart_listen(const char *path);
+
+/*
+ * Accepts a takeover request on control_socket and passes fds to the new process
+ */
+int hot_restart_hand_over(int control_socket, const int *fds, int count);
+
+/*
+ * Connects to the control socket of the running process and receives
+ * its listening sockets. Returns the number of received sockets or FAIL.
+ */
+int hot_restart_take_over(const char *path, int *fds, int max_count);
+
+#endif //PROXY_SERVER_HOT_RESTART_H
@@ -0,0 +1,172 @@
+#include "http_connect.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define METHOD "CONNECT "
+#define VERSION "HTTP/1."
+#define MAX_PORT (65535)
+
+enum {
+    STATE_METHOD,
+    STATE_HOST,
+    STATE_PORT,
+    STATE_VERSION,
+    STATE_VERSION_DIGIT,
+    STATE_REQUEST_LINE_END,
+    STATE_LINE_START,
+    STATE_HEADER,
+    STATE_LAST_LF,
+    STATE_DONE
+};
+
+void http_connect_init(http_connect_parser_t *parser) {
+    memset(parser, 0, sizeof(*parser));
+    parser->state = STATE_METHOD;
+}
+
+static http_parse_result_t fail(http_connect_parser_t *parser, int status) {
+    parser->status = status;
+    return HTTP_FAILED;
+}
+
+/*
+ * Takes one byte of the request
+ */
+static http_parse_result_t step(http_connect_parser_t *parser, char symbol) {
+    switch (parser->state) {
+        case STATE_METHOD:
+            if (symbol != METHOD[parser->matched]) {
+                // another method is still a request, anything else is not HTTP
+                bool method_symbol = symbol >= 'A' && symbol <= 'Z';
+                return fail(parser, method_symbol || symbol == ' ' ? HTTP_METHOD_NOT_ALLOWED : HTTP_BAD_REQUEST);
+            }
+            if (++parser->matched == strlen(METHOD)) {
+                parser->state = STATE_HOST;
+            }
+            return HTTP_NEED_MORE;
+        case STATE_HOST:
+            if (symbol == ':' && parser->host_len > 0) {
+                parser->host[parser->host_len] = '\0';
+                parser->state = STATE_PORT;
+                return HTTP_NEED_MORE;
+            }
+            // bracketed IPv6 literals are not supported, as in the SOCKS requests
+            if (symbol <= ' ' || symbol == '/' || symbol == '[' || parser->host_len + 1 >= ADDR_BUFFER_SIZE) {
+                return fail(parser, HTTP_BAD_REQUEST);
+            }
+            parser->host[parser->host_len++] = symbol;
+            return HTTP_NEED_MORE;
+        case STATE_PORT:
+            if (symbol == ' ' && parser->port > 0) {
+                parser->matched = 0;
+                parser->state = STATE_VERSION;
+                return HTTP_NEED_MORE;
+            }
+            if (symbol < '0' || symbol > '9') {
+                return fail(parser, HTTP_BAD_REQUEST);
+            }
+            parser->port = parser->port * 10 + (symbol - '0');
+            if (parser->port > MAX_PORT) {
+                return fail(parser, HTTP_BAD_REQUEST);
+            }
+            return HTTP_NEED_MORE;
+        case STATE_VERSION:
+            if (symbol != VERSION[parser->matched]) {
+                return fail(parser, HTTP_BAD_REQUEST);
+            }
+            if (++parser->matched == strlen(VERSION)) {
+                parser->state = STATE_VERSION_DIGIT;
+            }
+            return HTTP_NEED_MORE;
+        case STATE_VERSION_DIGIT:
+            if (symbol != '0' && symbol != '1') {
+                return fail(parser, HTTP_BAD_REQUEST);
+            }
+            parser->state = STATE_REQUEST_LINE_END;
+            return HTTP_NEED_MORE;
+        case STATE_REQUEST_LINE_END:
+            // CR is optional at the end of every line
+            if (symbol == '\n') {
+                parser->state = STATE_LINE_START;
+            } else if (symbol != '\r') {
+                return fail(parser, HTTP_BAD_REQUEST);
+            }
+            return HTTP_NEED_MORE;
+        case STATE_LINE_START:
+            if (symbol == '\n') {
+                parser->state = STATE_DONE;
+                return HTTP_DONE;
+            }
+            parser->state = symbol == '\r' ? STATE_LAST_LF : STATE_HEADER;
+            return HTTP_NEED_MORE;
+        case STATE_HEADER:
+            if (symbol == '\n') {
+                parser->state = STATE_LINE_START;
+            }
+            return HTTP_NEED_MORE;
+        case STATE_LAST_LF:
+            if (symbol != '\n') {
+                return fail(parser, HTTP_BAD_REQUEST);
+            }
+            parser->state = STATE_DONE;
+            return HTTP_DONE;
+        default:
+            return fail(parser, HTTP_BAD_REQUEST);
+    }
+}
+
+http_parse_result_t http_connect_feed(http_connect_parser_t *parser, const char *data, size_t len,
+                                      size_t *consumed) {
+    for (size_t i = 0; i < len; i++) {
+        if (parser->total++ == HTTP_MAX_REQUEST_SIZE) {
+            *consumed = i;
+            return fail(parser, HTTP_TOO_LARGE);
+        }
+        http_parse_result_t result = step(parser, data[i]);
+        if (result != HTTP_NEED_MORE) {
+            *consumed = i + 1;
+            return result;
+        }
+    }
+    *consumed = len;
+    return HTTP_NEED_MORE;
+}
+
+static const char *reply_of(int status) {
+    switch (status) {
+        case HTTP_OK:
+            return "HTTP/1.1 200 Connection established\r\n\r\n";
+        case HTTP_FORBIDDEN:
+            return "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        case HTTP_METHOD_NOT_ALLOWED:
+            return "HTTP/1.1 405 Method Not Allowed\r\nAllow: CONNECT\r\nContent-Length: 0\r\n"
+                   "Connection: close\r\n\r\n";
+        case HTTP_TOO_LARGE:
+            return "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\n"
+                   "Connection: close\r\n\r\n";
+        case HTTP_BAD_GATEWAY:
+            return "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        case HTTP_SERVICE_UNAVAILABLE:
+            return "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        default:
+            return "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    }
+}
+
+message_t *create_http_reply_message(int status) {
+    const char *reply = reply_of(status);
+    message_t *message = (message_t *) malloc(sizeof(*message));
+    if (message == NULL) {
+        return NULL;
+    }
+    message->len = strlen(reply);
+    message->data = (char *) malloc(message->len + 1);
+    if (message->data == NULL) {
+        free(message);
+        return NULL;
+    }
+    memcpy(message->data, reply, message->len + 1);
+    return message;
+}
@@ -0,0 +1,56 @@
+#ifndef PROXY_SERVER_HTTP_CONNECT_H
+#define PROXY_SERVER_HTTP_CONNECT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io_operations.h"
+#include "socks_messages.h"
+
+/*
+ * HTTP/1.1 CONNECT requests. The parser is fed whatever was read from
+ * the client, keeps its state between reads and allocates nothing.
+ * Headers are skipped, only the target of the request line is kept.
+ */
+
+#define HTTP_MAX_REQUEST_SIZE (8192) // request line and headers together
+
+#define HTTP_OK (200)
+#define HTTP_BAD_REQUEST (400)
+#define HTTP_FORBIDDEN (403)
+#define HTTP_METHOD_NOT_ALLOWED (405)
+#define HTTP_TOO_LARGE (431)
+#define HTTP_BAD_GATEWAY (502)
+#define HTTP_SERVICE_UNAVAILABLE (503)
+
+typedef enum http_parse_result_t {
+    HTTP_NEED_MORE,
+    HTTP_DONE,
+    HTTP_FAILED // the status to reply with is in the parser
+} http_parse_result_t;
+
+typedef struct http_connect_parser_t {
+    uint8_t state;
+    uint16_t matched; // bytes of the current token compared so far
+    uint16_t total;   // bytes of the request consumed so far
+    uint16_t host_len;
+    int port;
+    int status;
+    char host[ADDR_BUFFER_SIZE];
+} http_connect_parser_t;
+
+void http_connect_init(http_connect_parser_t *parser);
+
+/*
+ * Consumes data up to the end of the request. *consumed is how many
+ * bytes belong to the request, the rest is already tunnel payload.
+ */
+http_parse_result_t http_connect_feed(http_connect_parser_t *parser, const char *data, size_t len,
+                                      size_t *consumed);
+
+/*
+ * returns NULL in case of error
+ */
+message_t *create_http_reply_message(int status);
+
+#endif //PROXY_SERVER_HTTP_CONNECT_H
@@ -50,7 +50,29 @@ bool fwrite_into_pipe(FILE *pipe_fd, char *buffer, size_t len) {
     }
 }
 
+long write_available(int fd, const message_t *message) {
+    size_t written_bytes = 0;
+    while (written_bytes < message->len) {
+        ssize_t count = write(fd, message->data + written_bytes, message->len - written_bytes);
+        if (count == FAIL) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return FAIL;
+        }
+        written_bytes += count;
+    }
+    return (long) written_bytes;
+}
+
 message_t *read_all(int socket_fd) {
+    return read_up_to(socket_fd, MSG_LENGTH_LIMIT);
+}
+
+message_t *read_up_to(int socket_fd, size_t limit) {
     size_t capacity = DEFAULT_BUFFER_SIZE;
     char *buffer = malloc(capacity + 1);
     if (buffer == NULL) {
@@ -58,43 +80,35 @@ message_t *read_all(int socket_fd) {
     }
     size_t offset = 0;
     size_t portion = DEFAULT_BUFFER_SIZE;
-    while (true) {
+    while (offset < limit) {
         if (offset + portion > capacity) {
             capacity *= 2;
-            char *temp = realloc(buffer, capacity);
+            char *temp = realloc(buffer, capacity + 1);
             if (NULL == temp) {
                 free(buffer);
                 return NULL;
             }
             buffer = temp;
         }
-        long read_bytes = read(socket_fd, buffer + offset, portion);
+        size_t to_read = portion < limit - offset ? portion : limit - offset;
+        long read_bytes = read(socket_fd, buffer + offset, to_read);
         if (FAIL == read_bytes) {
             if (errno == EINTR) {
                 continue;
             } else if (errno == EAGAIN) {
-                buffer[offset] = '\0';
-                message_t *message = (message_t *) malloc(sizeof(*message));
-                if (NULL == message) {
+                if (offset == 0) {
                     free(buffer);
                     return NULL;
                 }
-                message->data = buffer;
-                message->len = offset;
-                return message;
+                break;
             } else {
                 free(buffer);
                 return NULL;
             }
         }
-        if (0 == read_bytes || offset >= MSG_LENGTH_LIMIT) {
-            offset += read_bytes;
+        offset += read_bytes;
+        if (0 == read_bytes || (size_t) read_bytes < to_read) {
             break;
-        } else {
-            offset += read_bytes;
-            if (offset % portion != 0) {
-                break;
-            }
         }
     }
     buffer[offset] = '\0';
@@ -15,12 +15,24 @@ bool write_all(int fd, message_t *message);
 
 bool fwrite_into_pipe(FILE *pipe_fd, char *buffer, size_t len);
 
+/*
+ * writes as many bytes as the descriptor accepts without blocking,
+ * returns the number of written bytes or FAIL
+ */
+long write_available(int fd, const message_t *message);
+
 /*
  * reads as many bytes from file as possible,
  * but not more that MSG_LENGTH_LIMIT
  */
 message_t *read_all(int socket_fd);
 
+/*
+ * same as read_all, but stops after limit bytes. If a nonblocking
+ * descriptor has nothing to read, returns NULL with errno set to EAGAIN
+ */
+message_t *read_up_to(int socket_fd, size_t limit);
+
 char *read_from_file(int pipe_fd);
 
 char *fread_from_pipe(FILE *pipe_fp);
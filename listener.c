@@ -0,0 +1,238 @@
+#include "listener.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "socket_operations.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define UNIX_PREFIX "unix:"
+#define TRANSPARENT_PREFIX "transparent:"
+#define HTTP_PREFIX "http:"
+#define LISTEN_BACKLOG (510)
+#define MAX_PORT (65535)
+
+static int parse_port(const char *text, in_port_t *port) {
+    char *end = NULL;
+    long value = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || value <= 0 || value > MAX_PORT) {
+        return FAIL;
+    }
+    *port = htons((uint16_t) value);
+    return SUCCESS;
+}
+
+int listener_parse(const char *spec, listener_t *listener) {
+    memset(listener, 0, sizeof(*listener));
+    if (strncmp(spec, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+        const char *path = spec + strlen(UNIX_PREFIX);
+        if (*path == '\0' || strlen(path) >= sizeof(listener->path)) {
+            return FAIL;
+        }
+        listener->family = AF_UNIX;
+        strcpy(listener->path, path);
+        return SUCCESS;
+    }
+    if (strncmp(spec, TRANSPARENT_PREFIX, strlen(TRANSPARENT_PREFIX)) == 0) {
+        listener->mode = LISTEN_TRANSPARENT;
+        spec += strlen(TRANSPARENT_PREFIX);
+    } else if (strncmp(spec, HTTP_PREFIX, strlen(HTTP_PREFIX)) == 0) {
+        listener->mode = LISTEN_HTTP;
+        spec += strlen(HTTP_PREFIX);
+    }
+    listener->family = AF_INET;
+    listener->inet_address.sin_family = AF_INET;
+    listener->inet_address.sin_addr.s_addr = INADDR_ANY;
+    const char *colon = strrchr(spec, ':');
+    if (colon == NULL) {
+        return parse_port(spec, &listener->inet_address.sin_port);
+    }
+    char address[INET_ADDRSTRLEN];
+    size_t len = colon - spec;
+    if (len == 0 || len >= sizeof(address)) {
+        return FAIL;
+    }
+    memcpy(address, spec, len);
+    address[len] = '\0';
+    if (inet_pton(AF_INET, address, &listener->inet_address.sin_addr) != 1) {
+        return FAIL;
+    }
+    return parse_port(colon + 1, &listener->inet_address.sin_port);
+}
+
+static int open_inet_socket(const listener_t *listener, bool shared_port) {
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket == FAIL) {
+        perror("[PROXY] Error in socket");
+        return FAIL;
+    }
+    // set_reusable() closes the socket itself
+    if (set_reusable(listen_socket) == FAIL) {
+        return FAIL;
+    }
+    /*
+     * TPROXY delivers connections to addresses that are not ours.
+     * It needs CAP_NET_ADMIN, without it REDIRECT still works.
+     */
+    int option_value = 1;
+    if (listener->mode == LISTEN_TRANSPARENT
+        && setsockopt(listen_socket, SOL_IP, IP_TRANSPARENT, &option_value, sizeof(option_value)) == FAIL) {
+        perror("[PROXY] Warning: IP_TRANSPARENT is not set");
+    }
+    // every worker listens on its own socket of the port
+    if (shared_port && set_reusable_port(listen_socket) == FAIL) {
+        perror("[PROXY] Error in set_reusable_port()");
+        close(listen_socket);
+        return FAIL;
+    }
+    if (bind(listen_socket, (const struct sockaddr *) &listener->inet_address,
+             sizeof(listener->inet_address)) == FAIL) {
+        perror("[PROXY] Error in bind");
+        close(listen_socket);
+        return FAIL;
+    }
+    return listen_socket;
+}
+
+/*
+ * A socket file nobody accepts on was left by a dead process. The probe
+ * does not wait, a running proxy with a full backlog answers EAGAIN.
+ */
+static bool is_stale_socket(const struct sockaddr_un *address) {
+    struct stat status;
+    if (lstat(address->sun_path, &status) == FAIL || !S_ISSOCK(status.st_mode)) {
+        return false;
+    }
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == FAIL) {
+        return false;
+    }
+    bool stale = set_nonblocking(probe) == SUCCESS
+                 && connect(probe, (const struct sockaddr *) address, sizeof(*address)) == FAIL
+                 && errno == ECONNREFUSED;
+    close(probe);
+    return stale;
+}
+
+static int open_unix_socket(const listener_t *listener) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, listener->path);
+    int listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_socket == FAIL) {
+        perror("[PROXY] Error in socket");
+        return FAIL;
+    }
+    // a path still in use by a running process is kept, bind fails with EADDRINUSE
+    if (is_stale_socket(&address)) {
+        unlink(listener->path);
+    }
+    if (bind(listen_socket, (struct sockaddr *) &address, sizeof(address)) == FAIL) {
+        perror("[PROXY] Error in bind of the unix socket");
+        close(listen_socket);
+        return FAIL;
+    }
+    return listen_socket;
+}
+
+int listener_open(listener_t *listener, int count) {
+    if (listener->family == AF_UNIX) {
+        // SO_REUSEPORT is not supported for unix sockets, the workers share one
+        count = 1;
+    }
+    listener->sockets_count = 0;
+    for (int i = 0; i < count; i++) {
+        int listen_socket = listener->family == AF_UNIX
+                ? open_unix_socket(listener)
+                : open_inet_socket(listener, count > 1);
+        if (listen_socket == FAIL) {
+            listener_close(listener, true);
+            return FAIL;
+        }
+        listener->sockets[listener->sockets_count++] = listen_socket;
+        // the order of listen() is the order of sockets in the reuseport group
+        if (set_nonblocking(listen_socket) == FAIL || listen(listen_socket, LISTEN_BACKLOG) == FAIL) {
+            perror("[PROXY] Error in listen");
+            listener_close(listener, true);
+            return FAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+static bool same_address(const listener_t *listener, const struct sockaddr_storage *address) {
+    if (listener->family != address->ss_family) {
+        return false;
+    }
+    if (listener->family == AF_UNIX) {
+        return strcmp(listener->path, ((const struct sockaddr_un *) address)->sun_path) == 0;
+    }
+    const struct sockaddr_in *inet_address = (const struct sockaddr_in *) address;
+    return listener->inet_address.sin_addr.s_addr == inet_address->sin_addr.s_addr
+           && listener->inet_address.sin_port == inet_address->sin_port;
+}
+
+bool listener_same_address(const listener_t *listener, const listener_t *other) {
+    if (listener->family != other->family) {
+        return false;
+    }
+    if (listener->family == AF_UNIX) {
+        return strcmp(listener->path, other->path) == 0;
+    }
+    return listener->inet_address.sin_addr.s_addr == other->inet_address.sin_addr.s_addr
+           && listener->inet_address.sin_port == other->inet_address.sin_port;
+}
+
+int listener_adopt(const int *fds, int count, listener_t *listeners, int max_count) {
+    int listeners_count = 0;
+    for (int i = 0; i < count; i++) {
+        struct sockaddr_storage address;
+        memset(&address, 0, sizeof(address));
+        socklen_t address_len = sizeof(address);
+        if (getsockname(fds[i], (struct sockaddr *) &address, &address_len) == FAIL
+            || (address.ss_family != AF_INET && address.ss_family != AF_UNIX)) {
+            return FAIL;
+        }
+        listener_t *listener = NULL;
+        for (int j = 0; j < listeners_count && listener == NULL; j++) {
+            if (same_address(&listeners[j], &address)) {
+                listener = &listeners[j];
+            }
+        }
+        if (listener == NULL) {
+            if (listeners_count == max_count) {
+                return FAIL;
+            }
+            listener = &listeners[listeners_count++];
+            memset(listener, 0, sizeof(*listener));
+            listener->family = address.ss_family;
+            if (listener->family == AF_UNIX) {
+                strcpy(listener->path, ((struct sockaddr_un *) &address)->sun_path);
+            } else {
+                listener->inet_address = *(struct sockaddr_in *) &address;
+            }
+        }
+        listener->sockets[listener->sockets_count++] = fds[i];
+    }
+    return listeners_count;
+}
+
+void listener_close(listener_t *listener, bool unlink_path) {
+    for (int i = 0; i < listener->sockets_count; i++) {
+        if (close(listener->sockets[i]) == FAIL) {
+            perror("[PROXY] Error in close");
+        }
+    }
+    if (listener->family == AF_UNIX && unlink_path && listener->sockets_count > 0) {
+        unlink(listener->path);
+    }
+    listener->sockets_count = 0;
+}
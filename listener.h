@@ -0,0 +1,57 @@
+#ifndef PROXY_SERVER_LISTENER_H
+#define PROXY_SERVER_LISTENER_H
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <sys/un.h>
+
+/*
+ * Addresses the proxy accepts clients on. A TCP listener may have one
+ * SO_REUSEPORT socket per worker, a unix listener has one socket that
+ * every worker accepts from.
+ */
+
+#define MAX_LISTENERS (16)
+#define MAX_LISTEN_SOCKETS (64) // of all listeners together, as many as one hand over passes
+
+typedef enum listener_mode_t {
+    LISTEN_SOCKS,
+    LISTEN_TRANSPARENT, // clients are redirected by the firewall and do not speak SOCKS
+    LISTEN_HTTP         // clients send HTTP CONNECT requests
+} listener_mode_t;
+
+typedef struct listener_t {
+    int family; // AF_INET or AF_UNIX
+    listener_mode_t mode;
+    struct sockaddr_in inet_address;
+    char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    int sockets[MAX_LISTEN_SOCKETS];
+    int sockets_count;
+} listener_t;
+
+/*
+ * Accepts "<port>", "<ipv4>:<port>" and "unix:<path>". A TCP listener
+ * may be prefixed with "transparent:" or "http:".
+ */
+int listener_parse(const char *spec, listener_t *listener);
+
+/*
+ * Binds count listening sockets, more than one only for TCP.
+ * A socket file left by a previous process at the unix path is replaced.
+ */
+int listener_open(listener_t *listener, int count);
+
+/*
+ * Groups sockets received from a running proxy by their local address.
+ * Returns the number of listeners or FAIL.
+ */
+int listener_adopt(const int *fds, int count, listener_t *listeners, int max_count);
+
+bool listener_same_address(const listener_t *listener, const listener_t *other);
+
+/*
+ * The unix path is left if another process accepts on the socket now
+ */
+void listener_close(listener_t *listener, bool unlink_path);
+
+#endif //PROXY_SERVER_LISTENER_H
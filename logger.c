@@ -0,0 +1,286 @@
+#include "logger.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_operations.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define BATCH_SIZE (64 * 1024)
+#define MAX_LINE_SIZE (512)
+#define IDLE_SLEEP_NS (10 * 1000 * 1000)
+#define NS_PER_SEC (1000000000ULL)
+#define NS_PER_US (1000ULL)
+
+#define APPEND_ERRNO (1 << 0) // ": <strerror(error_code)>" is added to the line
+#define APPEND_IPV4 (1 << 1)  // the last argument is an IPv4 address in network order
+
+typedef struct log_event_format_t {
+    /* receives fd as int and then every argument as long long */
+    const char *format;
+    int flags;
+} log_event_format_t;
+
+static const log_event_format_t EVENT_FORMATS[EV_EVENTS_COUNT] = {
+        [EV_RUNNING] = {"[PROXY] Running with %d listening sockets", 0},
+        [EV_SHUTDOWN] = {"[PROXY] Shutdown...", 0},
+        [EV_SELECT_WAIT] = {"[PROXY] Waiting on select, max_fd = %d", 0},
+        [EV_SELECT_ERROR] = {"[PROXY] Error in select", APPEND_ERRNO},
+        [EV_SELECT_TIMEOUT] = {"[PROXY] Select timed out. End program.", 0},
+        [EV_NEW_CONNECTION] = {"[PROXY] Accepted new connection %d", 0},
+        [EV_ACCEPT_ERROR] = {"[PROXY] Error in accept. Shutdown server...", APPEND_ERRNO},
+        [EV_CLOSED] = {"[PROXY] Closed connection %d", 0},
+        [EV_CLOSE_ERROR] = {"[PROXY] Error in close, fd = %d", APPEND_ERRNO},
+        [EV_GREETING_PARSE_FAILED] = {"[PROXY] could not parse greeting message, fd = %d", 0},
+        [EV_CHOICE_CREATE_FAILED] = {"[PROXY] could not create choice message, fd = %d", 0},
+        [EV_GREETING_QUEUED] = {"[PROXY] Pushed greeting into queue, fd = %d", 0},
+        [EV_GREETING_PASSED] = {"[PROXY] Greeting passed successfully, fd = %d", 0},
+        [EV_GREETING_REJECTED] = {"[PROXY] Greeting not passed, fd = %d", 0},
+        [EV_REQUEST_PARSE_FAILED] = {"[PROXY] could not parse request message, fd = %d", 0},
+        [EV_CONNECT_REQUEST] = {"[PROXY] Got request from %d to connect to port %lld, address type %lld, address",
+                                APPEND_IPV4},
+        [EV_CONNECT_FAILED] = {"[PROXY] failed to establish connection for %d, code: %lld", APPEND_ERRNO},
+        [EV_RESPONSE_CREATE_FAILED] = {"[PROXY] could not make response message, fd = %d", 0},
+        [EV_CONNECTED] = {"[PROXY] Connected %d", 0},
+        [EV_READ_ERROR] = {"[PROXY] Error in read, fd = %d", APPEND_ERRNO},
+        [EV_RECEIVED] = {"[PROXY] Received from %d: %lld bytes, pushed to a queue for %lld", 0},
+        [EV_WRITE_READY] = {"[PROXY] Ready to send message to %d", 0},
+        [EV_NULL_MESSAGE] = {"[PROXY] NULL message to send, fd = %d", 0},
+        [EV_SENT] = {"[PROXY] sent to %d: %lld bytes", 0},
+        [EV_WRITE_ERROR] = {"[PROXY] Error in write_all(), fd = %d", APPEND_ERRNO},
+        [EV_HANDED_OVER] = {"[PROXY] Listening socket %d handed over, draining for %lld s", 0},
+        [EV_HAND_OVER_FAILED] = {"[PROXY] Failed to hand over listening socket, control fd = %d", APPEND_ERRNO},
+        [EV_DRAINED] = {"[PROXY] All tunnels drained", 0},
+        [EV_DRAIN_DEADLINE] = {"[PROXY] Drain deadline reached, closing the rest of tunnels", 0},
+        [EV_RATE_LIMITED] = {"[PROXY] Closed %d, over the limits of client", APPEND_IPV4},
+        [EV_SHAPED] = {"[PROXY] Paused reading %d for %lld us by bandwidth limit", 0},
+        [EV_TENANT_HELD] = {"[PROXY] Paused writing %d for %lld us by the share of tenant %lld", 0},
+        [EV_MEMORY_REFUSED] = {"[PROXY] Closed %d, too much data is buffered", 0},
+        [EV_MEMORY_STATS] = {"[PROXY] Memory pressure level %d: buffered %lld bytes, peak %lld, ceiling %lld", 0},
+        [EV_MEMORY_REFUSED_TOTAL] = {"[PROXY] %d descriptors paused for memory, %lld tunnels refused", 0},
+        [EV_TOO_MANY_DESCRIPTORS] = {"[PROXY] Closed %d, the descriptor does not fit the tables", 0},
+        [EV_WORKER_STARTED] = {"[PROXY] Worker %d started, cpu %lld", 0},
+        [EV_WORKER_FAILED] = {"[PROXY] Worker %d failed to allocate its tables", 0},
+        [EV_PIN_FAILED] = {"[PROXY] Failed to pin worker %d to cpu %lld", APPEND_ERRNO},
+        [EV_LISTENING] = {"[PROXY] Listening on port %d with %lld sockets, address", APPEND_IPV4},
+        [EV_LISTENING_UNIX] = {"[PROXY] Listening on unix socket %d", 0},
+        [EV_NOT_REDIRECTED] = {"[PROXY] Closed %d, it came to the transparent listener itself, port %lld of",
+                               APPEND_IPV4},
+        [EV_HTTP_REQUEST_FAILED] = {"[PROXY] Closed %d, bad HTTP request, replied %lld", 0},
+        [EV_HANDSHAKE_TIMEOUT] = {"[PROXY] Closed %d, the handshake took too long", 0},
+        [EV_RESOLVE_FAILED] = {"[PROXY] Target of %d is not resolved, queued %lld", 0},
+        [EV_TASK_POOL_FAILED] = {"[PROXY] Task pool of %d threads is not started", APPEND_ERRNO},
+        [EV_ACCEPTOR_STARTED] = {"[PROXY] Acceptor started for %d workers", 0},
+        [EV_HANDOFF_FULL] = {"[PROXY] Closed %d, the queues of all workers are full", 0},
+        [EV_TRACE_CLOSED] = {"[PROXY] Trace written, %d records dropped", 0},
+        [EV_OVERLOAD_LEVEL] = {"[PROXY] Worker %d overload level %lld: loop lag %lld us, %lld handshakes", 0},
+        [EV_OVERLOAD_SHED] = {"[PROXY] Refused the request of %d, loop lag %lld us, %lld handshakes", 0},
+        [EV_OVERLOAD_REFUSED] = {"[PROXY] Closed %d, loop lag %lld us, %lld handshakes", 0},
+        [EV_ACL_DENIED] = {"[PROXY] Denied port %d by destination rules, address", APPEND_IPV4},
+        [EV_ACL_LOADED] = {"[PROXY] Destination rules loaded: %d rules, %lld prefixes, %lld KiB", 0},
+        [EV_ACL_LOAD_FAILED] = {"[PROXY] Destination rules kept, error in line %d of the new ones", 0},
+        [EV_BLOCKLIST_DENIED] = {"[PROXY] Denied %d, the name of the target is blocked", 0},
+        [EV_BLOCKLIST_OPENED] = {"[PROXY] Domain blocklist mapped: %d names, %lld KiB", 0},
+        [EV_ROUTED] = {"[PROXY] Target of %d is routed, egress kind %lld", 0},
+        [EV_ROUTES_LOADED] = {"[PROXY] Routes loaded: %d routes, %lld domains, %lld KiB", 0},
+        [EV_ROUTES_LOAD_FAILED] = {"[PROXY] Routes kept, error in line %d of the new ones", 0},
+        [EV_PARENT_FAILED] = {"[PROXY] Parent proxy refused %d, status %lld", 0},
+        [EV_QUEUE_JOIN_FAILED] = {"[PROXY] Closed %d, no memory to queue %lld bytes behind %lld", 0},
+        [EV_ACCESS_LOG_DROPPED] = {"[PROXY] Access log: %d records dropped", 0},
+};
+
+/*
+ * Single producer (the owning thread), single consumer (the writer).
+ * head is only written by the producer and tail only by the consumer.
+ */
+typedef struct log_ring_t {
+    log_record_t records[LOG_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    uint64_t reported_dropped;
+    struct log_ring_t *next;
+} log_ring_t;
+
+typedef struct log_batch_t {
+    int fd;
+    char data[BATCH_SIZE];
+    size_t len;
+} log_batch_t;
+
+log_level_t log_min_level = LOG_LEVEL_INFO;
+
+static __thread log_ring_t *thread_ring = NULL;
+static log_ring_t *rings = NULL;
+static pthread_t writer_thread;
+static bool writer_running = false;
+static bool stop_requested = false;
+static log_batch_t out_batch = {.fd = STDOUT_FILENO};
+static log_batch_t err_batch = {.fd = STDERR_FILENO};
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static log_ring_t *register_thread_ring() {
+    log_ring_t *ring = (log_ring_t *) calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    thread_ring = ring;
+    return ring;
+}
+
+void log_event(log_level_t level, log_event_t event, int fd, int64_t arg0, int64_t arg1, int64_t arg2) {
+    if (level < log_min_level) {
+        return;
+    }
+    int error_code = errno;
+    log_ring_t *ring = thread_ring;
+    if (ring == NULL) {
+        ring = register_thread_ring();
+        if (ring == NULL) {
+            errno = error_code;
+            return;
+        }
+    }
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == LOG_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    log_record_t *record = &ring->records[head & (LOG_RING_SIZE - 1)];
+    record->timestamp_ns = now_ns();
+    record->event = (uint16_t) event;
+    record->level = (uint8_t) level;
+    record->fd = fd;
+    record->error_code = error_code;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+    record->args[2] = arg2;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    // the caller may still inspect errno after logging
+    errno = error_code;
+}
+
+static void flush_batch(log_batch_t *batch) {
+    if (batch->len == 0) {
+        return;
+    }
+    message_t message = {
+            .data = batch->data,
+            .len = batch->len
+    };
+    write_all(batch->fd, &message);
+    batch->len = 0;
+}
+
+static void append_line(log_batch_t *batch, const char *line, size_t len) {
+    if (batch->len + len > BATCH_SIZE) {
+        flush_batch(batch);
+    }
+    memcpy(batch->data + batch->len, line, len);
+    batch->len += len;
+}
+
+static void format_record(const log_record_t *record) {
+    char line[MAX_LINE_SIZE];
+    if (record->event >= EV_EVENTS_COUNT) {
+        return;
+    }
+    const log_event_format_t *format = &EVENT_FORMATS[record->event];
+    uint64_t seconds = record->timestamp_ns / NS_PER_SEC;
+    uint64_t micros = (record->timestamp_ns % NS_PER_SEC) / NS_PER_US;
+    int len = snprintf(line, sizeof(line), "%llu.%06llu ", (unsigned long long) seconds,
+                       (unsigned long long) micros);
+    len += snprintf(line + len, sizeof(line) - len, format->format, record->fd,
+                    (long long) record->args[0], (long long) record->args[1], (long long) record->args[2]);
+    if ((format->flags & APPEND_IPV4) && len < MAX_LINE_SIZE) {
+        char address[INET_ADDRSTRLEN] = "?";
+        uint32_t ipv4 = (uint32_t) record->args[LOG_ARGS_COUNT - 1];
+        inet_ntop(AF_INET, &ipv4, address, sizeof(address));
+        len += snprintf(line + len, sizeof(line) - len, " %s", address);
+    }
+    if ((format->flags & APPEND_ERRNO) && len < MAX_LINE_SIZE) {
+        len += snprintf(line + len, sizeof(line) - len, ": %s", strerror(record->error_code));
+    }
+    if (len >= MAX_LINE_SIZE) {
+        len = MAX_LINE_SIZE - 1;
+    }
+    line[len++] = '\n';
+    append_line(record->level == LOG_LEVEL_ERROR ? &err_batch : &out_batch, line, len);
+}
+
+/*
+ * Returns the number of records taken from all the rings
+ */
+static size_t drain_rings() {
+    size_t drained = 0;
+    for (log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        uint64_t tail = ring->tail;
+        for (; tail != head; tail++) {
+            format_record(&ring->records[tail & (LOG_RING_SIZE - 1)]);
+            drained++;
+        }
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->reported_dropped) {
+            char line[MAX_LINE_SIZE];
+            int len = snprintf(line, sizeof(line), "[LOG] dropped %llu records\n",
+                               (unsigned long long) (dropped - ring->reported_dropped));
+            append_line(&err_batch, line, len);
+            ring->reported_dropped = dropped;
+        }
+    }
+    flush_batch(&out_batch);
+    flush_batch(&err_batch);
+    return drained;
+}
+
+static void *run_writer(__attribute__((unused)) void *arg) {
+    struct timespec idle_sleep = {
+            .tv_sec = 0,
+            .tv_nsec = IDLE_SLEEP_NS
+    };
+    while (!__atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE)) {
+        if (drain_rings() == 0) {
+            nanosleep(&idle_sleep, NULL);
+        }
+    }
+    drain_rings();
+    return NULL;
+}
+
+int logger_start(log_level_t min_level) {
+    log_min_level = min_level;
+    stop_requested = false;
+    int return_value = pthread_create(&writer_thread, NULL, run_writer, NULL);
+    if (return_value != SUCCESS) {
+        errno = return_value;
+        return FAIL;
+    }
+    writer_running = true;
+    return SUCCESS;
+}
+
+void logger_stop() {
+    if (!writer_running) {
+        return;
+    }
+    __atomic_store_n(&stop_requested, true, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    writer_running = false;
+}
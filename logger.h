@@ -0,0 +1,125 @@
+#ifndef PROXY_SERVER_LOGGER_H
+#define PROXY_SERVER_LOGGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous logger. The event loop only appends a fixed size binary
+ * record to a ring buffer owned by the calling thread. A background
+ * thread formats the records and writes them in batches. When a ring
+ * is full the record is dropped and counted, the caller never blocks.
+ * The writer reports the drops of every ring as a line of its own.
+ */
+
+#define LOG_ARGS_COUNT (3)
+#define LOG_RING_SIZE (4096) // records per thread, must be a power of two
+
+typedef enum log_level_t {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_ERROR
+} log_level_t;
+
+typedef enum log_event_t {
+    EV_RUNNING,
+    EV_SHUTDOWN,
+    EV_SELECT_WAIT,
+    EV_SELECT_ERROR,
+    EV_SELECT_TIMEOUT,
+    EV_NEW_CONNECTION,
+    EV_ACCEPT_ERROR,
+    EV_CLOSED,
+    EV_CLOSE_ERROR,
+    EV_GREETING_PARSE_FAILED,
+    EV_CHOICE_CREATE_FAILED,
+    EV_GREETING_QUEUED,
+    EV_GREETING_PASSED,
+    EV_GREETING_REJECTED,
+    EV_REQUEST_PARSE_FAILED,
+    EV_CONNECT_REQUEST,
+    EV_CONNECT_FAILED,
+    EV_RESPONSE_CREATE_FAILED,
+    EV_CONNECTED,
+    EV_READ_ERROR,
+    EV_RECEIVED,
+    EV_WRITE_READY,
+    EV_NULL_MESSAGE,
+    EV_SENT,
+    EV_WRITE_ERROR,
+    EV_HANDED_OVER,
+    EV_HAND_OVER_FAILED,
+    EV_DRAINED,
+    EV_DRAIN_DEADLINE,
+    EV_RATE_LIMITED,
+    EV_SHAPED,
+    EV_TENANT_HELD,
+    EV_MEMORY_REFUSED,
+    EV_MEMORY_STATS,
+    EV_MEMORY_REFUSED_TOTAL,
+    EV_TOO_MANY_DESCRIPTORS,
+    EV_WORKER_STARTED,
+    EV_WORKER_FAILED,
+    EV_PIN_FAILED,
+    EV_LISTENING,
+    EV_LISTENING_UNIX,
+    EV_NOT_REDIRECTED,
+    EV_HTTP_REQUEST_FAILED,
+    EV_HANDSHAKE_TIMEOUT,
+    EV_RESOLVE_FAILED,
+    EV_TASK_POOL_FAILED,
+    EV_ACCEPTOR_STARTED,
+    EV_HANDOFF_FULL,
+    EV_TRACE_CLOSED,
+    EV_OVERLOAD_LEVEL,
+    EV_OVERLOAD_SHED,
+    EV_OVERLOAD_REFUSED,
+    EV_ACL_DENIED,
+    EV_ACL_LOADED,
+    EV_ACL_LOAD_FAILED,
+    EV_BLOCKLIST_DENIED,
+    EV_BLOCKLIST_OPENED,
+    EV_ROUTED,
+    EV_ROUTES_LOADED,
+    EV_ROUTES_LOAD_FAILED,
+    EV_PARENT_FAILED,
+    EV_QUEUE_JOIN_FAILED,
+    EV_ACCESS_LOG_DROPPED,
+    EV_EVENTS_COUNT
+} log_event_t;
+
+typedef struct log_record_t {
+    uint64_t timestamp_ns;
+    uint16_t event;
+    uint8_t level;
+    int32_t fd;
+    int32_t error_code; // errno at the moment of logging
+    int64_t args[LOG_ARGS_COUNT];
+} log_record_t;
+
+extern log_level_t log_min_level;
+
+/*
+ * Starts the background writer. Records of lower level than min_level
+ * are discarded by the producer before touching the ring.
+ */
+int logger_start(log_level_t min_level);
+
+/*
+ * Drains every ring, writes the rest of the records and joins the writer
+ */
+void logger_stop();
+
+void log_event(log_level_t level, log_event_t event, int fd, int64_t arg0, int64_t arg1, int64_t arg2);
+
+#define LOG_DEBUG(event, fd, arg0, arg1, arg2) do { \
+    if (log_min_level <= LOG_LEVEL_DEBUG) log_event(LOG_LEVEL_DEBUG, event, fd, arg0, arg1, arg2); \
+} while (0)
+
+#define LOG_INFO(event, fd, arg0, arg1, arg2) do { \
+    if (log_min_level <= LOG_LEVEL_INFO) log_event(LOG_LEVEL_INFO, event, fd, arg0, arg1, arg2); \
+} while (0)
+
+#define LOG_ERROR(event, fd, arg0, arg1, arg2) log_event(LOG_LEVEL_ERROR, event, fd, arg0, arg1, arg2)
+
+#endif //PROXY_SERVER_LOGGER_H
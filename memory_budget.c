@@ -0,0 +1,87 @@
+#include "memory_budget.h"
+
+#include <stdbool.h>
+
+/*
+ * Counters are atomic, so threads of one process share one budget
+ */
+static size_t ceiling = 0;
+static size_t shrink_level = 0;
+static size_t pause_level = 0;
+static size_t refuse_level = 0;
+static size_t used = 0;
+static size_t peak = 0;
+static uint64_t refused = 0;
+
+void memory_budget_init(size_t new_ceiling) {
+    ceiling = new_ceiling;
+    shrink_level = ceiling / 100 * MEMORY_SHRINK_PERCENT;
+    pause_level = ceiling / 100 * MEMORY_PAUSE_PERCENT;
+    refuse_level = ceiling / 100 * MEMORY_REFUSE_PERCENT;
+    __atomic_store_n(&used, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&peak, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&refused, 0, __ATOMIC_RELAXED);
+}
+
+void memory_budget_charge(size_t bytes) {
+    size_t current = __atomic_add_fetch(&used, bytes, __ATOMIC_RELAXED);
+    size_t seen_peak = __atomic_load_n(&peak, __ATOMIC_RELAXED);
+    while (current > seen_peak
+           && !__atomic_compare_exchange_n(&peak, &seen_peak, current, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void memory_budget_credit(size_t bytes) {
+    __atomic_sub_fetch(&used, bytes, __ATOMIC_RELAXED);
+}
+
+memory_pressure_t memory_budget_pressure() {
+    if (ceiling == 0) {
+        return MEMORY_NORMAL;
+    }
+    size_t current = __atomic_load_n(&used, __ATOMIC_RELAXED);
+    if (current >= refuse_level) {
+        return MEMORY_REFUSE;
+    }
+    if (current >= pause_level) {
+        return MEMORY_PAUSE;
+    }
+    if (current >= shrink_level) {
+        return MEMORY_SHRINK;
+    }
+    return MEMORY_NORMAL;
+}
+
+size_t memory_budget_window(size_t full_window) {
+    if (ceiling == 0) {
+        return full_window;
+    }
+    size_t current = __atomic_load_n(&used, __ATOMIC_RELAXED);
+    if (current < shrink_level) {
+        return full_window;
+    }
+    if (current >= pause_level) {
+        return MEMORY_MIN_WINDOW;
+    }
+    size_t window = (size_t) ((uint64_t) full_window * (pause_level - current) / (pause_level - shrink_level));
+    return window < MEMORY_MIN_WINDOW ? MEMORY_MIN_WINDOW : window;
+}
+
+void memory_budget_count_refused() {
+    __atomic_add_fetch(&refused, 1, __ATOMIC_RELAXED);
+}
+
+size_t memory_budget_used() {
+    return __atomic_load_n(&used, __ATOMIC_RELAXED);
+}
+
+size_t memory_budget_peak() {
+    return __atomic_load_n(&peak, __ATOMIC_RELAXED);
+}
+
+size_t memory_budget_ceiling() {
+    return ceiling;
+}
+
+uint64_t memory_budget_refused() {
+    return __atomic_load_n(&refused, __ATOMIC_RELAXED);
+}
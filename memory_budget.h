@@ -0,0 +1,53 @@
+#ifndef PROXY_SERVER_MEMORY_BUDGET_H
+#define PROXY_SERVER_MEMORY_BUDGET_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Process wide count of payload bytes the proxy holds in queues,
+ * compared with a ceiling. The higher the usage, the harder the proxy
+ * pushes back: first it reads less per turn, then it stops reading
+ * relayed data, then it refuses new tunnels.
+ */
+
+#define MEMORY_SHRINK_PERCENT (50)
+#define MEMORY_PAUSE_PERCENT (75)
+#define MEMORY_REFUSE_PERCENT (90)
+#define MEMORY_MIN_WINDOW (4 * 1024)
+
+typedef enum memory_pressure_t {
+    MEMORY_NORMAL,
+    MEMORY_SHRINK,
+    MEMORY_PAUSE,
+    MEMORY_REFUSE
+} memory_pressure_t;
+
+/*
+ * ceiling 0 means no limit, usage is still counted
+ */
+void memory_budget_init(size_t ceiling);
+
+void memory_budget_charge(size_t bytes);
+
+void memory_budget_credit(size_t bytes);
+
+memory_pressure_t memory_budget_pressure();
+
+/*
+ * Shrinks full_window linearly between the shrink and pause levels,
+ * but not below MEMORY_MIN_WINDOW
+ */
+size_t memory_budget_window(size_t full_window);
+
+void memory_budget_count_refused();
+
+size_t memory_budget_used();
+
+size_t memory_budget_peak();
+
+size_t memory_budget_ceiling();
+
+uint64_t memory_budget_refused();
+
+#endif //PROXY_SERVER_MEMORY_BUDGET_H
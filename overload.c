@@ -0,0 +1,48 @@
+#include "overload.h"
+
+#include <stdbool.h>
+
+#define NS_PER_MS (1000000ULL)
+
+void overload_init(overload_t *overload, int max_lag_ms, int max_handshakes) {
+    overload->max_lag_ns = (uint64_t) max_lag_ms * NS_PER_MS;
+    overload->max_handshakes = max_handshakes;
+    overload->lag_ns = 0;
+    overload->level = OVERLOAD_NONE;
+}
+
+/*
+ * The level the loop is at if the thresholds are taken at percent of their values
+ */
+static overload_level_t level_at(const overload_t *overload, int handshakes, uint64_t percent) {
+    uint64_t shed_lag = overload->max_lag_ns * percent / 100;
+    bool lagging = overload->max_lag_ns != 0;
+    // not rounded down, a limit of one handshake must not refuse with none
+    bool crowded = overload->max_handshakes != 0
+                   && (uint64_t) handshakes * 100 >= (uint64_t) overload->max_handshakes * percent;
+    if ((lagging && overload->lag_ns >= shed_lag * OVERLOAD_REFUSE_LAG_FACTOR) || crowded) {
+        return OVERLOAD_REFUSE;
+    }
+    if (lagging && overload->lag_ns >= shed_lag) {
+        return OVERLOAD_SHED;
+    }
+    return OVERLOAD_NONE;
+}
+
+overload_level_t overload_update(overload_t *overload, uint64_t turn_lag_ns, int handshakes) {
+    if (turn_lag_ns >= overload->lag_ns) {
+        overload->lag_ns += (turn_lag_ns - overload->lag_ns) / OVERLOAD_LAG_SMOOTHING;
+    } else {
+        overload->lag_ns -= (overload->lag_ns - turn_lag_ns) / OVERLOAD_LAG_SMOOTHING;
+    }
+    overload_level_t entered = level_at(overload, handshakes, 100);
+    if (entered >= overload->level) {
+        overload->level = entered;
+        return overload->level;
+    }
+    overload_level_t kept = level_at(overload, handshakes, OVERLOAD_LEAVE_PERCENT);
+    if (kept < overload->level) {
+        overload->level = kept;
+    }
+    return overload->level;
+}
@@ -0,0 +1,44 @@
+#ifndef PROXY_SERVER_OVERLOAD_H
+#define PROXY_SERVER_OVERLOAD_H
+
+#include <stdint.h>
+
+/*
+ * Admission control of one event loop. The loop measures its lag, how
+ * long the descriptors select returned waited until they were handled,
+ * and counts the clients in the handshake. When it falls behind it
+ * first refuses new requests at once instead of connecting them, then
+ * closes new clients right after accept, so the tunnels already open
+ * keep the loop. A level is left only below OVERLOAD_LEAVE_PERCENT of
+ * its threshold, so it does not flap.
+ */
+
+#define OVERLOAD_LAG_SMOOTHING (8) // the last turn weighs 1/8 of the average
+#define OVERLOAD_REFUSE_LAG_FACTOR (2)
+#define OVERLOAD_LEAVE_PERCENT (75)
+
+typedef enum overload_level_t {
+    OVERLOAD_NONE,
+    OVERLOAD_SHED,  // new requests are answered with a failure
+    OVERLOAD_REFUSE // new clients are closed when accepted
+} overload_level_t;
+
+typedef struct overload_t {
+    uint64_t max_lag_ns; // 0 if the lag is not limited
+    int max_handshakes;  // 0 if not limited
+    uint64_t lag_ns;     // moving average
+    overload_level_t level;
+} overload_t;
+
+/*
+ * Shedding starts at max_lag_ms, refusing at OVERLOAD_REFUSE_LAG_FACTOR
+ * times more or at max_handshakes clients in the handshake
+ */
+void overload_init(overload_t *overload, int max_lag_ms, int max_handshakes);
+
+/*
+ * Takes the lag of one turn of the loop and returns the new level
+ */
+overload_level_t overload_update(overload_t *overload, uint64_t turn_lag_ns, int handshakes);
+
+#endif //PROXY_SERVER_OVERLOAD_H
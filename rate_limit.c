@@ -0,0 +1,100 @@
+#include "rate_limit.h"
+
+#include <string.h>
+
+#define NS_PER_SEC (1000000000ULL)
+#define HASH_MULTIPLIER (0x9E3779B1U)
+#define HASH_BITS (12) // log2(RATE_LIMIT_TABLE_SIZE)
+
+void rate_limit_init(rate_limiter_t *limiter, int rate, int burst, int max_tunnels) {
+    memset(limiter, 0, sizeof(*limiter));
+    if (rate > 0) {
+        limiter->interval_ns = NS_PER_SEC / (uint64_t) rate;
+        // by default a second worth of connections may come at once
+        limiter->burst_ns = limiter->interval_ns * (uint64_t) (burst > 0 ? burst : rate);
+    }
+    if (max_tunnels > 0) {
+        limiter->max_tunnels = (uint32_t) max_tunnels;
+    }
+    limiter->enabled = limiter->interval_ns != 0 || limiter->max_tunnels != 0;
+}
+
+static uint32_t slot_of(uint32_t address) {
+    return (address * HASH_MULTIPLIER) >> (32 - HASH_BITS);
+}
+
+static bool is_expired(const rate_limit_entry_t *entry, uint64_t now_ns) {
+    return entry->tunnels == 0 && entry->full_at_ns <= now_ns;
+}
+
+/*
+ * returns the entry of address, a reused or a new one, or NULL if the probes ran out
+ */
+static rate_limit_entry_t *find_entry(rate_limiter_t *limiter, uint32_t address, uint64_t now_ns) {
+    rate_limit_entry_t *reusable = NULL;
+    uint32_t slot = slot_of(address);
+    for (int probe = 0; probe < RATE_LIMIT_MAX_PROBES; probe++) {
+        rate_limit_entry_t *entry = &limiter->table[(slot + probe) & (RATE_LIMIT_TABLE_SIZE - 1)];
+        if (entry->address == address) {
+            return entry;
+        }
+        if (entry->address == 0) {
+            // the address can not be further along the chain
+            if (reusable == NULL) {
+                reusable = entry;
+            }
+            break;
+        }
+        if (reusable == NULL && is_expired(entry, now_ns)) {
+            reusable = entry;
+        }
+    }
+    if (reusable != NULL) {
+        reusable->address = address;
+        reusable->tunnels = 0;
+        reusable->full_at_ns = now_ns;
+    }
+    return reusable;
+}
+
+bool rate_limit_admit(rate_limiter_t *limiter, uint32_t address, uint64_t now_ns, bool *counted) {
+    *counted = false;
+    if (!limiter->enabled) {
+        return true;
+    }
+    rate_limit_entry_t *entry = find_entry(limiter, address, now_ns);
+    if (entry == NULL) {
+        // the neighbourhood is full of live entries, better to let one through than to refuse everybody
+        limiter->overflows++;
+        return true;
+    }
+    if (limiter->max_tunnels != 0 && entry->tunnels >= limiter->max_tunnels) {
+        return false;
+    }
+    if (limiter->interval_ns != 0) {
+        uint64_t full_at_ns = entry->full_at_ns > now_ns ? entry->full_at_ns : now_ns;
+        if (full_at_ns + limiter->interval_ns > now_ns + limiter->burst_ns) {
+            return false;
+        }
+        entry->full_at_ns = full_at_ns + limiter->interval_ns;
+    }
+    entry->tunnels++;
+    *counted = true;
+    return true;
+}
+
+void rate_limit_release(rate_limiter_t *limiter, uint32_t address) {
+    uint32_t slot = slot_of(address);
+    for (int probe = 0; probe < RATE_LIMIT_MAX_PROBES; probe++) {
+        rate_limit_entry_t *entry = &limiter->table[(slot + probe) & (RATE_LIMIT_TABLE_SIZE - 1)];
+        if (entry->address == address) {
+            if (entry->tunnels > 0) {
+                entry->tunnels--;
+            }
+            return;
+        }
+        if (entry->address == 0) {
+            return;
+        }
+    }
+}
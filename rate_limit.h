@@ -0,0 +1,53 @@
+#ifndef PROXY_SERVER_RATE_LIMIT_H
+#define PROXY_SERVER_RATE_LIMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Per client IP limits, checked right after accept: a token bucket
+ * for new connections and a cap on tunnels open at the same time.
+ * Entries live in an open addressing table without deletion, an entry
+ * whose bucket is full again and that has no tunnels is expired
+ * and its slot is reused by the next address that probes it.
+ */
+
+#define RATE_LIMIT_TABLE_SIZE (4096) // must be a power of two
+#define RATE_LIMIT_MAX_PROBES (16)
+
+typedef struct rate_limit_entry_t {
+    uint32_t address; // IPv4 in network order, 0 for a never used slot
+    uint32_t tunnels;
+    /*
+     * Token bucket kept as the time when the bucket is full again.
+     * Every connection moves it one interval forward.
+     */
+    uint64_t full_at_ns;
+} rate_limit_entry_t;
+
+typedef struct rate_limiter_t {
+    bool enabled;
+    uint64_t interval_ns; // 0 if the connection rate is not limited
+    uint64_t burst_ns;
+    uint32_t max_tunnels; // 0 if not limited
+    uint64_t overflows;   // admitted because no slot was found
+    rate_limit_entry_t table[RATE_LIMIT_TABLE_SIZE];
+} rate_limiter_t;
+
+/*
+ * rate is connections per second, burst is how many of them may come at once
+ */
+void rate_limit_init(rate_limiter_t *limiter, int rate, int burst, int max_tunnels);
+
+/*
+ * Takes a token and counts a tunnel for address, returns false if over a limit.
+ * counted is false if the connection was let through without an entry.
+ */
+bool rate_limit_admit(rate_limiter_t *limiter, uint32_t address, uint64_t now_ns, bool *counted);
+
+/*
+ * Must be called once for every counted connection when it is closed
+ */
+void rate_limit_release(rate_limiter_t *limiter, uint32_t address);
+
+#endif //PROXY_SERVER_RATE_LIMIT_H
@@ -0,0 +1,148 @@
+#include "relay_buffer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+
+static int pool_init(block_pool_t *pool, size_t block_size, int blocks_count) {
+    // one more byte in every block for the terminating zero
+    pool->slab = malloc((block_size + 1) * blocks_count);
+    pool->free_blocks = malloc(sizeof(*pool->free_blocks) * blocks_count);
+    if (pool->slab == NULL || pool->free_blocks == NULL) {
+        free(pool->slab);
+        free(pool->free_blocks);
+        pool->slab = NULL;
+        pool->free_blocks = NULL;
+        return FAIL;
+    }
+    pool->block_size = block_size;
+    pool->blocks_count = blocks_count;
+    for (int i = 0; i < blocks_count; i++) {
+        pool->free_blocks[i] = blocks_count - 1 - i;
+    }
+    pool->free_count = blocks_count;
+    return SUCCESS;
+}
+
+static void pool_free(block_pool_t *pool) {
+    free(pool->slab);
+    free(pool->free_blocks);
+    pool->slab = NULL;
+    pool->free_blocks = NULL;
+    pool->free_count = 0;
+}
+
+/*
+ * falls back to malloc when every block is taken
+ */
+static char *pool_take(block_pool_t *pool) {
+    if (pool->free_count == 0) {
+        return malloc(pool->block_size + 1);
+    }
+    int index = pool->free_blocks[--pool->free_count];
+    return pool->slab + (size_t) index * (pool->block_size + 1);
+}
+
+static bool pool_owns(const block_pool_t *pool, const char *data) {
+    return pool->slab != NULL && data >= pool->slab
+           && data < pool->slab + (size_t) pool->blocks_count * (pool->block_size + 1);
+}
+
+static void pool_give_back(block_pool_t *pool, char *data) {
+    pool->free_blocks[pool->free_count++] = (int) ((size_t) (data - pool->slab) / (pool->block_size + 1));
+}
+
+int relay_buffers_init(relay_buffers_t *buffers) {
+    int return_value = pool_init(&buffers->small, RELAY_SMALL_BLOCK_SIZE, RELAY_SMALL_BLOCKS_COUNT);
+    if (return_value == FAIL) {
+        return FAIL;
+    }
+    return_value = pool_init(&buffers->large, RELAY_LARGE_BLOCK_SIZE, RELAY_LARGE_BLOCKS_COUNT);
+    if (return_value == FAIL) {
+        pool_free(&buffers->small);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+void relay_buffers_free(relay_buffers_t *buffers) {
+    pool_free(&buffers->small);
+    pool_free(&buffers->large);
+}
+
+void relay_release(relay_buffers_t *buffers, char *data) {
+    if (pool_owns(&buffers->small, data)) {
+        pool_give_back(&buffers->small, data);
+    } else if (pool_owns(&buffers->large, data)) {
+        pool_give_back(&buffers->large, data);
+    } else {
+        free(data);
+    }
+}
+
+static void update_hint(relay_hint_t *hint, size_t read_bytes) {
+    if (read_bytes > RELAY_SMALL_BLOCK_SIZE) {
+        hint->bulk = true;
+        hint->small_reads = 0;
+    } else if (hint->bulk && ++hint->small_reads >= RELAY_SMALL_READS_TO_SHRINK) {
+        hint->bulk = false;
+        hint->small_reads = 0;
+    }
+}
+
+message_t *relay_read(relay_buffers_t *buffers, relay_hint_t *hint, int fd, size_t limit) {
+    if (limit > RELAY_LARGE_BLOCK_SIZE) {
+        limit = RELAY_LARGE_BLOCK_SIZE;
+    }
+    block_pool_t *pool = hint->bulk ? &buffers->large : &buffers->small;
+    char *block = pool_take(pool);
+    if (block == NULL) {
+        return NULL;
+    }
+    char overflow[RELAY_LARGE_BLOCK_SIZE];
+    struct iovec parts[2];
+    int parts_count = 1;
+    parts[0].iov_base = block;
+    parts[0].iov_len = limit < pool->block_size ? limit : pool->block_size;
+    if (limit > parts[0].iov_len) {
+        parts[1].iov_base = overflow;
+        parts[1].iov_len = limit - parts[0].iov_len;
+        parts_count = 2;
+    }
+    ssize_t read_bytes;
+    do {
+        read_bytes = readv(fd, parts, parts_count);
+    } while (read_bytes == FAIL && errno == EINTR);
+    if (read_bytes == FAIL) {
+        int error_code = errno;
+        relay_release(buffers, block);
+        errno = error_code;
+        return NULL;
+    }
+    if ((size_t) read_bytes > parts[0].iov_len) {
+        // the block was too small, this happens once before the connection is seen as bulk
+        char *large_block = pool_take(&buffers->large);
+        if (large_block == NULL) {
+            relay_release(buffers, block);
+            return NULL;
+        }
+        memcpy(large_block, block, parts[0].iov_len);
+        memcpy(large_block + parts[0].iov_len, overflow, read_bytes - parts[0].iov_len);
+        relay_release(buffers, block);
+        block = large_block;
+    }
+    block[read_bytes] = '\0';
+    update_hint(hint, (size_t) read_bytes);
+    message_t *message = (message_t *) malloc(sizeof(*message));
+    if (message == NULL) {
+        relay_release(buffers, block);
+        return NULL;
+    }
+    message->data = block;
+    message->len = (size_t) read_bytes;
+    return message;
+}
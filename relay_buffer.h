@@ -0,0 +1,61 @@
+#ifndef PROXY_SERVER_RELAY_BUFFER_H
+#define PROXY_SERVER_RELAY_BUFFER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io_operations.h"
+
+/*
+ * Relayed data is read into blocks preallocated at start, in two sizes.
+ * A connection reads into a small block until its reads overflow one,
+ * then into large blocks until it has been quiet for a while again.
+ * Every read is one readv(): the block and an overflow area behind it,
+ * so a small block never costs a second syscall.
+ */
+
+#define RELAY_SMALL_BLOCK_SIZE (2 * 1024)
+#define RELAY_LARGE_BLOCK_SIZE (64 * 1024)
+#define RELAY_SMALL_BLOCKS_COUNT (1024)
+#define RELAY_LARGE_BLOCKS_COUNT (64)
+#define RELAY_SMALL_READS_TO_SHRINK (8) // a bulk connection goes back to small blocks after so many small reads
+
+typedef struct block_pool_t {
+    char *slab;
+    size_t block_size;
+    int blocks_count;
+    int *free_blocks; // stack of indexes, the last released block is reused first
+    int free_count;
+} block_pool_t;
+
+typedef struct relay_buffers_t {
+    block_pool_t small;
+    block_pool_t large;
+} relay_buffers_t;
+
+/*
+ * What a connection has shown so far, zeroed for a new connection
+ */
+typedef struct relay_hint_t {
+    bool bulk;
+    uint8_t small_reads;
+} relay_hint_t;
+
+int relay_buffers_init(relay_buffers_t *buffers);
+
+void relay_buffers_free(relay_buffers_t *buffers);
+
+/*
+ * Reads not more than limit bytes and updates hint. Same results as read_up_to:
+ * an empty message at the end of file, NULL with errno EAGAIN if there is nothing to read.
+ * The data of the message must be given back with relay_release().
+ */
+message_t *relay_read(relay_buffers_t *buffers, relay_hint_t *hint, int fd, size_t limit);
+
+/*
+ * Returns a block to its pool, data not from a pool is freed
+ */
+void relay_release(relay_buffers_t *buffers, char *data);
+
+#endif //PROXY_SERVER_RELAY_BUFFER_H
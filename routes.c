@@ -0,0 +1,398 @@
+#include "routes.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "blocklist.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define MAX_PORT (65535)
+#define MAX_TOKENS (5)
+#define SEPARATORS " \t\r\n"
+#define INITIAL_CAPACITY (64)
+
+#ifndef IP_BIND_ADDRESS_NO_PORT
+#define IP_BIND_ADDRESS_NO_PORT (24)
+#endif
+
+typedef struct domain_line_t {
+    char name[BLOCKLIST_MAX_NAME + 1];
+    uint32_t line; // routes of one domain are tried in the order of lines
+    acl_rule_t rule;
+} domain_line_t;
+
+typedef struct routes_builder_t {
+    acl_entry_t *prefixes;
+    size_t prefixes_count;
+    size_t prefixes_capacity;
+    domain_line_t *domains;
+    size_t domains_count;
+    size_t domains_capacity;
+    size_t egresses_capacity;
+} routes_builder_t;
+
+static bool grow(void **array, size_t *capacity, size_t needed, size_t item_size) {
+    if (needed <= *capacity) {
+        return true;
+    }
+    size_t new_capacity = *capacity == 0 ? INITIAL_CAPACITY : *capacity;
+    while (new_capacity < needed) {
+        new_capacity *= 2;
+    }
+    void *grown = realloc(*array, new_capacity * item_size);
+    if (grown == NULL) {
+        return false;
+    }
+    *array = grown;
+    *capacity = new_capacity;
+    return true;
+}
+
+static int parse_egress(char **tokens, int count, route_egress_t *egress) {
+    memset(egress, 0, sizeof(*egress));
+    if (count == 1 && strcmp(tokens[0], "direct") == 0) {
+        egress->kind = ROUTE_DIRECT;
+        return SUCCESS;
+    }
+    if (count != 2) {
+        return FAIL;
+    }
+    if (strcmp(tokens[0], "source") == 0) {
+        egress->kind = ROUTE_SOURCE;
+        return inet_pton(AF_INET, tokens[1], &egress->address) == 1 ? SUCCESS : FAIL;
+    }
+    if (strcmp(tokens[0], "interface") == 0) {
+        if (strlen(tokens[1]) >= sizeof(egress->interface)) {
+            return FAIL;
+        }
+        egress->kind = ROUTE_INTERFACE;
+        strcpy(egress->interface, tokens[1]);
+        return SUCCESS;
+    }
+    if (strcmp(tokens[0], "parent") == 0) {
+        char *colon = strrchr(tokens[1], ':');
+        long port = 0;
+        if (colon == NULL) {
+            return FAIL;
+        }
+        *colon = '\0';
+        if (inet_pton(AF_INET, tokens[1], &egress->address) != 1
+            || acl_parse_number(colon + 1, MAX_PORT, &port) == FAIL || port == 0) {
+            return FAIL;
+        }
+        egress->kind = ROUTE_PARENT;
+        egress->port = (uint16_t) port;
+        return SUCCESS;
+    }
+    return FAIL;
+}
+
+/*
+ * Lower case, no leading or trailing dot, no empty labels
+ */
+static int parse_domain(const char *text, char *name) {
+    if (*text == '.') {
+        text++;
+    }
+    size_t len = strlen(text);
+    if (len > 0 && text[len - 1] == '.') {
+        len--;
+    }
+    if (len == 0 || len > BLOCKLIST_MAX_NAME) {
+        return FAIL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char) text[i];
+        if (c == '.' ? i == 0 || text[i - 1] == '.' : !isalnum(c) && c != '-' && c != '_') {
+            return FAIL;
+        }
+        name[i] = (char) tolower(c);
+    }
+    name[len] = '\0';
+    return SUCCESS;
+}
+
+static int add_prefix(routes_builder_t *builder, const acl_entry_t *entry) {
+    if (!grow((void **) &builder->prefixes, &builder->prefixes_capacity, builder->prefixes_count + 1,
+              sizeof(acl_entry_t))) {
+        return FAIL;
+    }
+    builder->prefixes[builder->prefixes_count++] = *entry;
+    return SUCCESS;
+}
+
+/*
+ * Returns FAIL on a wrong line, *out_of_memory tells it from a failed allocation
+ */
+static int parse_line(char *line, int line_number, routes_t *routes, routes_builder_t *builder,
+                      bool *out_of_memory) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+    char *tokens[MAX_TOKENS];
+    int count = 0;
+    char *position = NULL;
+    for (char *token = strtok_r(line, SEPARATORS, &position); token != NULL;
+         token = strtok_r(NULL, SEPARATORS, &position)) {
+        if (count == MAX_TOKENS) {
+            return FAIL;
+        }
+        tokens[count++] = token;
+    }
+    if (count == 0) {
+        return SUCCESS;
+    }
+    route_egress_t egress;
+    if (strcmp(tokens[0], "default") == 0) {
+        if (parse_egress(tokens + 1, count - 1, &egress) == FAIL) {
+            return FAIL;
+        }
+        routes->egresses[0] = egress;
+        return SUCCESS;
+    }
+    acl_rule_t rule;
+    int first_egress_token = count > 1 && isdigit((unsigned char) tokens[1][0]) ? 2 : 1;
+    if (acl_parse_ports(first_egress_token == 2 ? tokens[1] : NULL, &rule) == FAIL
+        || parse_egress(tokens + first_egress_token, count - first_egress_token, &egress) == FAIL) {
+        return FAIL;
+    }
+    if (!grow((void **) &routes->egresses, &builder->egresses_capacity, routes->egresses_count + 1,
+              sizeof(route_egress_t))) {
+        *out_of_memory = true;
+        return FAIL;
+    }
+    rule.value = (uint32_t) routes->egresses_count;
+    routes->egresses[routes->egresses_count++] = egress;
+    acl_entry_t entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.rule = rule;
+    if (strcmp(tokens[0], "*") == 0) {
+        entry.family = AF_INET;
+        int return_value = add_prefix(builder, &entry);
+        entry.family = AF_INET6;
+        if (return_value == FAIL || add_prefix(builder, &entry) == FAIL) {
+            *out_of_memory = true;
+            return FAIL;
+        }
+        return SUCCESS;
+    }
+    // what is not an address may be a domain
+    if (acl_parse_prefix(tokens[0], &entry) == SUCCESS) {
+        if (add_prefix(builder, &entry) == FAIL) {
+            *out_of_memory = true;
+            return FAIL;
+        }
+        return SUCCESS;
+    }
+    if (strchr(tokens[0], '/') != NULL) {
+        return FAIL;
+    }
+    if (!grow((void **) &builder->domains, &builder->domains_capacity, builder->domains_count + 1,
+              sizeof(domain_line_t))) {
+        *out_of_memory = true;
+        return FAIL;
+    }
+    domain_line_t *domain = &builder->domains[builder->domains_count];
+    if (parse_domain(tokens[0], domain->name) == FAIL) {
+        return FAIL;
+    }
+    domain->line = (uint32_t) line_number;
+    domain->rule = rule;
+    builder->domains_count++;
+    return SUCCESS;
+}
+
+static int compare_domains(const void *a, const void *b) {
+    const domain_line_t *first = (const domain_line_t *) a;
+    const domain_line_t *second = (const domain_line_t *) b;
+    int difference = strcmp(first->name, second->name);
+    if (difference != 0) {
+        return difference;
+    }
+    return first->line < second->line ? -1 : first->line > second->line;
+}
+
+static const route_domain_t *find_domain(const routes_t *routes, const char *name, size_t len) {
+    uint64_t hash = blocklist_hash(name, len);
+    uint32_t tag = (uint32_t) (hash >> 32);
+    uint32_t slot = blocklist_slot_of(hash, routes->slots_count);
+    while (routes->domains[slot].offset != 0) {
+        const route_domain_t *domain = &routes->domains[slot];
+        const char *stored = routes->names + domain->offset;
+        if (domain->tag == tag && (uint8_t) stored[0] == len && memcmp(stored + 1, name, len) == 0) {
+            return domain;
+        }
+        slot = slot + 1 == routes->slots_count ? 0 : slot + 1;
+    }
+    return NULL;
+}
+
+/*
+ * The routes of a domain are joined in a row and the domain is kept once
+ */
+static int compile_domains(routes_t *routes, domain_line_t *lines, size_t count) {
+    if (count == 0) {
+        return SUCCESS;
+    }
+    qsort(lines, count, sizeof(*lines), compare_domains);
+    routes->slots_count = (uint32_t) count * 2 + 1;
+    routes->domains = (route_domain_t *) calloc(routes->slots_count, sizeof(route_domain_t));
+    routes->domain_rules = (acl_rule_t *) malloc(count * sizeof(acl_rule_t));
+    // offset 0 marks an empty slot, so the names start at 1
+    size_t names_capacity = 1;
+    for (size_t i = 0; i < count; i++) {
+        names_capacity += 1 + strlen(lines[i].name);
+    }
+    routes->names = (char *) malloc(names_capacity);
+    if (routes->domains == NULL || routes->domain_rules == NULL || routes->names == NULL) {
+        return FAIL;
+    }
+    routes->names_size = 1;
+    route_domain_t *domain = NULL;
+    for (size_t i = 0; i < count; i++) {
+        if (domain == NULL || strcmp(lines[i - 1].name, lines[i].name) != 0) {
+            size_t len = strlen(lines[i].name);
+            uint64_t hash = blocklist_hash(lines[i].name, len);
+            uint32_t slot = blocklist_slot_of(hash, routes->slots_count);
+            while (routes->domains[slot].offset != 0) {
+                slot = slot + 1 == routes->slots_count ? 0 : slot + 1;
+            }
+            domain = &routes->domains[slot];
+            domain->tag = (uint32_t) (hash >> 32);
+            domain->offset = (uint32_t) routes->names_size;
+            domain->first_rule = (uint32_t) routes->domain_rules_count;
+            domain->rules_count = 0;
+            routes->names[routes->names_size] = (char) len;
+            memcpy(routes->names + routes->names_size + 1, lines[i].name, len);
+            routes->names_size += 1 + len;
+            routes->domains_count++;
+        }
+        routes->domain_rules[routes->domain_rules_count++] = lines[i].rule;
+        domain->rules_count++;
+    }
+    return SUCCESS;
+}
+
+routes_t *routes_load(const char *path, int *error_line) {
+    *error_line = 0;
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return NULL;
+    }
+    routes_builder_t builder;
+    memset(&builder, 0, sizeof(builder));
+    routes_t *routes = (routes_t *) calloc(1, sizeof(*routes));
+    bool failed = routes == NULL || !grow((void **) &routes->egresses, &builder.egresses_capacity, 1,
+                                          sizeof(route_egress_t));
+    if (!failed) {
+        // without a default the rest goes direct
+        memset(&routes->egresses[0], 0, sizeof(route_egress_t));
+        routes->egresses_count = 1;
+    }
+    char line[ROUTES_MAX_LINE];
+    int line_number = 0;
+    while (!failed && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+        bool too_long = strchr(line, '\n') == NULL && !feof(file);
+        bool out_of_memory = false;
+        if (too_long || parse_line(line, line_number, routes, &builder, &out_of_memory) == FAIL) {
+            *error_line = out_of_memory ? 0 : line_number;
+            failed = true;
+        }
+    }
+    failed = failed || ferror(file);
+    fclose(file);
+    if (!failed) {
+        routes->prefixes = acl_compile(builder.prefixes, builder.prefixes_count, 0);
+        failed = routes->prefixes == NULL
+                 || compile_domains(routes, builder.domains, builder.domains_count) == FAIL;
+    }
+    free(builder.prefixes);
+    free(builder.domains);
+    if (failed) {
+        routes_free(routes);
+        return NULL;
+    }
+    return routes;
+}
+
+bool routes_find_domain(const routes_t *routes, const char *host, uint16_t port, route_egress_t *egress) {
+    if (routes->slots_count == 0) {
+        return false;
+    }
+    size_t len = strlen(host);
+    if (len > 0 && host[len - 1] == '.') {
+        len--;
+    }
+    if (len == 0 || len > BLOCKLIST_MAX_NAME) {
+        return false;
+    }
+    char name[BLOCKLIST_MAX_NAME];
+    for (size_t i = 0; i < len; i++) {
+        name[i] = (char) tolower((unsigned char) host[i]);
+    }
+    // the most specific domain first, one whose routes do not cover the port leaves it to the next
+    for (size_t start = 0; start < len; start++) {
+        if (start > 0 && name[start - 1] != '.') {
+            continue;
+        }
+        const route_domain_t *domain = find_domain(routes, name + start, len - start);
+        for (uint32_t i = 0; domain != NULL && i < domain->rules_count; i++) {
+            const acl_rule_t *rule = &routes->domain_rules[domain->first_rule + i];
+            if (port >= rule->first_port && port <= rule->last_port) {
+                *egress = routes->egresses[rule->value];
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+route_egress_t routes_find_address(const routes_t *routes, int family, const void *address, uint16_t port) {
+    return routes->egresses[acl_lookup(routes->prefixes, family, address, port)];
+}
+
+int route_egress_bind(const route_egress_t *egress, int sd) {
+    if (egress->kind == ROUTE_INTERFACE) {
+        return setsockopt(sd, SOL_SOCKET, SO_BINDTODEVICE, egress->interface, (socklen_t) strlen(egress->interface));
+    }
+    if (egress->kind != ROUTE_SOURCE) {
+        return SUCCESS;
+    }
+    // the kernel picks the port at connect time, as for the source address pool
+    int option_value = 1;
+    int return_value = setsockopt(sd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &option_value, sizeof(option_value));
+    if (return_value == FAIL) {
+        return FAIL;
+    }
+    struct sockaddr_in source;
+    memset(&source, 0, sizeof(source));
+    source.sin_family = AF_INET;
+    source.sin_addr = egress->address;
+    source.sin_port = 0;
+    return bind(sd, (struct sockaddr *) &source, sizeof(source));
+}
+
+size_t routes_memory_size(const routes_t *routes) {
+    return sizeof(*routes) + acl_memory_size(routes->prefixes) + routes->slots_count * sizeof(route_domain_t)
+           + routes->names_size + routes->domain_rules_count * sizeof(acl_rule_t)
+           + routes->egresses_count * sizeof(route_egress_t);
+}
+
+void routes_free(routes_t *routes) {
+    if (routes == NULL) {
+        return;
+    }
+    acl_free(routes->prefixes);
+    free(routes->domains);
+    free(routes->names);
+    free(routes->domain_rules);
+    free(routes->egresses);
+    free(routes);
+}
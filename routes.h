@@ -0,0 +1,104 @@
+#ifndef PROXY_SERVER_ROUTES_H
+#define PROXY_SERVER_ROUTES_H
+
+#include <net/if.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "acl.h"
+
+/*
+ * Policy based routing, the egress path of a tunnel is chosen by its
+ * destination. A file of routes, one per line:
+ *
+ *     <destination> [<port>[-<port>]] <egress>
+ *     default <egress>
+ *
+ * A destination is an <ipv4>|<ipv6>[/<bits>] prefix, a domain, which
+ * covers its subdomains too, or * for any address. An egress is one of:
+ *
+ *     direct                 from the source address pool if there is one
+ *     source <ipv4>          from the local address
+ *     interface <name>       through the network interface
+ *     parent <ipv4>:<port>   through a SOCKS5 proxy without authentication
+ *
+ * A name goes by the most specific domain whose routes cover the port.
+ * A name no domain route covers is resolved and goes by its address,
+ * an address by the longest prefix whose routes cover the port, as in
+ * the destination rules. Routes of one destination are tried in the
+ * order of the file. Without a default the rest goes direct.
+ *
+ * A name routed to a parent is sent to it as a name. With destination
+ * rules it is resolved here too and refused if its address is denied,
+ * the parent may still connect to another address the name has.
+ *
+ * The prefixes are compiled into the poptrie of acl.h, the domains into
+ * a hash table looked up for every suffix of the name, as the blocklist.
+ * The table is never changed after it is loaded, a reload loads a new one.
+ */
+
+#define ROUTES_MAX_LINE (256)
+
+typedef enum route_kind_t {
+    ROUTE_DIRECT,
+    ROUTE_SOURCE,
+    ROUTE_INTERFACE,
+    ROUTE_PARENT
+} route_kind_t;
+
+typedef struct route_egress_t {
+    route_kind_t kind;
+    struct in_addr address; // the source, or the parent proxy
+    uint16_t port;          // of the parent proxy
+    char interface[IFNAMSIZ];
+} route_egress_t;
+
+typedef struct route_domain_t {
+    uint32_t tag;    // the upper half of the hash
+    uint32_t offset; // of the name among the names, 0 for an empty slot
+    uint32_t first_rule;
+    uint32_t rules_count;
+} route_domain_t;
+
+typedef struct routes_t {
+    acl_t *prefixes; // the values of its rules are egresses
+    route_domain_t *domains;
+    uint32_t slots_count; // 0 without domain routes
+    uint32_t domains_count;
+    char *names; // each a length byte and the name in lower case
+    size_t names_size;
+    acl_rule_t *domain_rules; // of one domain in a row, their values are egresses
+    size_t domain_rules_count;
+    route_egress_t *egresses; // 0 is the default
+    size_t egresses_count;
+} routes_t;
+
+/*
+ * Returns NULL if the file cannot be read or a line is wrong,
+ * *error_line is the number of the line then, 0 if it is not about a line
+ */
+routes_t *routes_load(const char *path, int *error_line);
+
+/*
+ * host is a name in any case, it may end with a dot. Returns false
+ * if no domain route covers it, it goes by its address then.
+ */
+bool routes_find_domain(const routes_t *routes, const char *host, uint16_t port, route_egress_t *egress);
+
+/*
+ * address is 4 bytes for AF_INET and 16 for AF_INET6, in network order
+ */
+route_egress_t routes_find_address(const routes_t *routes, int family, const void *address, uint16_t port);
+
+/*
+ * Binds sd to the source address or the interface of a source or an interface egress
+ */
+int route_egress_bind(const route_egress_t *egress, int sd);
+
+size_t routes_memory_size(const routes_t *routes);
+
+void routes_free(routes_t *routes);
+
+#endif //PROXY_SERVER_ROUTES_H
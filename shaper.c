@@ -0,0 +1,156 @@
+#include "shaper.h"
+
+#include <string.h>
+
+#define NS_PER_SEC (1000000000ULL)
+#define BURSTS_PER_SEC (100) // the burst is what the rate gives in 10 ms
+#define HASH_MULTIPLIER (0x9E3779B1U)
+#define HASH_BITS (12) // log2(SHAPER_GROUPS_SIZE)
+
+static shaper_rate_t make_rate(long bytes_per_sec) {
+    shaper_rate_t rate = {0, 0};
+    if (bytes_per_sec > 0) {
+        rate.bytes_per_sec = (uint64_t) bytes_per_sec;
+        rate.burst = rate.bytes_per_sec / BURSTS_PER_SEC;
+        if (rate.burst < SHAPER_MIN_BURST) {
+            rate.burst = SHAPER_MIN_BURST;
+        }
+    }
+    return rate;
+}
+
+void shaper_init(shaper_t *shaper, long tunnel_bytes_per_sec, long group_bytes_per_sec) {
+    memset(shaper, 0, sizeof(*shaper));
+    shaper->tunnel_rate = make_rate(tunnel_bytes_per_sec);
+    shaper->group_rate = make_rate(group_bytes_per_sec);
+    shaper->enabled = shaper->tunnel_rate.bytes_per_sec != 0 || shaper->group_rate.bytes_per_sec != 0;
+}
+
+static uint32_t slot_of(uint32_t address) {
+    return (address * HASH_MULTIPLIER) >> (32 - HASH_BITS);
+}
+
+shaper_group_t *shaper_join(shaper_t *shaper, uint32_t address, uint64_t now_ns) {
+    if (shaper->group_rate.bytes_per_sec == 0) {
+        return NULL;
+    }
+    shaper_group_t *reusable = NULL;
+    uint32_t slot = slot_of(address);
+    for (int probe = 0; probe < SHAPER_MAX_PROBES; probe++) {
+        shaper_group_t *group = &shaper->groups[(slot + probe) & (SHAPER_GROUPS_SIZE - 1)];
+        if (group->address == address) {
+            group->tunnels++;
+            return group;
+        }
+        if (group->address == 0) {
+            if (reusable == NULL) {
+                reusable = group;
+            }
+            break;
+        }
+        // a group without tunnels and with a full bucket is expired
+        if (reusable == NULL && group->tunnels == 0
+            && __atomic_load_n(&group->bucket.full_at_ns, __ATOMIC_RELAXED) <= now_ns) {
+            reusable = group;
+        }
+    }
+    if (reusable != NULL) {
+        reusable->address = address;
+        reusable->tunnels = 1;
+        __atomic_store_n(&reusable->bucket.full_at_ns, now_ns, __ATOMIC_RELAXED);
+    }
+    return reusable;
+}
+
+void shaper_leave(shaper_group_t *group) {
+    if (group != NULL && group->tunnels > 0) {
+        group->tunnels--;
+    }
+}
+
+/*
+ * Group buckets are read and written by several workers at once
+ */
+static uint64_t bucket_full_at_ns(const shaper_bucket_t *bucket) {
+    return __atomic_load_n(&bucket->full_at_ns, __ATOMIC_RELAXED);
+}
+
+static uint64_t bucket_available(const shaper_rate_t *rate, const shaper_bucket_t *bucket, uint64_t now_ns) {
+    uint64_t full_at_ns = bucket_full_at_ns(bucket);
+    if (full_at_ns <= now_ns) {
+        return rate->burst;
+    }
+    uint64_t missing = (full_at_ns - now_ns) * rate->bytes_per_sec / NS_PER_SEC;
+    return missing >= rate->burst ? 0 : rate->burst - missing;
+}
+
+static void bucket_consume(const shaper_rate_t *rate, shaper_bucket_t *bucket, uint64_t now_ns, size_t bytes) {
+    uint64_t from_ns = bucket->full_at_ns > now_ns ? bucket->full_at_ns : now_ns;
+    bucket->full_at_ns = from_ns + (uint64_t) bytes * NS_PER_SEC / rate->bytes_per_sec;
+}
+
+/*
+ * As bucket_consume, but a consumption by another worker in between is
+ * not lost: the new time is only stored if the old one has not changed
+ */
+static void shared_bucket_consume(const shaper_rate_t *rate, shaper_bucket_t *bucket, uint64_t now_ns,
+                                  size_t bytes) {
+    uint64_t cost_ns = (uint64_t) bytes * NS_PER_SEC / rate->bytes_per_sec;
+    uint64_t full_at_ns = bucket_full_at_ns(bucket);
+    uint64_t next_ns;
+    do {
+        next_ns = (full_at_ns > now_ns ? full_at_ns : now_ns) + cost_ns;
+    } while (!__atomic_compare_exchange_n(&bucket->full_at_ns, &full_at_ns, next_ns, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static uint64_t bucket_wait_ns(const shaper_rate_t *rate, const shaper_bucket_t *bucket, uint64_t now_ns) {
+    // the bucket holds a grant when it lacks no more than burst - grant
+    uint64_t spare_ns = (rate->burst - SHAPER_MIN_GRANT) * NS_PER_SEC / rate->bytes_per_sec;
+    uint64_t full_at_ns = bucket_full_at_ns(bucket);
+    if (full_at_ns <= now_ns + spare_ns) {
+        return 0;
+    }
+    return full_at_ns - spare_ns - now_ns;
+}
+
+size_t shaper_allowance(const shaper_t *shaper, const shaper_bucket_t *tunnel, const shaper_group_t *group,
+                        uint64_t now_ns, size_t limit) {
+    uint64_t allowance = limit;
+    if (shaper->tunnel_rate.bytes_per_sec != 0) {
+        uint64_t available = bucket_available(&shaper->tunnel_rate, tunnel, now_ns);
+        allowance = available < allowance ? available : allowance;
+    }
+    if (group != NULL) {
+        uint64_t available = bucket_available(&shaper->group_rate, &group->bucket, now_ns);
+        allowance = available < allowance ? available : allowance;
+    }
+    if (allowance < SHAPER_MIN_GRANT && allowance < limit) {
+        // many tiny reads would cost more than waiting for a grant
+        return 0;
+    }
+    return (size_t) allowance;
+}
+
+void shaper_consume(const shaper_t *shaper, shaper_bucket_t *tunnel, shaper_group_t *group,
+                    uint64_t now_ns, size_t bytes) {
+    if (shaper->tunnel_rate.bytes_per_sec != 0) {
+        bucket_consume(&shaper->tunnel_rate, tunnel, now_ns, bytes);
+    }
+    if (group != NULL) {
+        shared_bucket_consume(&shaper->group_rate, &group->bucket, now_ns, bytes);
+    }
+}
+
+uint64_t shaper_wait_ns(const shaper_t *shaper, const shaper_bucket_t *tunnel, const shaper_group_t *group,
+                        uint64_t now_ns) {
+    uint64_t wait_ns = 0;
+    if (shaper->tunnel_rate.bytes_per_sec != 0) {
+        wait_ns = bucket_wait_ns(&shaper->tunnel_rate, tunnel, now_ns);
+    }
+    if (group != NULL) {
+        uint64_t group_wait_ns = bucket_wait_ns(&shaper->group_rate, &group->bucket, now_ns);
+        wait_ns = group_wait_ns > wait_ns ? group_wait_ns : wait_ns;
+    }
+    return wait_ns;
+}
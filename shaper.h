@@ -0,0 +1,75 @@
+#ifndef PROXY_SERVER_SHAPER_H
+#define PROXY_SERVER_SHAPER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bandwidth shaping with token buckets: one bucket per tunnel and one
+ * per group of tunnels of the same client IP. A relayed read may take
+ * only as many bytes as both buckets hold, when one of them is empty
+ * the proxy stops reading the descriptor until shaper_wait_ns() passes.
+ *
+ * A tunnel bucket belongs to the worker of the tunnel. A group bucket is
+ * shared by the workers and updated with compare and swap, so relaying
+ * takes no lock. Joining and leaving a group must be serialized.
+ */
+
+#define SHAPER_GROUPS_SIZE (4096) // must be a power of two
+#define SHAPER_MAX_PROBES (16)
+#define SHAPER_MIN_BURST (16 * 1024)
+#define SHAPER_MIN_GRANT (4 * 1024) // a paused descriptor is resumed when this much can be read
+
+/*
+ * A bucket is kept as the time when it is full again, so refilling
+ * costs nothing and a zeroed bucket is full.
+ */
+typedef struct shaper_bucket_t {
+    uint64_t full_at_ns;
+} shaper_bucket_t;
+
+typedef struct shaper_group_t {
+    uint32_t address; // IPv4 in network order, 0 for a never used slot
+    uint32_t tunnels;
+    shaper_bucket_t bucket;
+} shaper_group_t;
+
+typedef struct shaper_rate_t {
+    uint64_t bytes_per_sec; // 0 if not limited
+    uint64_t burst;
+} shaper_rate_t;
+
+typedef struct shaper_t {
+    bool enabled;
+    shaper_rate_t tunnel_rate;
+    shaper_rate_t group_rate;
+    shaper_group_t groups[SHAPER_GROUPS_SIZE];
+} shaper_t;
+
+void shaper_init(shaper_t *shaper, long tunnel_bytes_per_sec, long group_bytes_per_sec);
+
+/*
+ * returns the group of address or NULL if group shaping is off or there is no free slot
+ */
+shaper_group_t *shaper_join(shaper_t *shaper, uint32_t address, uint64_t now_ns);
+
+void shaper_leave(shaper_group_t *group);
+
+/*
+ * returns how many bytes can be relayed now, not more than limit.
+ * Returns 0 if it is less than SHAPER_MIN_GRANT.
+ */
+size_t shaper_allowance(const shaper_t *shaper, const shaper_bucket_t *tunnel, const shaper_group_t *group,
+                        uint64_t now_ns, size_t limit);
+
+void shaper_consume(const shaper_t *shaper, shaper_bucket_t *tunnel, shaper_group_t *group,
+                    uint64_t now_ns, size_t bytes);
+
+/*
+ * returns how long to wait until SHAPER_MIN_GRANT can be relayed
+ */
+uint64_t shaper_wait_ns(const shaper_t *shaper, const shaper_bucket_t *tunnel, const shaper_group_t *group,
+                        uint64_t now_ns);
+
+#endif //PROXY_SERVER_SHAPER_H
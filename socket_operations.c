@@ -2,13 +2,21 @@
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <ifaddrs.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #define FAIL (-1)
 #define SUCCESS (0)
+#define MAX_PASSED_DESCRIPTORS (64)
+#ifndef SO_ORIGINAL_DST
+#define SO_ORIGINAL_DST (80)
+#endif
 
 /*
  * When writing a server, we need to be ready to react to many kinds of event
@@ -18,7 +26,7 @@
  * In this case you need to make a socket unblocking
  */
 int set_nonblocking(int serv_socket) {
-    int option_value;
+    int option_value = 1;
     int return_value = ioctl(serv_socket, FIONBIO, (char *) &option_value); // Set socket to be nonblocking
     if (return_value == FAIL) {
         perror("=== Error in ioctl");
@@ -28,7 +36,7 @@ int set_nonblocking(int serv_socket) {
 }
 
 int set_reusable(int serv_socket) {
-    int option_value;
+    int option_value = 1;
     int return_value = setsockopt(serv_socket, SOL_SOCKET, SO_REUSEADDR, // Allow socket descriptor to be reuseable
                                   (char *) &option_value, sizeof(option_value));
     if (return_value == FAIL) {
@@ -42,6 +50,49 @@ int set_reusable(int serv_socket) {
     return SUCCESS;
 }
 
+int set_reusable_port(int socket) {
+    int option_value = 1;
+    return setsockopt(socket, SOL_SOCKET, SO_REUSEPORT, (char *) &option_value, sizeof(option_value));
+}
+
+int set_nodelay(int socket) {
+    int option_value = 1;
+    return setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (char *) &option_value, sizeof(option_value));
+}
+
+int get_original_destination(int socket, struct sockaddr_in *destination) {
+    socklen_t len = sizeof(*destination);
+    int return_value = getsockopt(socket, SOL_IP, SO_ORIGINAL_DST, destination, &len);
+    if (return_value == SUCCESS) {
+        return SUCCESS;
+    }
+    // not NATed, the connection was delivered as it is
+    len = sizeof(*destination);
+    return_value = getsockname(socket, (struct sockaddr *) destination, &len);
+    if (return_value == FAIL || destination->sin_family != AF_INET) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+bool is_local_address(struct in_addr address) {
+    if ((ntohl(address.s_addr) >> 24) == IN_LOOPBACKNET) {
+        return true;
+    }
+    struct ifaddrs *addresses = NULL;
+    if (getifaddrs(&addresses) == FAIL) {
+        // as if it were ours, a connection that may loop is rather closed
+        return true;
+    }
+    bool local = false;
+    for (struct ifaddrs *entry = addresses; entry != NULL && !local; entry = entry->ifa_next) {
+        local = entry->ifa_addr != NULL && entry->ifa_addr->sa_family == AF_INET
+                && ((struct sockaddr_in *) entry->ifa_addr)->sin_addr.s_addr == address.s_addr;
+    }
+    freeifaddrs(addresses);
+    return local;
+}
+
 /*
  * returns non-blocking socket descriptor
  */
@@ -94,3 +145,66 @@ int make_new_connection_sockaddr(struct sockaddr_in *addr, int port) {
     }
     return client_sd;
 }
+
+int send_descriptors(int unix_socket, const int *fds, int count) {
+    if (count <= 0 || count > MAX_PASSED_DESCRIPTORS) {
+        return FAIL;
+    }
+    char payload = (char) count;
+    struct iovec iov = {
+            .iov_base = &payload,
+            .iov_len = sizeof(payload)
+    };
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_DESCRIPTORS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(header), fds, sizeof(int) * count);
+    ssize_t sent = sendmsg(unix_socket, &message, 0);
+    if (sent != sizeof(payload)) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+int receive_descriptors(int unix_socket, int *fds, int max_count) {
+    char payload = 0;
+    struct iovec iov = {
+            .iov_base = &payload,
+            .iov_len = sizeof(payload)
+    };
+    char control[CMSG_SPACE(sizeof(int) * MAX_PASSED_DESCRIPTORS)];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(unix_socket, &message, MSG_CMSG_CLOEXEC);
+    if (received != sizeof(payload)) {
+        return FAIL;
+    }
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+        return FAIL;
+    }
+    int count = (int) ((header->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    int passed[MAX_PASSED_DESCRIPTORS];
+    memcpy(passed, CMSG_DATA(header), sizeof(int) * count);
+    for (int i = max_count; i < count; i++) {
+        close(passed[i]);
+    }
+    if (count > max_count) {
+        count = max_count;
+    }
+    memcpy(fds, passed, sizeof(int) * count);
+    return count;
+}
@@ -2,14 +2,46 @@
 #define PROXY_SERVER_SOCKET_OPERATIONS_H
 
 #include <arpa/inet.h>
+#include <stdbool.h>
 
 int set_nonblocking(int serv_socket);
 
 int set_reusable(int serv_socket);
 
+/*
+ * Lets several sockets listen on one port, the kernel spreads connections between them
+ */
+int set_reusable_port(int socket);
+
+/*
+ * Disables Nagle's algorithm, small writes are sent at once
+ */
+int set_nodelay(int socket);
+
+/*
+ * Where a connection redirected to us by the firewall was going. REDIRECT
+ * keeps it in SO_ORIGINAL_DST, with TPROXY it is the local address.
+ */
+int get_original_destination(int socket, struct sockaddr_in *destination);
+
+/*
+ * true for loopback and the addresses of the interfaces of this host
+ */
+bool is_local_address(struct in_addr address);
+
 int connect_to_address(char *serv_ipv4_address, int port,
                        struct timeval *timeout);
 
 int make_new_connection_sockaddr(struct sockaddr_in *addr, int port);
 
+/*
+ * Passes descriptors to another process over a unix domain socket (SCM_RIGHTS)
+ */
+int send_descriptors(int unix_socket, const int *fds, int count);
+
+/*
+ * returns the number of received descriptors or FAIL
+ */
+int receive_descriptors(int unix_socket, int *fds, int max_count);
+
 #endif //PROXY_SERVER_SOCKET_OPERATIONS_H
@@ -276,6 +276,78 @@ conn_request_info_t *parse_conn_request_message(const message_t *message, bool a
     return res;
 }
 
+/*
+ * 	           VN  CD  DSTPORT  DSTIP  USERID  NULL  [DOMAIN  NULL]
+    Byte Count	1	1	  2       4    variable  1   [variable  1]
+ * returns NULL in case of error
+ */
+conn_request_info_t *parse_socks4_request_message(const message_t *message, bool allow_print_error) {
+    assert(message);
+    assert(message->data);
+    size_t len = message->len;
+    if (len < 1 + 1 + 2 + 4 + 1) {
+        if (allow_print_error) fprintf(stderr, "bad length\n");
+        return NULL;
+    }
+    if (message->data[0] != SOCKS4_VERSION) {
+        if (allow_print_error) fprintf(stderr, "=== bad socks version: %d\n", (int) message->data[0]);
+        return NULL;
+    }
+    const unsigned char *data = (const unsigned char *) message->data;
+    size_t current_idx = 1 + 1 + 2 + 4;
+    // the user id is not checked
+    const char *user_id_end = memchr(message->data + current_idx, 0, len - current_idx);
+    if (user_id_end == NULL) {
+        if (allow_print_error) fprintf(stderr, "not enough length for user id\n");
+        return NULL;
+    }
+    current_idx = user_id_end - message->data + 1;
+    conn_request_info_t *res = (conn_request_info_t *) malloc(sizeof(*res));
+    if (NULL == res) {
+        if (allow_print_error) fprintf(stderr, "memory error\n");
+        return NULL;
+    }
+    res->command_code = message->data[1];
+    res->dest_port = (data[2] << 8) | data[3];
+    // 0.0.0.x with x != 0 means that the domain follows the user id
+    if (data[4] == 0 && data[5] == 0 && data[6] == 0 && data[7] != 0) {
+        const char *domain_end = memchr(message->data + current_idx, 0, len - current_idx);
+        size_t domain_len = domain_end == NULL ? 0 : domain_end - (message->data + current_idx);
+        if (domain_len == 0 || domain_len >= ADDR_BUFFER_SIZE) {
+            if (allow_print_error) fprintf(stderr, "bad domain\n");
+            free(res);
+            return NULL;
+        }
+        memcpy(res->dest_address, message->data + current_idx, domain_len);
+        res->dest_address[domain_len] = 0;
+        res->address_type = DOMAIN_TYPE;
+    } else {
+        sprintf(res->dest_address, "%hhu.%hhu.%hhu.%hhu", data[4], data[5], data[6], data[7]);
+        res->address_type = IPV4_TYPE;
+    }
+    return res;
+}
+
+/*
+ * 	           VN  CD  DSTPORT  DSTIP
+    Byte Count	1	1	  2       4
+ * the port and the address are ignored by clients and left zero
+ */
+message_t *create_socks4_response_message(char status_code) {
+    message_t *message = (message_t *) malloc(sizeof(*message));
+    if (message == NULL) {
+        return message;
+    }
+    message->len = 1 + 1 + 2 + 4;
+    message->data = (char *) calloc(message->len + 1, 1);
+    if (message->data == NULL) {
+        free(message);
+        return NULL;
+    }
+    message->data[1] = status_code;
+    return message;
+}
+
 /*
  * returns NULL in case of error
  */
@@ -299,3 +371,39 @@ server_response_t *parse_response_message(const message_t *message, bool allow_p
     free(packet);
     return res;
 }
+
+/*
+ * 	          VER	CAUTH	VER	STATUS	RSV	BNDADDR	 BNDPORT
+    Byte count	1	  1	     1	  1	     1	variable	2
+ */
+parent_reply_result_t parent_reply_feed(parent_reply_t *reply, const char *data, size_t len, size_t *consumed) {
+    *consumed = 0;
+    while (*consumed < len && (reply->len == 0 || reply->read < reply->len)) {
+        uint8_t byte = (uint8_t) data[(*consumed)++];
+        if (reply->read < sizeof(reply->head)) {
+            reply->head[reply->read] = byte;
+        }
+        reply->read++;
+        if (reply->read == 2 && (reply->head[0] != SOCKS_VERSION || reply->head[1] != WITHOUT_AUTH)) {
+            reply->head[3] = 0;
+            return PARENT_REPLY_FAILED;
+        }
+        if (reply->read == 4 && (reply->head[2] != SOCKS_VERSION || reply->head[3] != 0)) {
+            return PARENT_REPLY_FAILED;
+        }
+        if (reply->read == 6) {
+            uint8_t address_type = reply->head[5];
+            if (address_type == IPV4_TYPE) {
+                reply->len = 2 + 4 + 4 + 2;
+            } else if (address_type == IPV6_TYPE) {
+                reply->len = 2 + 4 + 16 + 2;
+            } else if (address_type != DOMAIN_TYPE) {
+                return PARENT_REPLY_FAILED;
+            }
+        }
+        if (reply->read == 7 && reply->len == 0) {
+            reply->len = 2 + 4 + 1 + reply->head[6] + 2;
+        }
+    }
+    return reply->len != 0 && reply->read == reply->len ? PARENT_REPLY_DONE : PARENT_REPLY_NEED_MORE;
+}
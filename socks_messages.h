@@ -1,19 +1,29 @@
 #ifndef PROXY_SERVER_SOCKS_MESSAGES_H
 #define PROXY_SERVER_SOCKS_MESSAGES_H
 
+#include <stdint.h>
+
 #include "io_operations.h"
 
 /*
  * This file is used to parse SOCKS version 5 messages
+ * and the requests of SOCKS version 4 and 4a
  */
 
 #define SOCKS_VERSION (5)
+#define SOCKS4_VERSION (4)
+#define SOCKS4_GRANTED (0x5A)
+#define SOCKS4_REJECTED (0x5B)
+#define CONNECT_COMMAND (1)
 #define IPV4_TYPE (1)
 #define DOMAIN_TYPE (3)
+#define IPV6_TYPE (4)
 #define ADDR_BUFFER_SIZE (256)
 #define CONN_REFUSED (5)
 #define UNREACHABLE (3)
+#define HOST_UNREACHABLE (4)
 #define GENERAL_ERROR (1)
+#define NOT_ALLOWED (2)
 #define MAX_AUTHS_COUNT (16)
 #define NO_METHODS_ACCEPTED (0xFF)
 #define WITHOUT_AUTH (0x00)
@@ -37,6 +47,23 @@ typedef struct client_greeting_t {
     char auths[MAX_AUTHS_COUNT];
 } client_greeting_t;
 
+typedef enum parent_reply_result_t {
+    PARENT_REPLY_NEED_MORE,
+    PARENT_REPLY_DONE,
+    PARENT_REPLY_FAILED
+} parent_reply_result_t;
+
+/*
+ * The choice and the reply of a parent proxy that was sent a greeting
+ * and a request at once. They may come in pieces, and the payload of
+ * the tunnel may come right behind them.
+ */
+typedef struct parent_reply_t {
+    uint8_t head[7]; // the choice and the reply up to the length of a name
+    uint32_t read;
+    uint32_t len;    // of the choice and the reply, 0 until the address type is read
+} parent_reply_t;
+
 message_t *create_server_choice_message(char choice);
 
 // creates default greeting with no authentication
@@ -46,12 +73,25 @@ message_t *create_conn_request_message(const conn_request_info_t *info);
 
 message_t *create_server_response_message(server_response_t *response);
 
+message_t *create_socks4_response_message(char status_code);
+
 conn_request_info_t *parse_conn_request_message(const message_t *message, bool allow_print_error);
 
+/*
+ * The address of a SOCKS4a request is a domain name
+ */
+conn_request_info_t *parse_socks4_request_message(const message_t *message, bool allow_print_error);
+
 server_response_t *parse_response_message(const message_t *message, bool allow_print_error);
 
 client_greeting_t *parse_client_greeting(const message_t *message, bool allow_print_error);
 
 char parse_server_choice(const message_t *message, bool allow_print_error);
 
+/*
+ * *consumed is how many bytes of data belong to the reply. On failure the
+ * status of the reply is in reply->head[3], it is 0 if the choice failed.
+ */
+parent_reply_result_t parent_reply_feed(parent_reply_t *reply, const char *data, size_t len, size_t *consumed);
+
 #endif //PROXY_SERVER_SOCKS_MESSAGES_H
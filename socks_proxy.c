@@ -10,30 +10,82 @@
 #include <unistd.h>
 #include <assert.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "io_operations.h"
 #include "socket_operations.h"
 #include "pipe_operations.h"
 #include "socks_messages.h"
+#include "logger.h"
+#include "access_log.h"
+#include "acl.h"
+#include "blocklist.h"
+#include "routes.h"
+#include "hot_restart.h"
+#include "rate_limit.h"
+#include "shaper.h"
+#include "tenants.h"
+#include "timer_heap.h"
+#include "relay_buffer.h"
+#include "egress_pool.h"
+#include "memory_budget.h"
+#include "cpu_affinity.h"
+#include "listener.h"
+#include "http_connect.h"
+#include "coroutine.h"
+#include "task_pool.h"
+#include "handoff_queue.h"
+#include "trace.h"
+#include "overload.h"
 
 #define SUCCESS (0)
 #define FAIL (-1)
 #define TERMINATE (1)
+#define HANDED_OVER (2)
 #define MAX_CLIENTS_COUNT (510)
 #define WAIT_TIME (3 * 60)
 #define TIMEOUT_CODE (0)
-#define REQUIRED_ARGC (1 + 1)
-#define USAGE_GUIDE "usage: ./prog <proxy_port>"
+#define USAGE_GUIDE "usage: ./prog [<proxy_port>] [-L <port>|<ipv4>:<port>|unix:<path>]... [-p]\n" \
+                    "                    [-a <access_log_path>] [-c <control_socket_path>]\n" \
+                    "                    [-t <control_socket_path_of_running_proxy>] [-d <drain_seconds>]\n" \
+                    "                    [-r <connections_per_sec_per_ip>] [-b <connection_burst>]\n" \
+                    "                    [-l <max_tunnels_per_ip>] [-s <bytes_per_sec_per_tunnel>]\n" \
+                    "                    [-g <bytes_per_sec_per_ip>] [-e <source_ipv4>[,<source_ipv4>...]]\n" \
+                    "                    [-m <buffered_bytes_ceiling>] [-w <workers>] [-C <cpu>[,<cpu>...]]\n" \
+                    "                    [-S cpu|bpf] [-A] [-T <trace_path>]\n" \
+                    "                    [-o <max_loop_lag_ms>] [-H <max_handshakes_per_worker>]\n" \
+                    "                    [-B <bytes_per_sec_shared_by_tenants>]\n" \
+                    "                    [-W <ipv4>/<bits>|port:<port>,<weight>[,<min_bytes_per_sec>]]...\n" \
+                    "                    [-D <destination_rules_path>] [-N <domain_blocklist_path>]\n" \
+                    "                    [-R <routes_path>]"
 #define READ_PIPE_END (0)
 #define WRITE_PIPE_END (1)
 #define TERMINATE_COMMAND "stop"
+#define STATS_COMMAND "stat" // as long as TERMINATE_COMMAND
+#define RELOAD_COMMAND "load"
+#define HANDED_OVER_COMMAND "hand"
+#define WORKER_DONE_COMMAND "done"
+#define NS_PER_SEC (1000000000ULL)
+#define NS_PER_MS (1000000ULL)
+#define NS_PER_US (1000ULL)
+/*
+ * How many bytes one connection may read in one turn of the loop.
+ * The rest waits for the next turn, so one bulk tunnel cannot hold
+ * the loop while the others are ready too.
+ */
+#define RELAY_BUDGET (64 * 1024)
+/* a client that has not finished its handshake by then is closed */
+#define HANDSHAKE_TIMEOUT_NS (10 * NS_PER_SEC)
 
-#define NEW_CLIENT (0)
-#define PASSED_GREETING (1)
+#define NEW_CLIENT (0) // in the handshake, see run_handshake()
 #define PASSED_SEND_REQUEST (2)
-#define REJECTED (3)
 #define SERVER (4)
 #define WAIT_FOR_CONNECT (5)
+#define LISTENER (6)
+#define TRANSPARENT_LISTENER (7)
+#define HTTP_LISTENER (8)
 
 int signal_pipe[2];
 
@@ -41,10 +93,86 @@ static int max(int a, int b);
 
 typedef struct args_t {
     bool valid;
-    int proxy_server_port;
+    int proxy_server_port; // 0 if only -L listeners are given
+    const char *listener_specs[MAX_LISTENERS];
+    int listener_specs_count;
     bool print_allowed;
+    const char *access_log_path;
+    /* unix socket where a new process can ask for our listening socket */
+    const char *control_path;
+    /* control socket of the running proxy to take the listening socket from */
+    const char *takeover_path;
+    int drain_time;
+    /* per client IP limits, 0 means no limit */
+    int connection_rate;
+    int connection_burst;
+    int max_tunnels_per_ip;
+    /* bandwidth limits, 0 means no limit */
+    int tunnel_bandwidth;
+    int ip_bandwidth;
+    /* comma separated local addresses for upstream connections */
+    const char *egress_addresses;
+    /* how many payload bytes may wait in queues, 0 means no limit */
+    int memory_ceiling;
+    int workers_count;
+    /* worker i is pinned to cpus[i % cpus_count], not pinned if cpus_count is 0 */
+    int cpus[MAX_WORKERS];
+    int cpus_count;
+    steering_t steering;
+    /* one thread accepts and hands clients to the least loaded worker */
+    bool acceptor;
+    /* binary trace of tunnel events, for the replay scenario of the load generator */
+    const char *trace_path;
+    /* admission control of every worker, 0 means no limit */
+    int max_loop_lag_ms;
+    int max_handshakes;
+    /* relay bandwidth divided between tenants by weight, 0 means no sharing */
+    int shared_bandwidth;
+    const char *tenant_specs[MAX_TENANTS];
+    int tenant_specs_count;
+    /* allow and deny rules of destinations, reloaded on SIGHUP */
+    const char *acl_path;
+    /* built by blocklist_builder */
+    const char *blocklist_path;
+    /* egress paths of destinations, reloaded on SIGHUP */
+    const char *routes_path;
 } args_t;
 
+typedef enum client_protocol_t {
+    PROTOCOL_UNKNOWN, // told by the first byte
+    PROTOCOL_SOCKS5,
+    PROTOCOL_SOCKS4,
+    PROTOCOL_HTTP
+} client_protocol_t;
+
+/*
+ * Name resolution of a target, run by the task pool
+ */
+typedef struct resolve_task_t {
+    task_t task;
+    int fd; // FAIL once the client is gone, only the event loop uses it
+    bool resolved;
+    struct in_addr address;
+    char host[ADDR_BUFFER_SIZE];
+} resolve_task_t;
+
+/*
+ * What the handshake of a client keeps across waits
+ */
+typedef struct handshake_t {
+    coroutine_t co;
+    uint8_t protocol;     // client_protocol_t
+    uint8_t address_type; // of a SOCKS5 request, the reply repeats it
+    bool has_target;
+    bool blocked;         // the name of the target is in the blocklist
+    bool routed;          // the name of the target has a domain route
+    uint32_t consumed;    // bytes of the current message taken by the handshake
+    struct in_addr target;
+    route_egress_t route; // direct unless routed
+    resolve_task_t *resolving; // NULL unless the target is being resolved
+    message_t *early_data;     // sent behind the request while it is resolved
+} handshake_t;
+
 typedef struct proxy_t {
     int max_fd;
     fd_set read_wait_set;
@@ -59,9 +187,121 @@ typedef struct proxy_t {
      */
     message_t *message_queue[MAX_CLIENTS_COUNT * 2 + 3];
     bool has_message_to_send[MAX_CLIENTS_COUNT * 2 + 3];
-    bool print_allowed;
+    /* true for sockets the proxy opened to destinations */
+    bool is_upstream[MAX_CLIENTS_COUNT * 2 + 3];
+    /* tunnel statistics, indexed by the client socket */
+    access_record_t access_table[MAX_CLIENTS_COUNT * 2 + 3];
+    /* true for clients counted by the limiter, indexed by the client socket */
+    bool rate_counted[MAX_CLIENTS_COUNT * 2 + 3];
+    /* bandwidth buckets of tunnels, indexed by the client socket */
+    shaper_bucket_t tunnel_bucket[MAX_CLIENTS_COUNT * 2 + 3];
+    shaper_group_t *shaping_group[MAX_CLIENTS_COUNT * 2 + 3];
+    /* when a descriptor paused by shaping is read again, 0 if it is not paused */
+    uint64_t resume_at_ns[MAX_CLIENTS_COUNT * 2 + 3];
+    /* tenant of the tunnel, indexed by the client socket */
+    int tenant[MAX_CLIENTS_COUNT * 2 + 3];
+    tenants_usage_t *tenant_usage;
+    /* when a descriptor paused by the share of its tenant is written again, 0 if it is not paused */
+    uint64_t write_resume_at_ns[MAX_CLIENTS_COUNT * 2 + 3];
+    timer_heap_t timers;
+    relay_buffers_t buffers;
+    relay_hint_t relay_hint[MAX_CLIENTS_COUNT * 2 + 3];
+    /* source address taken by an upstream socket */
+    egress_lease_t egress_lease[MAX_CLIENTS_COUNT * 2 + 3];
+    /* upstream sockets to parent proxies, their reply is read before they relay */
+    bool awaiting_parent[MAX_CLIENTS_COUNT * 2 + 3];
+    parent_reply_t parent_reply[MAX_CLIENTS_COUNT * 2 + 3];
+    /* descriptors not read because too much is buffered */
+    bool memory_paused[MAX_CLIENTS_COUNT * 2 + 3];
+    int memory_paused_count;
+    memory_pressure_t memory_pressure;
+    /* handshakes in progress, indexed by the client socket */
+    handshake_t handshake[MAX_CLIENTS_COUNT * 2 + 3];
+    http_connect_parser_t http_parser[MAX_CLIENTS_COUNT * 2 + 3];
+    /* id of the tunnel in the trace, indexed by the client socket */
+    uint32_t trace_tunnel[MAX_CLIENTS_COUNT * 2 + 3];
+    overload_t overload;
+    /* clients in the handshake, they are counted by handshakes_count */
+    bool in_handshake[MAX_CLIENTS_COUNT * 2 + 3];
+    int handshakes_count;
+    /* read end of the pipe the main thread sends commands to */
+    int command_fd;
+    /* tasks this loop has given to the task pool come back here */
+    task_completions_t completions;
+    /* clients from the acceptor, NULL if the worker accepts itself */
+    handoff_queue_t *handoff;
+    int *live_connections;
 } proxy_t;
 
+static void connect_transparent(int fd, int listen_socket, proxy_t *proxy);
+
+static co_status_t run_handshake(int fd, proxy_t *proxy, message_t *message);
+
+static int send_message(int fd, proxy_t *proxy, message_t *message);
+
+typedef struct worker_t {
+    int index;
+    int cpu; // FAIL if not pinned
+    int listen_sockets[MAX_LISTENERS];
+    listener_mode_t listen_mode[MAX_LISTENERS];
+    int listen_count;
+    int command_pipe[2];
+    pthread_t thread;
+    const args_t *args;
+    handoff_queue_t *handoff; // NULL unless clients come from the acceptor
+    int live_connections;     // clients handed to the worker and not closed yet, atomic
+    unsigned long epoch;      // odd while the worker runs a turn, even while it waits, atomic
+} worker_t;
+
+typedef struct acceptor_t {
+    const listener_t *listeners;
+    int listeners_count;
+    worker_t *workers;
+    int workers_count;
+    int next_worker; // breaks ties, so equally loaded workers take turns
+    int command_pipe[2];
+    pthread_t thread;
+} acceptor_t;
+
+/*
+ * Limits and the source address pool are shared by all the workers
+ * and only used under shared_lock, but for the buckets of the shaper and of the tenants
+ */
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static rate_limiter_t limiter;
+static shaper_t shaper;
+static tenants_t tenants;
+/* of each worker, the main thread sums them to divide the capacity, see tenants_share */
+static tenants_usage_t tenant_usage[MAX_WORKERS];
+static egress_pool_t egress;
+/*
+ * Swapped by a reload, read without the lock. The old rules are freed
+ * once every worker has been quiescent, see wait_for_quiescent_workers.
+ */
+static acl_t *destination_acl;
+/* set before the workers start, read without the lock */
+static bool acl_enabled = false;
+/* mapped read only before the workers start, used without the lock */
+static blocklist_t blocklist;
+static bool blocklist_enabled = false;
+/* swapped by a reload and read without the lock, as the destination rules */
+static routes_t *routes;
+static bool routes_enabled = false;
+/* for what may block, has its own locking */
+static task_pool_t task_pool;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static uint64_t wall_clock_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + (uint64_t) ts.tv_nsec / NS_PER_MS;
+}
+
 static bool extract_int(const char *buf, int *num) {
     if (NULL == buf || num == NULL) {
         return false;
@@ -77,57 +317,177 @@ static bool extract_int(const char *buf, int *num) {
 static args_t parse_args(int argc, char *argv[]) {
     args_t result;
     result.valid = false;
-    if (argc < REQUIRED_ARGC) {
+    result.proxy_server_port = 0;
+    result.listener_specs_count = 0;
+    result.print_allowed = false;
+    result.access_log_path = NULL;
+    result.control_path = NULL;
+    result.takeover_path = NULL;
+    result.drain_time = DEFAULT_DRAIN_TIME;
+    result.connection_rate = 0;
+    result.connection_burst = 0;
+    result.max_tunnels_per_ip = 0;
+    result.tunnel_bandwidth = 0;
+    result.ip_bandwidth = 0;
+    result.egress_addresses = NULL;
+    result.memory_ceiling = 0;
+    result.workers_count = 0;
+    result.cpus_count = 0;
+    result.steering = STEERING_NONE;
+    result.acceptor = false;
+    result.trace_path = NULL;
+    result.max_loop_lag_ms = 0;
+    result.max_handshakes = 0;
+    result.shared_bandwidth = 0;
+    result.tenant_specs_count = 0;
+    result.acl_path = NULL;
+    result.blocklist_path = NULL;
+    result.routes_path = NULL;
+    int option;
+    while ((option = getopt(argc, argv, "pa:c:t:d:r:b:l:s:g:e:m:w:C:S:L:AT:o:H:B:W:D:N:R:")) != FAIL) {
+        switch (option) {
+            case 'L':
+                if (result.listener_specs_count == MAX_LISTENERS) {
+                    return result;
+                }
+                result.listener_specs[result.listener_specs_count++] = optarg;
+                break;
+            case 'p':
+                result.print_allowed = true;
+                break;
+            case 'a':
+                result.access_log_path = optarg;
+                break;
+            case 'c':
+                result.control_path = optarg;
+                break;
+            case 't':
+                result.takeover_path = optarg;
+                break;
+            case 'd':
+                if (!extract_int(optarg, &result.drain_time) || result.drain_time < 0) {
+                    return result;
+                }
+                break;
+            case 'r':
+                if (!extract_int(optarg, &result.connection_rate) || result.connection_rate < 0) {
+                    return result;
+                }
+                break;
+            case 'b':
+                if (!extract_int(optarg, &result.connection_burst) || result.connection_burst < 0) {
+                    return result;
+                }
+                break;
+            case 'l':
+                if (!extract_int(optarg, &result.max_tunnels_per_ip) || result.max_tunnels_per_ip < 0) {
+                    return result;
+                }
+                break;
+            case 's':
+                if (!extract_int(optarg, &result.tunnel_bandwidth) || result.tunnel_bandwidth < 0) {
+                    return result;
+                }
+                break;
+            case 'g':
+                if (!extract_int(optarg, &result.ip_bandwidth) || result.ip_bandwidth < 0) {
+                    return result;
+                }
+                break;
+            case 'e':
+                result.egress_addresses = optarg;
+                break;
+            case 'm':
+                if (!extract_int(optarg, &result.memory_ceiling) || result.memory_ceiling < 0) {
+                    return result;
+                }
+                break;
+            case 'w':
+                if (!extract_int(optarg, &result.workers_count) || result.workers_count < 1
+                    || result.workers_count > MAX_WORKERS) {
+                    return result;
+                }
+                break;
+            case 'C':
+                result.cpus_count = parse_cpu_list(optarg, result.cpus, MAX_WORKERS);
+                if (result.cpus_count == FAIL) {
+                    return result;
+                }
+                break;
+            case 'S':
+                if (strcmp(optarg, "cpu") == 0) {
+                    result.steering = STEERING_INCOMING_CPU;
+                } else if (strcmp(optarg, "bpf") == 0) {
+                    result.steering = STEERING_BPF;
+                } else {
+                    return result;
+                }
+                break;
+            case 'A':
+                result.acceptor = true;
+                break;
+            case 'T':
+                result.trace_path = optarg;
+                break;
+            case 'o':
+                if (!extract_int(optarg, &result.max_loop_lag_ms) || result.max_loop_lag_ms < 0) {
+                    return result;
+                }
+                break;
+            case 'H':
+                if (!extract_int(optarg, &result.max_handshakes) || result.max_handshakes < 0) {
+                    return result;
+                }
+                break;
+            case 'B':
+                if (!extract_int(optarg, &result.shared_bandwidth) || result.shared_bandwidth < 0) {
+                    return result;
+                }
+                break;
+            case 'W':
+                // the default tenant takes one place
+                if (result.tenant_specs_count == MAX_TENANTS - 1) {
+                    return result;
+                }
+                result.tenant_specs[result.tenant_specs_count++] = optarg;
+                break;
+            case 'D':
+                result.acl_path = optarg;
+                break;
+            case 'N':
+                result.blocklist_path = optarg;
+                break;
+            case 'R':
+                result.routes_path = optarg;
+                break;
+            default:
+                return result;
+        }
+    }
+    if (optind < argc) {
+        // the port of the old command line, listened on every address
+        bool extracted = extract_int(argv[optind], &result.proxy_server_port);
+        if (!extracted || result.proxy_server_port <= 0 || result.listener_specs_count == MAX_LISTENERS) {
+            return result;
+        }
+        result.listener_specs[result.listener_specs_count++] = argv[optind];
+    }
+    // with the acceptor there is one listening socket to steer from
+    if (result.listener_specs_count == 0 || (result.acceptor && result.steering != STEERING_NONE)) {
         return result;
     }
-    bool extracted = extract_int(argv[1], &result.proxy_server_port);
-    if (!extracted) {
+    // tenants have nothing to share without the bandwidth
+    if (result.tenant_specs_count > 0 && result.shared_bandwidth == 0) {
         return result;
     }
-    result.print_allowed = false;
-    if (argc == REQUIRED_ARGC + 1) {
-        if (strcmp(argv[2], "-p") == 0) {
-            result.print_allowed = true;
-        }
+    if (result.workers_count == 0) {
+        // one worker per listed CPU
+        result.workers_count = result.cpus_count > 0 ? result.cpus_count : 1;
     }
     result.valid = true;
     return result;
 }
 
-static int init_and_bind_proxy_socket(args_t args) {
-    int proxy_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (proxy_socket == FAIL) {
-        perror("[PROXY] Error in socket");
-        return FAIL;
-    }
-    int return_value = set_reusable(proxy_socket);
-    if (return_value == FAIL) {
-        close(proxy_socket);
-        fprintf(stderr, "[PROXY] Failed to make socket reusable\n");
-        return FAIL;
-    }
-    return_value = set_nonblocking(proxy_socket);
-    if (return_value == FAIL) {
-        close(proxy_socket);
-        fprintf(stderr, "[PROXY] Failed to make socket nonblocking\n");
-        return FAIL;
-    }
-    struct sockaddr_in proxy_sockaddr;
-    proxy_sockaddr.sin_family = AF_INET;
-    proxy_sockaddr.sin_addr.s_addr = INADDR_ANY;
-    proxy_sockaddr.sin_port = htons(args.proxy_server_port);
-    return_value = bind(proxy_socket, (struct sockaddr *) &proxy_sockaddr, sizeof(proxy_sockaddr));
-    if (return_value < 0) {
-        perror("[PROXY] Error in bind");
-        return_value = close(proxy_socket);
-        if (return_value == FAIL) {
-            perror("[PROXY] Error in close");
-        }
-        return FAIL;
-    }
-    return proxy_socket;
-}
-
 static void handle_sigint_sigterm(__attribute__((unused)) int sig) {
     message_t terminate = {
             .data = TERMINATE_COMMAND,
@@ -136,6 +496,22 @@ static void handle_sigint_sigterm(__attribute__((unused)) int sig) {
     write_all(signal_pipe[WRITE_PIPE_END], &terminate);
 }
 
+static void handle_sigusr1(__attribute__((unused)) int sig) {
+    message_t stats = {
+            .data = STATS_COMMAND,
+            .len = strlen(STATS_COMMAND)
+    };
+    write_all(signal_pipe[WRITE_PIPE_END], &stats);
+}
+
+static void handle_sighup(__attribute__((unused)) int sig) {
+    message_t reload = {
+            .data = RELOAD_COMMAND,
+            .len = strlen(RELOAD_COMMAND)
+    };
+    write_all(signal_pipe[WRITE_PIPE_END], &reload);
+}
+
 static int init_signal_handlers() {
     int return_value = pipe(signal_pipe);
     if (return_value == FAIL) {
@@ -144,48 +520,301 @@ static int init_signal_handlers() {
     }
     signal(SIGINT, handle_sigint_sigterm);
     signal(SIGTERM, handle_sigint_sigterm);
+    signal(SIGUSR1, handle_sigusr1);
+    signal(SIGHUP, handle_sighup);
     return SUCCESS;
 }
 
-static int handle_new_connection(int proxy_socket, proxy_t *proxy) {
-    int new_client_fd = accept(proxy_socket, NULL, NULL);
-    if (new_client_fd == FAIL) {
-        if (errno != EAGAIN) {
-            perror("[PROXY] Error in accept. Shutdown server...");
-        }
+/*
+ * Records an event of the tunnel fd belongs to if the trace is on
+ */
+static void trace_event(int fd, proxy_t *proxy, trace_event_t event, uint32_t value, uint16_t port) {
+    if (!trace_enabled()) {
+        return;
+    }
+    int client_fd = proxy->is_upstream[fd] ? proxy->translation_table[fd] : fd;
+    trace_side_t side = proxy->is_upstream[fd] ? TRACE_UPSTREAM : TRACE_CLIENT;
+    if (client_fd != 0) {
+        trace_record(event, proxy->trace_tunnel[client_fd], side, value, port);
+    }
+}
+
+/*
+ * The port of the listener is looked up only if some tenant is selected by it
+ */
+static int classify_tenant(int listen_socket, uint32_t client_address) {
+    uint16_t port = 0;
+    struct sockaddr_in local_address;
+    socklen_t address_len = sizeof(local_address);
+    if (tenants.by_port
+        && getsockname(listen_socket, (struct sockaddr *) &local_address, &address_len) == SUCCESS
+        && local_address.sin_family == AF_INET) {
+        port = ntohs(local_address.sin_port);
+    }
+    return tenants_classify(&tenants, port, client_address);
+}
+
+/*
+ * Takes an accepted client into the tables of the worker.
+ * Returns FAIL if the client is refused, its socket is closed then.
+ */
+static int admit_client(int new_client_fd, int listen_socket, int listener_status,
+                        const struct sockaddr_storage *accepted_address, proxy_t *proxy) {
+    if (new_client_fd >= MAX_CLIENTS_COUNT * 2 + 3) {
+        // the tables of every worker are indexed by descriptors of the whole process
+        LOG_ERROR(EV_TOO_MANY_DESCRIPTORS, new_client_fd, 0, 0, 0);
+        close(new_client_fd);
+        return FAIL;
+    }
+    struct sockaddr_in client_address;
+    if (accepted_address->ss_family == AF_INET) {
+        memcpy(&client_address, accepted_address, sizeof(client_address));
+    } else {
+        // clients of unix listeners are on this host, the limits and the log see them as loopback
+        memset(&client_address, 0, sizeof(client_address));
+        client_address.sin_family = AF_INET;
+        client_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    }
+    if (memory_budget_pressure() == MEMORY_REFUSE) {
+        memory_budget_count_refused();
+        LOG_DEBUG(EV_MEMORY_REFUSED, new_client_fd, 0, 0, 0);
+        close(new_client_fd);
+        return FAIL;
+    }
+    // a client closed at once costs less than one that times out in the handshake
+    if (proxy->overload.level == OVERLOAD_REFUSE) {
+        LOG_DEBUG(EV_OVERLOAD_REFUSED, new_client_fd, proxy->overload.lag_ns / NS_PER_US, proxy->handshakes_count, 0);
+        close(new_client_fd);
+        return FAIL;
+    }
+    // nothing is spent on a client over its limits
+    bool counted = false;
+    pthread_mutex_lock(&shared_lock);
+    bool admitted = rate_limit_admit(&limiter, client_address.sin_addr.s_addr, now_ns(), &counted);
+    pthread_mutex_unlock(&shared_lock);
+    if (!admitted) {
+        LOG_DEBUG(EV_RATE_LIMITED, new_client_fd, 0, 0, client_address.sin_addr.s_addr);
+        close(new_client_fd);
         return FAIL;
     }
     int return_value = set_nonblocking(new_client_fd);
     if (return_value == FAIL) {
+        if (counted) {
+            pthread_mutex_lock(&shared_lock);
+            rate_limit_release(&limiter, client_address.sin_addr.s_addr);
+            pthread_mutex_unlock(&shared_lock);
+        }
         close(new_client_fd);
         return FAIL;
     }
+    if (shaper.enabled) {
+        // shaped reads are small, Nagle's algorithm would hold them back; not fatal
+        set_nodelay(new_client_fd);
+    }
     FD_SET(new_client_fd, &proxy->read_wait_set);
     if (new_client_fd > proxy->max_fd) {
         proxy->max_fd = new_client_fd;
     }
+    // descriptor numbers are reused, so nothing may be left from the previous owner
     proxy->has_message_to_send[new_client_fd] = false;
+    proxy->status_table[new_client_fd] = NEW_CLIENT;
+    proxy->translation_table[new_client_fd] = 0;
+    proxy->is_upstream[new_client_fd] = false;
+    proxy->rate_counted[new_client_fd] = counted;
+    proxy->resume_at_ns[new_client_fd] = 0;
+    proxy->relay_hint[new_client_fd].bulk = false;
+    proxy->relay_hint[new_client_fd].small_reads = 0;
+    proxy->tunnel_bucket[new_client_fd].full_at_ns = 0;
+    proxy->shaping_group[new_client_fd] = NULL;
+    if (shaper.enabled) {
+        pthread_mutex_lock(&shared_lock);
+        proxy->shaping_group[new_client_fd] = shaper_join(&shaper, client_address.sin_addr.s_addr, now_ns());
+        pthread_mutex_unlock(&shared_lock);
+    }
+    proxy->write_resume_at_ns[new_client_fd] = 0;
+    proxy->tenant[new_client_fd] = DEFAULT_TENANT;
+    if (tenants.enabled) {
+        proxy->tenant[new_client_fd] = classify_tenant(listen_socket, client_address.sin_addr.s_addr);
+    }
+    access_record_t *record = &proxy->access_table[new_client_fd];
+    memset(record, 0, sizeof(*record));
+    record->active = true;
+    record->client_address = client_address;
+    record->accepted_ns = now_ns();
+    record->start_wall_ms = wall_clock_ms();
+    handshake_t *handshake = &proxy->handshake[new_client_fd];
+    memset(handshake, 0, sizeof(*handshake));
+    if (trace_enabled()) {
+        proxy->trace_tunnel[new_client_fd] = trace_next_tunnel();
+        trace_event(new_client_fd, proxy, TRACE_ACCEPT, 0, 0);
+    }
+    if (listener_status == TRANSPARENT_LISTENER) {
+        proxy->in_handshake[new_client_fd] = false;
+        connect_transparent(new_client_fd, listen_socket, proxy);
+        return SUCCESS;
+    }
+    proxy->in_handshake[new_client_fd] = true;
+    proxy->handshakes_count++;
+    if (listener_status == HTTP_LISTENER) {
+        handshake->protocol = PROTOCOL_HTTP;
+    }
+    // runs up to the wait for the first message
+    run_handshake(new_client_fd, proxy, NULL);
+    return SUCCESS;
+}
+
+/*
+ * returns FAIL only if the listening socket is broken
+ */
+static int handle_new_connection(int proxy_socket, proxy_t *proxy) {
+    struct sockaddr_storage accepted_address;
+    socklen_t address_len = sizeof(accepted_address);
+    int new_client_fd = accept(proxy_socket, (struct sockaddr *) &accepted_address, &address_len);
+    if (new_client_fd == FAIL) {
+        // another process sharing the socket may have taken the connection
+        if (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED) {
+            return SUCCESS;
+        }
+        LOG_ERROR(EV_ACCEPT_ERROR, proxy_socket, 0, 0, 0);
+        return FAIL;
+    }
+    admit_client(new_client_fd, proxy_socket, proxy->status_table[proxy_socket], &accepted_address, proxy);
     return SUCCESS;
 }
 
-static void close_connection(int fd, proxy_t *proxy) {
+static int status_of_listener(listener_mode_t mode) {
+    if (mode == LISTEN_TRANSPARENT) {
+        return TRANSPARENT_LISTENER;
+    }
+    if (mode == LISTEN_HTTP) {
+        return HTTP_LISTENER;
+    }
+    return LISTENER;
+}
+
+/*
+ * Admits the clients the acceptor has queued for this worker
+ */
+static void handle_handoffs(proxy_t *proxy) {
+    handoff_queue_answer(proxy->handoff);
+    handoff_t handoff;
+    while (handoff_queue_pop(proxy->handoff, &handoff)) {
+        int status = status_of_listener((listener_mode_t) handoff.listen_mode);
+        if (admit_client(handoff.fd, handoff.listen_socket, status, &handoff.address, proxy) == FAIL) {
+            __atomic_sub_fetch(proxy->live_connections, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+static void free_message(proxy_t *proxy, message_t *message) {
+    relay_release(&proxy->buffers, message->data);
+    free(message);
+}
+
+static void drop_queued_message(int fd, proxy_t *proxy) {
+    FD_CLR(fd, &proxy->write_wait_set);
+    if (proxy->has_message_to_send[fd] && proxy->message_queue[fd] != NULL) {
+        memory_budget_credit(proxy->message_queue[fd]->len);
+        free_message(proxy, proxy->message_queue[fd]);
+    }
+    proxy->message_queue[fd] = NULL;
+    proxy->has_message_to_send[fd] = false;
+}
+
+static void release_lease(egress_lease_t lease) {
+    if (lease.leased) {
+        pthread_mutex_lock(&shared_lock);
+        egress_pool_release(&egress, lease);
+        pthread_mutex_unlock(&shared_lock);
+    }
+}
+
+static void release_egress(int fd, proxy_t *proxy) {
+    if (proxy->is_upstream[fd]) {
+        release_lease(proxy->egress_lease[fd]);
+        proxy->egress_lease[fd].leased = false;
+    }
+}
+
+/*
+ * The task finishes anyway, its completion is dropped
+ */
+static void cancel_resolving(int fd, proxy_t *proxy) {
+    handshake_t *handshake = &proxy->handshake[fd];
+    if (handshake->resolving != NULL) {
+        handshake->resolving->fd = FAIL;
+        handshake->resolving = NULL;
+    }
+    if (handshake->early_data != NULL) {
+        free_message(proxy, handshake->early_data);
+        handshake->early_data = NULL;
+    }
+}
+
+static void leave_handshake(int fd, proxy_t *proxy) {
+    if (proxy->in_handshake[fd]) {
+        proxy->in_handshake[fd] = false;
+        proxy->handshakes_count--;
+    }
+}
+
+static void close_connection(int fd, proxy_t *proxy, close_reason_t reason) {
+    int client_fd = proxy->is_upstream[fd] ? proxy->translation_table[fd] : fd;
+    if (client_fd != 0) {
+        leave_handshake(client_fd, proxy);
+    }
+    if (client_fd != 0 && proxy->access_table[client_fd].active) {
+        trace_event(fd, proxy, TRACE_CLOSE, reason, 0);
+        access_log_write(&proxy->access_table[client_fd], reason, now_ns());
+        proxy->access_table[client_fd].active = false;
+        if (proxy->live_connections != NULL) {
+            __atomic_sub_fetch(proxy->live_connections, 1, __ATOMIC_RELAXED);
+        }
+    }
+    if (client_fd != 0 && proxy->rate_counted[client_fd]) {
+        pthread_mutex_lock(&shared_lock);
+        rate_limit_release(&limiter, proxy->access_table[client_fd].client_address.sin_addr.s_addr);
+        pthread_mutex_unlock(&shared_lock);
+        proxy->rate_counted[client_fd] = false;
+    }
+    if (client_fd != 0 && proxy->shaping_group[client_fd] != NULL) {
+        pthread_mutex_lock(&shared_lock);
+        shaper_leave(proxy->shaping_group[client_fd]);
+        pthread_mutex_unlock(&shared_lock);
+        proxy->shaping_group[client_fd] = NULL;
+    }
     // connection was closed
     int return_value = close(fd);
     if (return_value == FAIL) {
-        perror("[PROXY] Error in close");
+        LOG_ERROR(EV_CLOSE_ERROR, fd, 0, 0, 0);
     }
-    if (proxy->print_allowed) printf("[PROXY] Closed connection %d\n", fd);
+    LOG_DEBUG(EV_CLOSED, fd, 0, 0, 0);
     FD_CLR(fd, &proxy->read_wait_set);
+    drop_queued_message(fd, proxy);
+    proxy->resume_at_ns[fd] = 0;
+    proxy->write_resume_at_ns[fd] = 0;
+    proxy->memory_paused[fd] = false;
+    proxy->awaiting_parent[fd] = false;
+    // a pending deadline must not wake the handshake of a closed socket
+    proxy->handshake[fd].co.waiting = CO_WAIT_NONE;
+    cancel_resolving(fd, proxy);
+    release_egress(fd, proxy);
     if (fd == proxy->max_fd) {
         proxy->max_fd--;
     }
     if (proxy->translation_table[fd] != 0) {
         return_value = close(proxy->translation_table[fd]);
         if (return_value == FAIL) {
-            perror("[PROXY] Error in close");
+            LOG_ERROR(EV_CLOSE_ERROR, proxy->translation_table[fd], 0, 0, 0);
         }
-        if (proxy->print_allowed) printf("[PROXY] Closed connection %d\n", proxy->translation_table[fd]);
+        LOG_DEBUG(EV_CLOSED, proxy->translation_table[fd], 0, 0, 0);
         FD_CLR(proxy->translation_table[fd], &proxy->read_wait_set);
+        drop_queued_message(proxy->translation_table[fd], proxy);
+        proxy->resume_at_ns[proxy->translation_table[fd]] = 0;
+        proxy->write_resume_at_ns[proxy->translation_table[fd]] = 0;
+        proxy->memory_paused[proxy->translation_table[fd]] = false;
+        proxy->awaiting_parent[proxy->translation_table[fd]] = false;
+        release_egress(proxy->translation_table[fd], proxy);
         if (proxy->translation_table[fd] == proxy->max_fd) {
             proxy->max_fd--;
         }
@@ -194,24 +823,66 @@ static void close_connection(int fd, proxy_t *proxy) {
     }
 }
 
-static void put_message_into_queue(int fd, proxy_t *proxy, message_t *message) {
-    if (proxy->has_message_to_send[fd] && proxy->message_queue[fd] != NULL) {
-        free(proxy->message_queue[fd]->data);
-        free(proxy->message_queue[fd]);
+/*
+ * If something is still waiting for fd, the new message is appended to it.
+ * The message is freed either way, FAIL means it could not be appended and
+ * is lost, so the caller must close the connection.
+ */
+static int put_message_into_queue(int fd, proxy_t *proxy, message_t *message) {
+    message_t *queued = proxy->message_queue[fd];
+    if (proxy->has_message_to_send[fd] && queued != NULL) {
+        // the queued data may be a pool block, so it is copied and not reallocated
+        char *joined = malloc(queued->len + message->len + 1);
+        if (joined == NULL) {
+            LOG_ERROR(EV_QUEUE_JOIN_FAILED, fd, message->len, queued->len, 0);
+            free_message(proxy, message);
+            return FAIL;
+        }
+        memory_budget_charge(message->len);
+        memcpy(joined, queued->data, queued->len);
+        memcpy(joined + queued->len, message->data, message->len);
+        relay_release(&proxy->buffers, queued->data);
+        queued->data = joined;
+        queued->len += message->len;
+        free_message(proxy, message);
+    } else {
+        memory_budget_charge(message->len);
+        proxy->message_queue[fd] = message;
+    }
+    // a descriptor paused by the share of its tenant is written by its timer
+    if (proxy->write_resume_at_ns[fd] == 0) {
+        FD_SET(fd, &proxy->write_wait_set);
     }
-    proxy->message_queue[fd] = message;
-    FD_SET(fd, &proxy->write_wait_set);
     proxy->max_fd = max(proxy->max_fd, fd);
     proxy->has_message_to_send[fd] = true;
+    return SUCCESS;
+}
+
+/*
+ * The sender is not read until the receiver has taken the whole message,
+ * so a slow receiver slows down the sender instead of buffering.
+ * Relayed bytes are never dropped, a tunnel that cannot keep them is closed.
+ */
+static void relay_message(int fd, proxy_t *proxy, message_t *message) {
+    if (put_message_into_queue(proxy->translation_table[fd], proxy, message) == FAIL) {
+        close_connection(fd, proxy, CLOSE_OUT_OF_MEMORY);
+        return;
+    }
+    FD_CLR(fd, &proxy->read_wait_set);
 }
 
-static int handle_greeting(int fd, proxy_t *proxy, message_t *greeting_msg) {
+/*
+ * *consumed is the length of the greeting, an optimistic client
+ * may have sent its request behind it
+ */
+static int handle_greeting(int fd, proxy_t *proxy, message_t *greeting_msg, size_t *consumed) {
     assert(greeting_msg);
-    client_greeting_t *greeting = parse_client_greeting(greeting_msg, true);
+    client_greeting_t *greeting = parse_client_greeting(greeting_msg, false);
     if (greeting == NULL) {
-        fprintf(stderr, "[PROXY] could not parse greeting message\n");
+        LOG_ERROR(EV_GREETING_PARSE_FAILED, fd, 0, 0, 0);
         return FAIL;
     }
+    *consumed = 1 + 1 + greeting->auths_count;
     bool acceptable = false;
     for (int i = 0; i < greeting->auths_count; i++) {
         if (greeting->auths[i] == 0x00) {
@@ -226,195 +897,1069 @@ static int handle_greeting(int fd, proxy_t *proxy, message_t *greeting_msg) {
     }
     message_t *choice_message = create_server_choice_message(choice);
     if (choice_message == NULL) {
-        fprintf(stderr, "[PROXY] could not create choice message\n");
+        LOG_ERROR(EV_CHOICE_CREATE_FAILED, fd, 0, 0, 0);
+        return FAIL;
+    }
+    if (put_message_into_queue(fd, proxy, choice_message) == FAIL) {
         return FAIL;
     }
-    put_message_into_queue(fd, proxy, choice_message);
-    if (proxy->print_allowed) printf("[PROXY] Pushed greeting into queue, fd = %d\n", fd);
+    LOG_DEBUG(EV_GREETING_QUEUED, fd, 0, 0, 0);
     if (acceptable) {
         return SUCCESS;
     }
     return FAIL;
 }
 
+/*
+ * On failure the socket is left open, the caller closes the whole tunnel
+ */
 static int connect_to_remote(int sd, proxy_t *proxy) {
     FD_CLR(sd, &proxy->write_wait_set);
     proxy->status_table[sd] = NEW_CLIENT;
     int opt = fcntl(sd, F_GETFL, NULL);
     if (opt < 0) {
-        close(sd);
         return FAIL;
     }
     socklen_t len = sizeof(opt);
     int return_code = getsockopt(sd, SOL_SOCKET, SO_ERROR, &opt, &len);
     if (return_code < 0) {
-        close(sd);
         return FAIL;
     }
     if (opt != SUCCESS) {
         errno = opt;
-        close(sd);
         return FAIL;
     }
     proxy->status_table[sd] = SERVER;
+    proxy->access_table[proxy->translation_table[sd]].established_ns = now_ns();
+    if (proxy->has_message_to_send[sd]) {
+        // the client did not wait for the connect to complete
+        FD_SET(sd, &proxy->write_wait_set);
+    }
     return SUCCESS;
 }
 
-static int start_connecting(char *serv_ipv4_address, int port, proxy_t *proxy) {
-    if (port < 0 || port >= 65536) {
-        return FAIL;
+/*
+ * returns a nonblocking socket, bound as its route says or to a source
+ * address from the pool if there is one, with a connect in progress or completed
+ */
+static int connect_from_pool(const struct sockaddr_in *serv_sockaddr, const route_egress_t *route,
+                             egress_lease_t *lease, bool *in_progress) {
+    // sources that have no free port to this destination
+    uint32_t exhausted = 0;
+    while (true) {
+        int sd = socket(AF_INET, SOCK_STREAM, 0);
+        if (sd == FAIL) {
+            return FAIL;
+        }
+        int opt = fcntl(sd, F_GETFL, NULL);
+        if (opt < 0) {
+            close(sd);
+            return FAIL;
+        }
+        int return_code = fcntl(sd, F_SETFL, opt | O_NONBLOCK);
+        if (return_code < 0) {
+            close(sd);
+            return FAIL;
+        }
+        if (route->kind == ROUTE_SOURCE || route->kind == ROUTE_INTERFACE) {
+            memset(lease, 0, sizeof(*lease));
+            if (route_egress_bind(route, sd) == FAIL) {
+                close(sd);
+                return FAIL;
+            }
+        } else {
+            pthread_mutex_lock(&shared_lock);
+            *lease = egress_pool_acquire(&egress, serv_sockaddr, exhausted);
+            pthread_mutex_unlock(&shared_lock);
+        }
+        if (lease->leased && egress_pool_bind(&egress, sd, *lease) == FAIL) {
+            release_lease(*lease);
+            close(sd);
+            return FAIL;
+        }
+        return_code = connect(sd, (const struct sockaddr *) serv_sockaddr, sizeof(*serv_sockaddr));
+        if (return_code < 0 && errno == EADDRNOTAVAIL && lease->leased) {
+            release_lease(*lease);
+            close(sd);
+            exhausted |= 1U << lease->source;
+            continue;
+        }
+        if (return_code < 0 && errno != EINPROGRESS) {
+            release_lease(*lease);
+            close(sd);
+            return FAIL;
+        }
+        *in_progress = return_code < 0;
+        return sd;
     }
-    int sd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sd == FAIL) {
-        return FAIL;
+}
+
+static bool destination_allowed(struct in_addr address, int port) {
+    if (!acl_enabled) {
+        return true;
     }
+    return acl_allows(__atomic_load_n(&destination_acl, __ATOMIC_ACQUIRE), AF_INET, &address, (uint16_t) port);
+}
+
+static route_egress_t route_of_address(struct in_addr address, int port) {
+    route_egress_t route;
+    memset(&route, 0, sizeof(route));
+    if (!routes_enabled) {
+        return route;
+    }
+    return routes_find_address(__atomic_load_n(&routes, __ATOMIC_ACQUIRE), AF_INET, &address, (uint16_t) port);
+}
+
+/*
+ * The upstream socket to address, or to the parent proxy of the route
+ */
+static int open_upstream(struct in_addr address, int port, const route_egress_t *route, proxy_t *proxy) {
     struct sockaddr_in serv_sockaddr;
     serv_sockaddr.sin_family = AF_INET;
-    serv_sockaddr.sin_port = htons(port);
-    if (inet_pton(AF_INET, serv_ipv4_address, &serv_sockaddr.sin_addr) == FAIL) {
-        close(sd);
-        return FAIL;
-    }
-    int opt = fcntl(sd, F_GETFL, NULL);
-    if (opt < 0) {
-        close(sd);
+    serv_sockaddr.sin_port = htons(route->kind == ROUTE_PARENT ? route->port : port);
+    serv_sockaddr.sin_addr = route->kind == ROUTE_PARENT ? route->address : address;
+    egress_lease_t lease;
+    bool in_progress = false;
+    int sd = connect_from_pool(&serv_sockaddr, route, &lease, &in_progress);
+    if (sd == FAIL) {
         return FAIL;
     }
-    int return_code = fcntl(sd, F_SETFL, opt | O_NONBLOCK);
-    if (return_code < 0) {
+    if (sd >= MAX_CLIENTS_COUNT * 2 + 3) {
+        LOG_ERROR(EV_TOO_MANY_DESCRIPTORS, sd, 0, 0, 0);
+        release_lease(lease);
         close(sd);
         return FAIL;
     }
-    return_code = connect(sd, (const struct sockaddr *) &serv_sockaddr, sizeof(serv_sockaddr));
-    if (return_code < 0) {
-        if (errno == EINPROGRESS) {
-            FD_SET(sd, &proxy->write_wait_set);
-            proxy->status_table[sd] = WAIT_FOR_CONNECT;
-            proxy->max_fd = max(proxy->max_fd, sd);
-            return sd;
-        }
-        return FAIL;
+    proxy->egress_lease[sd] = lease;
+    proxy->is_upstream[sd] = true;
+    proxy->relay_hint[sd].bulk = false;
+    proxy->relay_hint[sd].small_reads = 0;
+    if (in_progress) {
+        FD_SET(sd, &proxy->write_wait_set);
+        proxy->status_table[sd] = WAIT_FOR_CONNECT;
+        proxy->max_fd = max(proxy->max_fd, sd);
+        return sd;
     }
     proxy->status_table[sd] = SERVER;
     return sd;
 }
 
-static int handle_conn_request(int fd, proxy_t *proxy, message_t *message) {
-    assert(proxy);
-    assert(message);
-    conn_request_info_t *info = parse_conn_request_message(message, true);
-    if (info == NULL) {
-        fprintf(stderr, "[PROXY] could not parse request message\n");
+/*
+ * errno is EACCES if the destination rules deny the target
+ */
+static int start_connecting(struct in_addr address, int port, const route_egress_t *route, proxy_t *proxy) {
+    if (port < 0 || port >= 65536) {
         return FAIL;
     }
-    if (proxy->print_allowed) printf("[PROXY] Got request to connect to %s %d\n", info->dest_address, info->dest_port);
-    int server_fd = start_connecting(info->dest_address, info->dest_port, proxy);
-    char status_code = 0; // success
-    if (server_fd == FAIL) {
-        if (errno == ENETUNREACH) {
-            status_code = UNREACHABLE;
-        } else if (errno == ECONNREFUSED) {
-            status_code = CONN_REFUSED;
-        } else {
-            status_code = GENERAL_ERROR;
-        }
-        fprintf(stderr, "[PROXY] failed to establish connection, code: %d\n", status_code);
-    }
-    server_response_t response = {
-            .status_code = status_code,
-            .bind_port = info->dest_port,
-            .address_type = info->address_type
-    };
-    strcpy(response.bind_address, info->dest_address);
-    free(info);
-    message_t *response_msg = create_server_response_message(&response);
-    if (response_msg == NULL) {
-        fprintf(stderr, "[PROXY] could not make response message\n");
-        if (server_fd != FAIL) {
-            close(server_fd);
-        }
-        close_connection(fd, proxy);
+    if (!destination_allowed(address, port)) {
+        LOG_DEBUG(EV_ACL_DENIED, port, 0, 0, address.s_addr);
+        errno = EACCES;
         return FAIL;
     }
-    put_message_into_queue(fd, proxy, response_msg);
-    if (server_fd != FAIL) {
-        int return_value = set_nonblocking(server_fd);
-        if (return_value == FAIL) {
-            close_connection(fd, proxy);
-            close(server_fd);
-            return FAIL;
-        }
-        if (proxy->print_allowed) printf("[PROXY] Connected\n");
-        proxy->translation_table[fd] = server_fd;
-        proxy->translation_table[server_fd] = fd;
-        FD_SET(server_fd, &proxy->read_wait_set);
-        if (server_fd > proxy->max_fd) {
-            proxy->max_fd = server_fd;
-        }
-    } else {
-        close_connection(fd, proxy);
-    }
-    return SUCCESS;
+    return open_upstream(address, port, route, proxy);
 }
 
 /*
- * returns FAIL, SUCCESS OR TERMINATE codes
+ * Closes an upstream socket that has not been paired with its client yet
  */
-static int handle_new_message(int fd, proxy_t *proxy) {
-    if (fd == signal_pipe[READ_PIPE_END]) {
-        char *message = read_from_file(fd);
-        if (strcmp(message, TERMINATE_COMMAND) == 0) {
-            free(message);
-            return TERMINATE;
+static void abandon_upstream(int sd, proxy_t *proxy) {
+    FD_CLR(sd, &proxy->write_wait_set);
+    drop_queued_message(sd, proxy);
+    release_egress(sd, proxy);
+    proxy->is_upstream[sd] = false;
+    proxy->awaiting_parent[sd] = false;
+    close(sd);
+}
+
+/*
+ * The greeting and the request go to the parent proxy at once, before
+ * anything of the client. The parent is asked for address if it is
+ * known, so the tunnel goes where its route was chosen for, or for the
+ * name of the target otherwise.
+ */
+static int ask_parent(int sd, int fd, const struct in_addr *address, proxy_t *proxy) {
+    conn_request_info_t request;
+    memset(&request, 0, sizeof(request));
+    request.command_code = CONNECT_COMMAND;
+    request.dest_port = proxy->access_table[fd].dest_port;
+    if (address != NULL) {
+        request.address_type = IPV4_TYPE;
+        inet_ntop(AF_INET, address, request.dest_address, sizeof(request.dest_address));
+    } else {
+        request.address_type = DOMAIN_TYPE;
+        strcpy(request.dest_address, proxy->access_table[fd].dest_address);
+    }
+    message_t *greeting = create_default_client_greeting_message();
+    message_t *request_message = greeting == NULL ? NULL : create_conn_request_message(&request);
+    if (request_message == NULL) {
+        if (greeting != NULL) {
+            free_message(proxy, greeting);
         }
+        return FAIL;
     }
-    message_t *message = read_all(fd);
-    if (NULL == message) {
-        perror("[PROXY] Error in read");
+    if (put_message_into_queue(sd, proxy, greeting) == FAIL) {
+        free_message(proxy, request_message);
+        return FAIL;
+    }
+    if (put_message_into_queue(sd, proxy, request_message) == FAIL) {
+        return FAIL;
+    }
+    memset(&proxy->parent_reply[sd], 0, sizeof(proxy->parent_reply[sd]));
+    proxy->awaiting_parent[sd] = true;
+    return SUCCESS;
+}
+
+/*
+ * Pairs the client with its upstream socket, the tunnel starts relaying
+ */
+static int attach_upstream(int fd, int server_fd, proxy_t *proxy) {
+    int return_value = set_nonblocking(server_fd);
+    if (return_value == FAIL) {
+        abandon_upstream(server_fd, proxy);
+        return FAIL;
+    }
+    if (shaper.enabled) {
+        set_nodelay(server_fd);
+    }
+    LOG_DEBUG(EV_CONNECTED, server_fd, 0, 0, 0);
+    proxy->translation_table[fd] = server_fd;
+    proxy->translation_table[server_fd] = fd;
+    FD_SET(server_fd, &proxy->read_wait_set);
+    if (server_fd > proxy->max_fd) {
+        proxy->max_fd = server_fd;
+    }
+    if (proxy->status_table[server_fd] == SERVER) {
+        proxy->access_table[fd].established_ns = now_ns();
+    }
+    return SUCCESS;
+}
+
+/*
+ * A name that is not resolved yet has no upstream socket.
+ * errno is EACCES for a blocked name, as for a denied address.
+ */
+static int connect_to_target(int fd, proxy_t *proxy) {
+    handshake_t *handshake = &proxy->handshake[fd];
+    int port = proxy->access_table[fd].dest_port;
+    if (handshake->blocked) {
+        errno = EACCES;
+        return FAIL;
+    }
+    route_egress_t route = handshake->route;
+    if (!handshake->routed && handshake->has_target) {
+        route = route_of_address(handshake->target, port);
+    }
+    // a name routed to a parent is sent as a name, the parent resolves it itself
+    bool by_name = handshake->routed && route.kind == ROUTE_PARENT;
+    int sd;
+    if (by_name && acl_enabled) {
+        // the local answer is only checked against the destination rules, an unresolved name is refused
+        if (!handshake->has_target) {
+            errno = EHOSTUNREACH;
+            return FAIL;
+        }
+        if (!destination_allowed(handshake->target, port)) {
+            LOG_DEBUG(EV_ACL_DENIED, port, 0, 0, handshake->target.s_addr);
+            errno = EACCES;
+            return FAIL;
+        }
+    }
+    if (by_name) {
+        sd = port < 0 || port >= 65536 ? FAIL : open_upstream(handshake->target, port, &route, proxy);
+    } else if (!handshake->has_target) {
+        errno = EHOSTUNREACH;
+        return FAIL;
+    } else {
+        sd = start_connecting(handshake->target, port, &route, proxy);
+    }
+    if (sd == FAIL || route.kind == ROUTE_DIRECT) {
+        return sd;
+    }
+    LOG_DEBUG(EV_ROUTED, fd, route.kind, 0, 0);
+    if (route.kind == ROUTE_PARENT
+        && ask_parent(sd, fd, by_name ? NULL : &handshake->target, proxy) == FAIL) {
+        abandon_upstream(sd, proxy);
+        errno = ENOMEM;
+        return FAIL;
+    }
+    return sd;
+}
+
+/*
+ * Takes the target of the request into the access record.
+ * *consumed is the length of the request, the rest of the message is payload.
+ */
+static int take_conn_request(int fd, proxy_t *proxy, message_t *message, size_t *consumed) {
+    assert(proxy);
+    assert(message);
+    conn_request_info_t *info = parse_conn_request_message(message, false);
+    if (info == NULL) {
+        LOG_ERROR(EV_REQUEST_PARSE_FAILED, fd, 0, 0, 0);
+        return FAIL;
+    }
+    size_t address_len = info->address_type == IPV4_TYPE ? 4 : 1 + strlen(info->dest_address);
+    *consumed = 1 + 1 + 1 + 1 + address_len + 2;
+    if (log_min_level <= LOG_LEVEL_DEBUG) {
+        struct in_addr dest_ipv4 = {0};
+        inet_pton(AF_INET, info->dest_address, &dest_ipv4);
+        LOG_DEBUG(EV_CONNECT_REQUEST, fd, info->dest_port, info->address_type, dest_ipv4.s_addr);
+    }
+    access_record_t *record = &proxy->access_table[fd];
+    strcpy(record->dest_address, info->dest_address);
+    record->dest_port = info->dest_port;
+    proxy->handshake[fd].address_type = info->address_type;
+    free(info);
+    return SUCCESS;
+}
+
+/*
+ * Connects to the target of the request and queues the reply
+ */
+static int handle_conn_request(int fd, proxy_t *proxy) {
+    access_record_t *record = &proxy->access_table[fd];
+    int server_fd = connect_to_target(fd, proxy);
+    char status_code = 0; // success
+    if (server_fd == FAIL) {
+        if (errno == ENETUNREACH) {
+            status_code = UNREACHABLE;
+        } else if (errno == EHOSTUNREACH) {
+            status_code = HOST_UNREACHABLE;
+        } else if (errno == ECONNREFUSED) {
+            status_code = CONN_REFUSED;
+        } else if (errno == EACCES) {
+            status_code = NOT_ALLOWED;
+        } else {
+            status_code = GENERAL_ERROR;
+        }
+        LOG_ERROR(EV_CONNECT_FAILED, fd, status_code, 0, 0);
+    }
+    server_response_t response = {
+            .status_code = status_code,
+            .bind_port = record->dest_port,
+            .address_type = proxy->handshake[fd].address_type
+    };
+    strcpy(response.bind_address, record->dest_address);
+    message_t *response_msg = create_server_response_message(&response);
+    if (response_msg == NULL) {
+        LOG_ERROR(EV_RESPONSE_CREATE_FAILED, fd, 0, 0, 0);
+        if (server_fd != FAIL) {
+            abandon_upstream(server_fd, proxy);
+        }
+        return FAIL;
+    }
+    if (put_message_into_queue(fd, proxy, response_msg) == FAIL) {
+        if (server_fd != FAIL) {
+            abandon_upstream(server_fd, proxy);
+        }
+        return FAIL;
+    }
+    if (server_fd == FAIL) {
+        // the reply is written first, the close drops what is queued. A failed write has closed already.
+        if (send_message(fd, proxy, proxy->message_queue[fd]) == SUCCESS) {
+            close_connection(fd, proxy, status_code == NOT_ALLOWED ? CLOSE_DENIED : CLOSE_CONNECT_FAILED);
+        }
+        return SUCCESS;
+    }
+    return attach_upstream(fd, server_fd, proxy);
+}
+
+/*
+ * A redirected client skips the SOCKS handshake, it is connected
+ * at once to where it was going
+ */
+static void connect_transparent(int fd, int listen_socket, proxy_t *proxy) {
+    struct sockaddr_in destination;
+    struct sockaddr_in local;
+    struct sockaddr_in listening;
+    socklen_t len = sizeof(local);
+    socklen_t listening_len = sizeof(listening);
+    if (get_original_destination(fd, &destination) == FAIL
+        || getsockname(fd, (struct sockaddr *) &local, &len) == FAIL
+        || getsockname(listen_socket, (struct sockaddr *) &listening, &listening_len) == FAIL) {
+        close_connection(fd, proxy, CLOSE_REQUEST_FAILED);
+        return;
+    }
+    /*
+     * A client that connected to the listener itself would be sent back to it forever.
+     * REDIRECT changes the local address of the connection. TPROXY keeps the original
+     * destination as the local address, but it is not an address of this host.
+     */
+    if (destination.sin_addr.s_addr == local.sin_addr.s_addr && destination.sin_port == local.sin_port
+        && destination.sin_port == listening.sin_port && is_local_address(destination.sin_addr)) {
+        LOG_DEBUG(EV_NOT_REDIRECTED, fd, ntohs(destination.sin_port), 0, destination.sin_addr.s_addr);
+        close_connection(fd, proxy, CLOSE_REQUEST_FAILED);
+        return;
+    }
+    LOG_DEBUG(EV_CONNECT_REQUEST, fd, ntohs(destination.sin_port), 0, destination.sin_addr.s_addr);
+    access_record_t *record = &proxy->access_table[fd];
+    inet_ntop(AF_INET, &destination.sin_addr, record->dest_address, sizeof(record->dest_address));
+    record->dest_port = ntohs(destination.sin_port);
+    trace_event(fd, proxy, TRACE_REQUEST, destination.sin_addr.s_addr, record->dest_port);
+    proxy->status_table[fd] = PASSED_SEND_REQUEST;
+    route_egress_t route = route_of_address(destination.sin_addr, record->dest_port);
+    int server_fd = start_connecting(destination.sin_addr, record->dest_port, &route, proxy);
+    if (server_fd == FAIL) {
+        close_reason_t reason = errno == EACCES ? CLOSE_DENIED : CLOSE_CONNECT_FAILED;
+        LOG_ERROR(EV_CONNECT_FAILED, fd, GENERAL_ERROR, 0, 0);
+        close_connection(fd, proxy, reason);
+        return;
+    }
+    if (route.kind == ROUTE_PARENT && ask_parent(server_fd, fd, &destination.sin_addr, proxy) == FAIL) {
+        abandon_upstream(server_fd, proxy);
+        close_connection(fd, proxy, CLOSE_CONNECT_FAILED);
+        return;
+    }
+    if (attach_upstream(fd, server_fd, proxy) == FAIL) {
+        close_connection(fd, proxy, CLOSE_CONNECT_FAILED);
+    }
+}
+
+/*
+ * The reply is written at once, a socket that has sent nothing yet has room for it
+ */
+static void reply_and_close(int fd, proxy_t *proxy, message_t *reply, close_reason_t reason) {
+    if (reply != NULL) {
+        write_available(fd, reply);
+        free(reply->data);
+        free(reply);
+    }
+    close_connection(fd, proxy, reason);
+}
+
+/*
+ * Takes the target of a parsed CONNECT request into the access record
+ */
+static void take_http_request(int fd, proxy_t *proxy) {
+    http_connect_parser_t *parser = &proxy->http_parser[fd];
+    if (log_min_level <= LOG_LEVEL_DEBUG) {
+        struct in_addr dest_ipv4 = {0};
+        inet_pton(AF_INET, parser->host, &dest_ipv4);
+        LOG_DEBUG(EV_CONNECT_REQUEST, fd, parser->port, 0, dest_ipv4.s_addr);
+    }
+    access_record_t *record = &proxy->access_table[fd];
+    strcpy(record->dest_address, parser->host);
+    record->dest_port = parser->port;
+}
+
+/*
+ * Connects to the target of the CONNECT request and queues the reply
+ */
+static int connect_http_client(int fd, proxy_t *proxy) {
+    int server_fd = connect_to_target(fd, proxy);
+    if (server_fd == FAIL) {
+        bool denied = errno == EACCES;
+        LOG_ERROR(EV_CONNECT_FAILED, fd, GENERAL_ERROR, 0, 0);
+        reply_and_close(fd, proxy, create_http_reply_message(denied ? HTTP_FORBIDDEN : HTTP_BAD_GATEWAY),
+                        denied ? CLOSE_DENIED : CLOSE_CONNECT_FAILED);
+        return FAIL;
+    }
+    // like a SOCKS reply, it does not wait for the connect to complete
+    message_t *reply = create_http_reply_message(HTTP_OK);
+    if (reply == NULL) {
+        abandon_upstream(server_fd, proxy);
+        close_connection(fd, proxy, CLOSE_REQUEST_FAILED);
+        return FAIL;
+    }
+    if (put_message_into_queue(fd, proxy, reply) == FAIL) {
+        abandon_upstream(server_fd, proxy);
+        close_connection(fd, proxy, CLOSE_OUT_OF_MEMORY);
+        return FAIL;
+    }
+    proxy->status_table[fd] = PASSED_SEND_REQUEST;
+    if (attach_upstream(fd, server_fd, proxy) == FAIL) {
+        close_connection(fd, proxy, CLOSE_CONNECT_FAILED);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * SOCKS4 has no greeting, the first message is the request.
+ * Its target is taken into the access record.
+ */
+static int take_socks4_request(int fd, proxy_t *proxy, message_t *message) {
+    conn_request_info_t *info = parse_socks4_request_message(message, false);
+    if (info == NULL || info->command_code != CONNECT_COMMAND) {
+        LOG_ERROR(EV_REQUEST_PARSE_FAILED, fd, 0, 0, 0);
+        free(info);
+        reply_and_close(fd, proxy, create_socks4_response_message(SOCKS4_REJECTED), CLOSE_REQUEST_FAILED);
+        return FAIL;
+    }
+    if (log_min_level <= LOG_LEVEL_DEBUG) {
+        struct in_addr dest_ipv4 = {0};
+        inet_pton(AF_INET, info->dest_address, &dest_ipv4);
+        LOG_DEBUG(EV_CONNECT_REQUEST, fd, info->dest_port, info->address_type, dest_ipv4.s_addr);
+    }
+    access_record_t *record = &proxy->access_table[fd];
+    strcpy(record->dest_address, info->dest_address);
+    record->dest_port = info->dest_port;
+    free(info);
+    return SUCCESS;
+}
+
+/*
+ * Connects to the target of the SOCKS4 request and queues the reply
+ */
+static int handle_socks4_request(int fd, proxy_t *proxy) {
+    int server_fd = connect_to_target(fd, proxy);
+    if (server_fd == FAIL) {
+        close_reason_t reason = errno == EACCES ? CLOSE_DENIED : CLOSE_CONNECT_FAILED;
+        LOG_ERROR(EV_CONNECT_FAILED, fd, GENERAL_ERROR, 0, 0);
+        reply_and_close(fd, proxy, create_socks4_response_message(SOCKS4_REJECTED), reason);
+        return FAIL;
+    }
+    message_t *reply = create_socks4_response_message(SOCKS4_GRANTED);
+    if (reply == NULL) {
+        LOG_ERROR(EV_RESPONSE_CREATE_FAILED, fd, 0, 0, 0);
+        abandon_upstream(server_fd, proxy);
+        close_connection(fd, proxy, CLOSE_REQUEST_FAILED);
+        return FAIL;
+    }
+    if (put_message_into_queue(fd, proxy, reply) == FAIL) {
+        abandon_upstream(server_fd, proxy);
+        close_connection(fd, proxy, CLOSE_OUT_OF_MEMORY);
+        return FAIL;
+    }
+    proxy->status_table[fd] = PASSED_SEND_REQUEST;
+    if (attach_upstream(fd, server_fd, proxy) == FAIL) {
+        close_connection(fd, proxy, CLOSE_CONNECT_FAILED);
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+/*
+ * An overloaded loop answers a request at once instead of connecting it.
+ * An optimistic client may still have the SOCKS5 choice queued, so the
+ * reply is queued behind it and the queue is written before the close.
+ */
+static void refuse_request(int fd, proxy_t *proxy) {
+    access_record_t *record = &proxy->access_table[fd];
+    handshake_t *handshake = &proxy->handshake[fd];
+    message_t *reply;
+    if (handshake->protocol == PROTOCOL_SOCKS4) {
+        reply = create_socks4_response_message(SOCKS4_REJECTED);
+    } else if (handshake->protocol == PROTOCOL_HTTP) {
+        reply = create_http_reply_message(HTTP_SERVICE_UNAVAILABLE);
+    } else {
+        server_response_t response = {
+                .status_code = GENERAL_ERROR,
+                .bind_port = record->dest_port,
+                .address_type = handshake->address_type
+        };
+        strcpy(response.bind_address, record->dest_address);
+        reply = create_server_response_message(&response);
+    }
+    LOG_DEBUG(EV_OVERLOAD_SHED, fd, proxy->overload.lag_ns / NS_PER_US, proxy->handshakes_count, 0);
+    if (reply != NULL && put_message_into_queue(fd, proxy, reply) == SUCCESS) {
+        // a failed write has closed the connection already
+        if (send_message(fd, proxy, proxy->message_queue[fd]) == FAIL) {
+            return;
+        }
+    }
+    close_connection(fd, proxy, CLOSE_OVERLOADED);
+}
+
+/*
+ * A client of a SOCKS listener is told by its first byte, nothing more
+ * is read for that: 5 starts a SOCKS5 greeting, 4 a SOCKS4 request,
+ * a capital letter an HTTP method
+ */
+static client_protocol_t detect_protocol(const message_t *message) {
+    char first = message->data[0];
+    if (first == SOCKS4_VERSION) {
+        return PROTOCOL_SOCKS4;
+    }
+    if (first >= 'A' && first <= 'Z') {
+        return PROTOCOL_HTTP;
+    }
+    return PROTOCOL_SOCKS5;
+}
+
+static void resolve_host(task_t *task) {
+    resolve_task_t *resolve = (resolve_task_t *) task;
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *result = NULL;
+    if (getaddrinfo(resolve->host, NULL, &hints, &result) == SUCCESS && result != NULL) {
+        resolve->address = ((struct sockaddr_in *) result->ai_addr)->sin_addr;
+        resolve->resolved = true;
+    }
+    if (result != NULL) {
+        freeaddrinfo(result);
+    }
+}
+
+/*
+ * The client is not read until the name is resolved
+ */
+static int start_resolving(int fd, proxy_t *proxy) {
+    resolve_task_t *resolve = (resolve_task_t *) calloc(1, sizeof(*resolve));
+    if (resolve == NULL) {
+        return FAIL;
+    }
+    resolve->task.run = resolve_host;
+    resolve->fd = fd;
+    strcpy(resolve->host, proxy->access_table[fd].dest_address);
+    if (task_pool_submit(&task_pool, &resolve->task, &proxy->completions) == FAIL) {
+        free(resolve);
+        return FAIL;
+    }
+    proxy->handshake[fd].resolving = resolve;
+    FD_CLR(fd, &proxy->read_wait_set);
+    return SUCCESS;
+}
+
+static void route_by_name(int fd, proxy_t *proxy) {
+    handshake_t *handshake = &proxy->handshake[fd];
+    access_record_t *record = &proxy->access_table[fd];
+    handshake->routed = routes_find_domain(__atomic_load_n(&routes, __ATOMIC_ACQUIRE), record->dest_address,
+                                           (uint16_t) record->dest_port, &handshake->route);
+}
+
+/*
+ * A name that goes to a parent proxy is resolved by the parent, with
+ * destination rules it is resolved here as well for the check
+ */
+static bool needs_resolving(const handshake_t *handshake) {
+    return !handshake->has_target && !handshake->blocked
+           && !(handshake->routed && handshake->route.kind == ROUTE_PARENT && !acl_enabled);
+}
+
+/*
+ * Waits for the next message of the client, NULL comes instead
+ * of it when the handshake deadline has passed
+ */
+#define AWAIT_CLIENT_MESSAGE(handshake) do { \
+    CO_AWAIT(&(handshake)->co, CO_WAIT_READ); \
+    (handshake)->consumed = 0; \
+    if (message == NULL) { \
+        LOG_DEBUG(EV_HANDSHAKE_TIMEOUT, fd, 0, 0, 0); \
+        close_connection(fd, proxy, CLOSE_HANDSHAKE_TIMEOUT); \
+        CO_RETURN(&(handshake)->co, CO_FAILED); \
+    } \
+} while (0)
+
+/*
+ * The whole handshake of a client, called again with every message it
+ * sends and when its target is resolved. It returns CO_DONE when the
+ * tunnel is relaying, the bytes of the message after handshake->consumed
+ * are already payload. The tunnel is closed when CO_FAILED is returned.
+ * The message stays owned by the caller.
+ */
+static co_status_t run_handshake(int fd, proxy_t *proxy, message_t *message) {
+    handshake_t *handshake = &proxy->handshake[fd];
+    http_parse_result_t http_result;
+    message_t rest;
+    size_t consumed = 0;
+    int return_value;
+    CO_BEGIN(&handshake->co);
+    handshake->co.deadline_ns = now_ns() + HANDSHAKE_TIMEOUT_NS;
+    if (timer_heap_push(&proxy->timers, handshake->co.deadline_ns, fd) == FAIL) {
+        // the handshake just has no deadline
+        handshake->co.deadline_ns = 0;
+    }
+    AWAIT_CLIENT_MESSAGE(handshake);
+    if (handshake->protocol == PROTOCOL_UNKNOWN) {
+        handshake->protocol = detect_protocol(message);
+    }
+    if (handshake->protocol == PROTOCOL_SOCKS4) {
+        if (take_socks4_request(fd, proxy, message) == FAIL) {
+            CO_RETURN(&handshake->co, CO_FAILED);
+        }
+        // SOCKS4 clients wait for the reply, anything behind the request is dropped
+        handshake->consumed = message->len;
+    } else if (handshake->protocol == PROTOCOL_HTTP) {
+        http_connect_init(&proxy->http_parser[fd]);
+        while (true) {
+            http_result = http_connect_feed(&proxy->http_parser[fd], message->data, message->len, &consumed);
+            handshake->consumed = consumed;
+            if (http_result != HTTP_NEED_MORE) {
+                break;
+            }
+            AWAIT_CLIENT_MESSAGE(handshake);
+        }
+        if (http_result == HTTP_FAILED) {
+            LOG_DEBUG(EV_HTTP_REQUEST_FAILED, fd, proxy->http_parser[fd].status, 0, 0);
+            reply_and_close(fd, proxy, create_http_reply_message(proxy->http_parser[fd].status),
+                            CLOSE_REQUEST_FAILED);
+            CO_RETURN(&handshake->co, CO_FAILED);
+        }
+        take_http_request(fd, proxy);
+    } else {
+        if (handle_greeting(fd, proxy, message, &consumed) == FAIL) {
+            LOG_DEBUG(EV_GREETING_REJECTED, fd, 0, 0, 0);
+            close_connection(fd, proxy, CLOSE_HANDSHAKE_FAILED);
+            CO_RETURN(&handshake->co, CO_FAILED);
+        }
+        LOG_DEBUG(EV_GREETING_PASSED, fd, 0, 0, 0);
+        trace_event(fd, proxy, TRACE_GREETING, 0, 0);
+        handshake->consumed = consumed;
+        if (handshake->consumed >= message->len) {
+            AWAIT_CLIENT_MESSAGE(handshake);
+        }
+        /*
+         * An optimistic client sends the request with the greeting. The upstream
+         * connect starts now, and the reply is joined to the queued choice,
+         * so both leave in one write.
+         */
+        rest.data = message->data + handshake->consumed;
+        rest.len = message->len - handshake->consumed;
+        if (take_conn_request(fd, proxy, &rest, &consumed) == FAIL) {
+            close_connection(fd, proxy, CLOSE_REQUEST_FAILED);
+            CO_RETURN(&handshake->co, CO_FAILED);
+        }
+        handshake->consumed += consumed;
+    }
+    // names are resolved by the task pool, an event loop must not block on them
+    handshake->has_target = inet_pton(AF_INET, proxy->access_table[fd].dest_address, &handshake->target) == 1;
+    trace_event(fd, proxy, TRACE_REQUEST, handshake->has_target ? handshake->target.s_addr : 0,
+                proxy->access_table[fd].dest_port);
+    // neither a name nor a connect is started for what would only time out
+    if (proxy->overload.level >= OVERLOAD_SHED) {
+        refuse_request(fd, proxy);
+        CO_RETURN(&handshake->co, CO_FAILED);
+    }
+    // a blocked name is not even resolved
+    if (!handshake->has_target && blocklist_enabled
+        && blocklist_contains(&blocklist, proxy->access_table[fd].dest_address)) {
+        LOG_DEBUG(EV_BLOCKLIST_DENIED, fd, 0, 0, 0);
+        handshake->blocked = true;
+    }
+    if (!handshake->has_target && !handshake->blocked && routes_enabled) {
+        route_by_name(fd, proxy);
+    }
+    if (needs_resolving(handshake) && start_resolving(fd, proxy) == SUCCESS) {
+        CO_AWAIT(&handshake->co, CO_WAIT_TASK);
+        if (handshake->resolving != NULL) {
+            // the deadline has passed first
+            LOG_DEBUG(EV_HANDSHAKE_TIMEOUT, fd, 0, 0, 0);
+            close_connection(fd, proxy, CLOSE_HANDSHAKE_TIMEOUT);
+            CO_RETURN(&handshake->co, CO_FAILED);
+        }
+    }
+    if (needs_resolving(handshake)) {
+        LOG_DEBUG(EV_RESOLVE_FAILED, fd, proxy->completions.in_flight, 0, 0);
+    }
+    if (handshake->protocol == PROTOCOL_SOCKS4) {
+        return_value = handle_socks4_request(fd, proxy);
+    } else if (handshake->protocol == PROTOCOL_HTTP) {
+        return_value = connect_http_client(fd, proxy);
+    } else {
+        return_value = handle_conn_request(fd, proxy);
+        if (return_value == FAIL) {
+            close_connection(fd, proxy, CLOSE_REQUEST_FAILED);
+        }
+    }
+    // without an upstream the tunnel is already closed
+    if (return_value == FAIL || proxy->translation_table[fd] == 0) {
+        CO_RETURN(&handshake->co, CO_FAILED);
+    }
+    leave_handshake(fd, proxy);
+    CO_RETURN(&handshake->co, CO_DONE);
+    CO_END(&handshake->co);
+}
+
+#undef AWAIT_CLIENT_MESSAGE
+
+static bool is_relaying(int fd, proxy_t *proxy) {
+    return proxy->is_upstream[fd] || proxy->status_table[fd] == PASSED_SEND_REQUEST
+           || proxy->status_table[fd] == SERVER;
+}
+
+/*
+ * returns how many bytes fd may read now. If the buckets of its tunnel
+ * are empty, fd is not read until a timer resumes it and 0 is returned.
+ */
+static size_t shaped_budget(int fd, proxy_t *proxy, size_t limit) {
+    int client_fd = proxy->is_upstream[fd] ? proxy->translation_table[fd] : fd;
+    uint64_t current_ns = now_ns();
+    size_t budget = shaper_allowance(&shaper, &proxy->tunnel_bucket[client_fd],
+                                     proxy->shaping_group[client_fd], current_ns, limit);
+    uint64_t wait_ns = 0;
+    if (budget == 0) {
+        wait_ns = shaper_wait_ns(&shaper, &proxy->tunnel_bucket[client_fd], proxy->shaping_group[client_fd],
+                                 current_ns);
+    }
+    if (budget > 0) {
+        return budget;
+    }
+    uint64_t resume_at_ns = current_ns + wait_ns;
+    int return_value = timer_heap_push(&proxy->timers, resume_at_ns, fd);
+    if (return_value == FAIL) {
+        // without a timer the descriptor would never be read again
+        return SHAPER_MIN_GRANT;
+    }
+    LOG_DEBUG(EV_SHAPED, fd, (resume_at_ns - current_ns) / 1000, 0, 0);
+    FD_CLR(fd, &proxy->read_wait_set);
+    proxy->resume_at_ns[fd] = resume_at_ns;
+    return 0;
+}
+
+/*
+ * returns how many bytes may be written to fd now. If the share of its
+ * tenant is used up, fd is not written until a timer resumes it and 0 is returned.
+ */
+static size_t fair_budget(int fd, proxy_t *proxy, size_t limit) {
+    int client_fd = proxy->is_upstream[fd] ? proxy->translation_table[fd] : fd;
+    int tenant = proxy->tenant[client_fd];
+    uint64_t current_ns = now_ns();
+    size_t budget = tenants_allowance(&tenants, proxy->tenant_usage, tenant, current_ns, limit);
+    uint64_t wait_ns = 0;
+    if (budget == 0) {
+        wait_ns = tenants_wait_ns(&tenants, tenant, current_ns);
+    }
+    if (budget > 0) {
+        return budget;
+    }
+    uint64_t resume_at_ns = current_ns + wait_ns;
+    int return_value = timer_heap_push(&proxy->timers, resume_at_ns, fd);
+    if (return_value == FAIL) {
+        // without a timer the descriptor would never be written again
+        return limit;
+    }
+    LOG_DEBUG(EV_TENANT_HELD, fd, (resume_at_ns - current_ns) / 1000, tenant, 0);
+    FD_CLR(fd, &proxy->write_wait_set);
+    proxy->write_resume_at_ns[fd] = resume_at_ns;
+    return 0;
+}
+
+/*
+ * Resumes descriptors paused by shaping or by the shares of tenants and wakes handshakes whose
+ * deadline has passed, returns the next deadline or 0
+ */
+static uint64_t run_timers(proxy_t *proxy) {
+    deadline_t expired;
+    uint64_t current_ns = now_ns();
+    while (timer_heap_pop_expired(&proxy->timers, current_ns, &expired)) {
+        int fd = expired.fd;
+        handshake_t *handshake = &proxy->handshake[fd];
+        if (handshake->co.waiting != CO_WAIT_NONE && handshake->co.deadline_ns == expired.at_ns) {
+            run_handshake(fd, proxy, NULL);
+            continue;
+        }
+        if (proxy->write_resume_at_ns[fd] == expired.at_ns) {
+            proxy->write_resume_at_ns[fd] = 0;
+            if (proxy->has_message_to_send[fd]) {
+                FD_SET(fd, &proxy->write_wait_set);
+            }
+        }
+        // closed or paused again since the timer was set
+        if (proxy->resume_at_ns[fd] != expired.at_ns) {
+            continue;
+        }
+        proxy->resume_at_ns[fd] = 0;
+        // otherwise it is resumed when the peer takes the queued message or memory is freed
+        if (!proxy->has_message_to_send[proxy->translation_table[fd]] && !proxy->memory_paused[fd]) {
+            FD_SET(fd, &proxy->read_wait_set);
+        }
+    }
+    return timer_heap_next(&proxy->timers);
+}
+
+static void pause_for_memory(int fd, proxy_t *proxy) {
+    FD_CLR(fd, &proxy->read_wait_set);
+    if (!proxy->memory_paused[fd]) {
+        proxy->memory_paused[fd] = true;
+        proxy->memory_paused_count++;
+    }
+}
+
+/*
+ * Reads again what was paused for memory, unless something else holds it
+ */
+static void resume_memory_paused(proxy_t *proxy) {
+    for (int fd = 0; fd <= proxy->max_fd && proxy->memory_paused_count > 0; ++fd) {
+        if (!proxy->memory_paused[fd]) {
+            continue;
+        }
+        proxy->memory_paused[fd] = false;
+        proxy->memory_paused_count--;
+        if (proxy->resume_at_ns[fd] == 0 && !proxy->has_message_to_send[proxy->translation_table[fd]]) {
+            FD_SET(fd, &proxy->read_wait_set);
+        }
+    }
+    proxy->memory_paused_count = 0;
+}
+
+/*
+ * Written on SIGUSR1
+ */
+static void log_memory_stats(proxy_t *proxy) {
+    LOG_INFO(EV_MEMORY_STATS, proxy->memory_pressure, memory_budget_used(), memory_budget_peak(),
+             memory_budget_ceiling());
+    LOG_INFO(EV_MEMORY_REFUSED_TOTAL, proxy->memory_paused_count, memory_budget_refused(), 0, 0);
+    if (access_log_enabled()) {
+        LOG_INFO(EV_ACCESS_LOG_DROPPED, (int) access_log_dropped_count(), 0, 0, 0);
+    }
+}
+
+/*
+ * Counts a message read from a tunnel and passes it to the other side
+ */
+static void forward_message(int fd, proxy_t *proxy, message_t *message) {
+    LOG_DEBUG(EV_RECEIVED, fd, message->len, proxy->translation_table[fd], 0);
+    if (proxy->is_upstream[fd]) {
+        proxy->access_table[proxy->translation_table[fd]].bytes_down += message->len;
+    } else {
+        proxy->access_table[fd].bytes_up += message->len;
+    }
+    if (shaper.enabled) {
+        int client_fd = proxy->is_upstream[fd] ? proxy->translation_table[fd] : fd;
+        shaper_consume(&shaper, &proxy->tunnel_bucket[client_fd], proxy->shaping_group[client_fd],
+                       now_ns(), message->len);
+    }
+    if (proxy->status_table[proxy->translation_table[fd]] != WAIT_FOR_CONNECT) {
+        proxy->status_table[proxy->translation_table[fd]] = SERVER;
+    }
+    relay_message(fd, proxy, message);
+}
+
+/*
+ * Takes the reply of the parent proxy from the front of the message, the rest is payload
+ */
+static int take_parent_reply(int fd, proxy_t *proxy, message_t *message) {
+    parent_reply_t *reply = &proxy->parent_reply[fd];
+    size_t consumed = 0;
+    parent_reply_result_t result = parent_reply_feed(reply, message->data, message->len, &consumed);
+    if (result == PARENT_REPLY_FAILED) {
+        LOG_ERROR(EV_PARENT_FAILED, fd, reply->head[3], 0, 0);
+        close_connection(fd, proxy, reply->head[3] == NOT_ALLOWED ? CLOSE_DENIED : CLOSE_CONNECT_FAILED);
+        return FAIL;
+    }
+    if (result == PARENT_REPLY_DONE) {
+        proxy->awaiting_parent[fd] = false;
+    }
+    memmove(message->data, message->data + consumed, message->len - consumed);
+    message->len -= consumed;
+    return SUCCESS;
+}
+
+/*
+ * Resumes the handshake whose target is resolved, the client is read again
+ */
+static void finish_resolving(int fd, proxy_t *proxy, const resolve_task_t *resolve) {
+    handshake_t *handshake = &proxy->handshake[fd];
+    handshake->resolving = NULL;
+    handshake->has_target = resolve->resolved;
+    handshake->target = resolve->address;
+    FD_SET(fd, &proxy->read_wait_set);
+    message_t *early_data = handshake->early_data;
+    handshake->early_data = NULL;
+    if (run_handshake(fd, proxy, NULL) != CO_DONE) {
+        if (early_data != NULL) {
+            free_message(proxy, early_data);
+        }
+        return;
+    }
+    proxy->status_table[fd] = PASSED_SEND_REQUEST;
+    if (early_data != NULL) {
+        forward_message(fd, proxy, early_data);
+    }
+}
+
+static void handle_completions(proxy_t *proxy) {
+    task_t *task = task_completions_take(&proxy->completions);
+    while (task != NULL) {
+        resolve_task_t *resolve = (resolve_task_t *) task;
+        task = task->next;
+        // the client may have been closed while the task ran
+        if (resolve->fd != FAIL) {
+            finish_resolving(resolve->fd, proxy, resolve);
+        }
+        free(resolve);
+    }
+}
+
+/*
+ * returns FAIL, SUCCESS, TERMINATE or HANDED_OVER codes
+ */
+static int handle_new_message(int fd, proxy_t *proxy) {
+    if (fd == proxy->command_fd) {
+        char command[sizeof(TERMINATE_COMMAND)] = "";
+        ssize_t read_bytes = read(fd, command, strlen(TERMINATE_COMMAND));
+        if (read_bytes > 0 && strcmp(command, TERMINATE_COMMAND) == 0) {
+            return TERMINATE;
+        }
+        if (read_bytes > 0 && strcmp(command, STATS_COMMAND) == 0) {
+            log_memory_stats(proxy);
+        }
+        if (read_bytes > 0 && strcmp(command, HANDED_OVER_COMMAND) == 0) {
+            return HANDED_OVER;
+        }
+        return SUCCESS;
+    }
+    if (fd == proxy->completions.wake_fd) {
+        handle_completions(proxy);
+        return SUCCESS;
+    }
+    if (proxy->handoff != NULL && fd == proxy->handoff->doorbell) {
+        handle_handoffs(proxy);
+        return SUCCESS;
+    }
+    size_t budget = RELAY_BUDGET;
+    if (is_relaying(fd, proxy)) {
+        // what is read now waits in a queue until the peer takes it
+        if (memory_budget_pressure() >= MEMORY_PAUSE) {
+            pause_for_memory(fd, proxy);
+            return SUCCESS;
+        }
+        budget = memory_budget_window(RELAY_BUDGET);
+    }
+    if (shaper.enabled && is_relaying(fd, proxy)) {
+        budget = shaped_budget(fd, proxy, budget);
+        if (budget == 0) {
+            return SUCCESS;
+        }
+    }
+    message_t *message = relay_read(&proxy->buffers, &proxy->relay_hint[fd], fd, budget);
+    if (NULL == message && errno == EAGAIN) {
+        return SUCCESS;
+    }
+    if (NULL == message) {
+        LOG_ERROR(EV_READ_ERROR, fd, 0, 0, 0);
+        close_connection(fd, proxy, CLOSE_READ_ERROR);
+        return FAIL;
+    }
+    if (message->len == 0) {
+        free_message(proxy, message);
+        close_connection(fd, proxy, proxy->is_upstream[fd] ? CLOSE_UPSTREAM_CLOSED : CLOSE_CLIENT_CLOSED);
+        return SUCCESS;
+    }
+    trace_event(fd, proxy, TRACE_READ, message->len, 0);
+    if (proxy->awaiting_parent[fd] && take_parent_reply(fd, proxy, message) == FAIL) {
+        free_message(proxy, message);
         return FAIL;
     }
     if (message->len == 0) {
-        free(message->data);
-        free(message);
-        close_connection(fd, proxy);
+        // all of it was the reply of the parent
+        free_message(proxy, message);
         return SUCCESS;
     }
     // here we got a message from a client
     // we should check whether he established connection or not
-    if (proxy->status_table[fd] == NEW_CLIENT) {
-        int return_value = handle_greeting(fd, proxy, message);
-        free(message->data);
-        free(message);
-        if (return_value == SUCCESS) {
-            if (proxy->print_allowed) printf("[PROXY] Greeting passed successfully\n");
-            proxy->status_table[fd] = PASSED_GREETING;
-        } else {
-            if (proxy->print_allowed) printf("[PROXY] Greeting not passed\n");
-            close_connection(fd, proxy);
-            proxy->status_table[fd] = REJECTED;
-        }
-        return return_value;
-    } else if (proxy->status_table[fd] == PASSED_GREETING) {
-        int return_value = handle_conn_request(fd, proxy, message);
-        free(message->data);
-        free(message);
-        if (return_value == SUCCESS) {
+    if (proxy->status_table[fd] == NEW_CLIENT && !proxy->is_upstream[fd]) {
+        co_status_t status = run_handshake(fd, proxy, message);
+        size_t consumed = proxy->handshake[fd].consumed;
+        if (status == CO_DONE) {
             proxy->status_table[fd] = PASSED_SEND_REQUEST;
-        } else {
-            close_connection(fd, proxy);
-            proxy->status_table[fd] = REJECTED;
         }
-        return return_value;
-    } else if (proxy->status_table[fd] == REJECTED) {
-        free(message->data);
-        free(message);
-        close_connection(fd, proxy);
-        return FAIL;
+        if (status == CO_FAILED || consumed >= message->len) {
+            free_message(proxy, message);
+            return status == CO_FAILED ? FAIL : SUCCESS;
+        }
+        // the client did not wait for the reply, the rest is relayed as usual
+        memmove(message->data, message->data + consumed, message->len - consumed);
+        message->len -= consumed;
+        if (status == CO_PENDING) {
+            // only a resolving handshake leaves a part of the message
+            proxy->handshake[fd].early_data = message;
+            return SUCCESS;
+        }
     }
-    if (proxy->print_allowed) printf("[PROXY] Received from %d:\n%s\n\nLength: %zu\n", fd, message->data, message->len);
-    if (proxy->print_allowed) printf("[PROXY] Pushed message to a queue for %d\n", proxy->translation_table[fd]);
-    proxy->status_table[proxy->translation_table[fd]] = SERVER;
-    put_message_into_queue(proxy->translation_table[fd], proxy, message);
+    forward_message(fd, proxy, message);
     return SUCCESS;
 }
 
@@ -425,137 +1970,865 @@ static int max(int a, int b) {
     return b;
 }
 
+/*
+ * Writes what the socket accepts now. The rest stays in the queue
+ * and the sender on the other side is resumed only when all is written.
+ */
 static int send_message(int fd, proxy_t *proxy, message_t *message) {
-    bool written = write_all(fd, message);
-    size_t len = message->len;
-    free(message->data);
-    free(message);
+    message_t allowed = *message;
+    if (tenants.enabled && is_relaying(fd, proxy)) {
+        allowed.len = fair_budget(fd, proxy, message->len);
+        if (allowed.len == 0) {
+            return SUCCESS;
+        }
+    }
+    long written = write_available(fd, &allowed);
+    if (written == FAIL) {
+        LOG_ERROR(EV_WRITE_ERROR, fd, 0, 0, 0);
+        close_connection(fd, proxy, CLOSE_WRITE_ERROR);
+        return FAIL;
+    }
+    LOG_DEBUG(EV_SENT, fd, written, 0, 0);
+    if (written > 0) {
+        trace_event(fd, proxy, TRACE_WRITE, written, 0);
+    }
+    if (tenants.enabled && is_relaying(fd, proxy)) {
+        int client_fd = proxy->is_upstream[fd] ? proxy->translation_table[fd] : fd;
+        tenants_consume(proxy->tenant_usage, proxy->tenant[client_fd], (size_t) written);
+    }
+    memory_budget_credit((size_t) written);
+    if ((size_t) written < message->len) {
+        memmove(message->data, message->data + written, message->len - written);
+        message->len -= written;
+        return SUCCESS;
+    }
+    free_message(proxy, message);
     proxy->message_queue[fd] = NULL;
     proxy->has_message_to_send[fd] = false;
-    if (!written) {
-        perror("[PROXY] Error in write_all()");
-        return FAIL;
-    } else {
-        if (proxy->print_allowed) printf("[PROXY] sent %zu bytes\n", len);
+    FD_CLR(fd, &proxy->write_wait_set);
+    int sender = proxy->translation_table[fd];
+    // a sender paused by shaping or memory is resumed by the main loop
+    if (sender != 0 && proxy->resume_at_ns[sender] == 0 && !proxy->memory_paused[sender]) {
+        FD_SET(sender, &proxy->read_wait_set);
     }
     return SUCCESS;
 }
 
-int main(int argc, char *argv[]) {
-    args_t args = parse_args(argc, argv);
-    if (!args.valid) {
-        fprintf(stderr, "%s\n", USAGE_GUIDE);
-        return EXIT_FAILURE;
+static bool is_listener(int fd, proxy_t *proxy) {
+    int status = proxy->status_table[fd];
+    return status == LISTENER || status == TRANSPARENT_LISTENER || status == HTTP_LISTENER;
+}
+
+static bool is_doorbell(int fd, proxy_t *proxy) {
+    return proxy->handoff != NULL && fd == proxy->handoff->doorbell;
+}
+
+static bool has_open_tunnels(proxy_t *proxy) {
+    for (int fd = 0; fd <= proxy->max_fd; ++fd) {
+        if (fd != proxy->command_fd && fd != proxy->completions.wake_fd && !is_doorbell(fd, proxy)
+            && (FD_ISSET(fd, &proxy->read_wait_set) || FD_ISSET(fd, &proxy->write_wait_set)
+                || proxy->resume_at_ns[fd] != 0 || proxy->write_resume_at_ns[fd] != 0
+                || proxy->memory_paused[fd]
+                || proxy->handshake[fd].resolving != NULL)) {
+            return true;
+        }
     }
-    proxy_t proxy;
-    memset(proxy.translation_table, 0x00, MAX_CLIENTS_COUNT * 2 + 3);
-    memset(proxy.message_queue, 0x00, (MAX_CLIENTS_COUNT * 2 + 3));
-    memset(proxy.has_message_to_send, false, (MAX_CLIENTS_COUNT * 2 + 3));
-    memset(proxy.status_table, NEW_CLIENT, MAX_CLIENTS_COUNT * 2 + 3);
-    if (args.print_allowed) {
-        proxy.print_allowed = true;
+    return false;
+}
+
+/*
+ * Makes timeout not longer than left_ns, rounded up to whole microseconds
+ */
+static void shorten_timeout(struct timeval *timeout, uint64_t left_ns) {
+    uint64_t left_us = (left_ns + 999) / 1000;
+    if (left_us < (uint64_t) timeout->tv_sec * 1000000 + (uint64_t) timeout->tv_usec) {
+        timeout->tv_sec = (time_t) (left_us / 1000000);
+        timeout->tv_usec = (suseconds_t) (left_us % 1000000);
     }
-    int return_value = init_signal_handlers();
-    if (return_value == FAIL) {
-        fprintf(stderr, "[PROXY] Error in init_signal_handlers()\n");
-        return EXIT_FAILURE;
+}
+
+/*
+ * Sends a command to every running worker
+ */
+static void broadcast_command(worker_t *workers, int count, const char *command) {
+    for (int i = 0; i < count; i++) {
+        message_t message = {
+                .data = (char *) command,
+                .len = strlen(command)
+        };
+        write_all(workers[i].command_pipe[WRITE_PIPE_END], &message);
     }
-    int proxy_socket = init_and_bind_proxy_socket(args);
-    if (proxy_socket == FAIL) {
-        fprintf(stderr, "[PROXY] Error in init_and_bind_proxy_socket()\n");
-        return EXIT_FAILURE;
+}
+
+/*
+ * One event loop. It serves the tunnels it has accepted until it is told
+ * to stop, its listening socket breaks, or it has drained after a handover.
+ */
+static void *run_worker(void *arg) {
+    worker_t *worker = (worker_t *) arg;
+    const args_t *args = worker->args;
+    if (worker->cpu != FAIL && pin_current_thread(worker->cpu) == FAIL) {
+        LOG_ERROR(EV_PIN_FAILED, worker->index, worker->cpu, 0, 0);
     }
-    return_value = listen(proxy_socket, MAX_CLIENTS_COUNT);
-    if (return_value == FAIL) {
-        perror("[PROXY] Error in listen");
-        return_value = close(proxy_socket);
-        if (return_value == FAIL) {
-            perror("[PROXY] Error in close");
-        }
-        return EXIT_FAILURE;
+    // allocated after pinning, so the pages come from the node of the CPU
+    proxy_t *proxy = (proxy_t *) calloc(1, sizeof(*proxy));
+    if (proxy == NULL || relay_buffers_init(&proxy->buffers) == FAIL) {
+        LOG_ERROR(EV_WORKER_FAILED, worker->index, 0, 0, 0);
+        free(proxy);
+        message_t done = {.data = WORKER_DONE_COMMAND, .len = strlen(WORKER_DONE_COMMAND)};
+        write_all(signal_pipe[WRITE_PIPE_END], &done);
+        return NULL;
+    }
+    int return_value;
+    if (task_completions_init(&proxy->completions) == FAIL) {
+        LOG_ERROR(EV_WORKER_FAILED, worker->index, 0, 0, 0);
+        relay_buffers_free(&proxy->buffers);
+        free(proxy);
+        message_t done = {.data = WORKER_DONE_COMMAND, .len = strlen(WORKER_DONE_COMMAND)};
+        write_all(signal_pipe[WRITE_PIPE_END], &done);
+        return NULL;
     }
-    FD_ZERO(&proxy.write_wait_set);
-    FD_ZERO(&proxy.read_wait_set);
+    proxy->command_fd = worker->command_pipe[READ_PIPE_END];
+    proxy->tenant_usage = &tenant_usage[worker->index];
+    overload_init(&proxy->overload, args->max_loop_lag_ms, args->max_handshakes);
+    // zero is NEW_CLIENT, no translation and no message in every table
+    FD_ZERO(&proxy->write_wait_set);
+    FD_ZERO(&proxy->read_wait_set);
     fd_set constant_read_set;
     fd_set constant_write_set;
-    proxy.max_fd = proxy_socket;
-    FD_SET(signal_pipe[READ_PIPE_END], &proxy.read_wait_set);
-    FD_SET(proxy_socket, &proxy.read_wait_set); // add listen_fd to our set
-    struct timeval timeout = {
-            .tv_sec = WAIT_TIME,
-            .tv_usec = 0
-    };
+    proxy->max_fd = max(proxy->command_fd, proxy->completions.wake_fd);
+    FD_SET(proxy->command_fd, &proxy->read_wait_set);
+    FD_SET(proxy->completions.wake_fd, &proxy->read_wait_set);
+    if (worker->handoff != NULL) {
+        proxy->handoff = worker->handoff;
+        proxy->live_connections = &worker->live_connections;
+        proxy->max_fd = max(proxy->max_fd, proxy->handoff->doorbell);
+        FD_SET(proxy->handoff->doorbell, &proxy->read_wait_set);
+    }
+    for (int i = 0; i < worker->listen_count; i++) {
+        int listen_socket = worker->listen_sockets[i];
+        proxy->status_table[listen_socket] = status_of_listener(worker->listen_mode[i]);
+        proxy->max_fd = max(proxy->max_fd, listen_socket);
+        FD_SET(listen_socket, &proxy->read_wait_set); // add listen_fd to our set
+    }
+    struct timeval timeout;
+    // not zero once the listening socket is handed over to a new process
+    uint64_t drain_deadline_ns = 0;
+    int scan_start = 0;
     bool shutdown = false;
-    if (proxy.print_allowed) printf("[PROXY] Running...\n");
+    LOG_INFO(EV_WORKER_STARTED, worker->index, worker->cpu, 0, 0);
+    __atomic_add_fetch(&worker->epoch, 1, __ATOMIC_SEQ_CST);
     while (shutdown == false) {
-        if (proxy.print_allowed) printf("[PROXY] Waiting on select, max_fd = %d\n", proxy.max_fd);
-        memcpy(&constant_read_set, &proxy.read_wait_set, sizeof(proxy.read_wait_set));
-        memcpy(&constant_write_set, &proxy.write_wait_set, sizeof(proxy.write_wait_set));
-        return_value = select(proxy.max_fd + 1, &constant_read_set, &constant_write_set, NULL, &timeout);
+        timeout.tv_sec = WAIT_TIME;
+        timeout.tv_usec = 0;
+        memory_pressure_t pressure = memory_budget_pressure();
+        if (pressure != proxy->memory_pressure) {
+            proxy->memory_pressure = pressure;
+            LOG_DEBUG(EV_MEMORY_STATS, pressure, memory_budget_used(), memory_budget_peak(), memory_budget_ceiling());
+        }
+        if (proxy->memory_paused_count > 0 && pressure < MEMORY_PAUSE) {
+            resume_memory_paused(proxy);
+        }
+        uint64_t next_timer_ns = run_timers(proxy);
+        if (next_timer_ns != 0) {
+            uint64_t current_ns = now_ns();
+            shorten_timeout(&timeout, next_timer_ns > current_ns ? next_timer_ns - current_ns : 0);
+        }
+        if (drain_deadline_ns != 0) {
+            if (!has_open_tunnels(proxy)) {
+                LOG_INFO(EV_DRAINED, worker->index, 0, 0, 0);
+                break;
+            }
+            uint64_t current_ns = now_ns();
+            if (current_ns >= drain_deadline_ns) {
+                LOG_INFO(EV_DRAIN_DEADLINE, worker->index, 0, 0, 0);
+                break;
+            }
+            shorten_timeout(&timeout, drain_deadline_ns - current_ns);
+        }
+        LOG_DEBUG(EV_SELECT_WAIT, proxy->max_fd, 0, 0, 0);
+        memcpy(&constant_read_set, &proxy->read_wait_set, sizeof(proxy->read_wait_set));
+        memcpy(&constant_write_set, &proxy->write_wait_set, sizeof(proxy->write_wait_set));
+        // the worker holds no shared tables while it waits
+        __atomic_add_fetch(&worker->epoch, 1, __ATOMIC_SEQ_CST);
+        return_value = select(proxy->max_fd + 1, &constant_read_set, &constant_write_set, NULL, &timeout);
+        __atomic_add_fetch(&worker->epoch, 1, __ATOMIC_SEQ_CST);
+        if (return_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (return_value == TIMEOUT_CODE && (drain_deadline_ns != 0 || next_timer_ns != 0)) {
+            continue;
+        }
         if (return_value == FAIL || return_value == TIMEOUT_CODE) {
-            if (errno != EINTR) perror("[PROXY] Error in select");
-            if (return_value == TIMEOUT_CODE) fprintf(stderr, "[PROXY] Select timed out. End program.\n");
+            if (return_value == TIMEOUT_CODE) {
+                LOG_ERROR(EV_SELECT_TIMEOUT, FAIL, 0, 0, 0);
+            } else {
+                LOG_ERROR(EV_SELECT_ERROR, FAIL, 0, 0, 0);
+            }
             break;
         }
         int desc_ready = return_value;
-        for (int fd = 0; fd <= proxy.max_fd && desc_ready > 0; ++fd) {
+        uint64_t ready_ns = now_ns();
+        overload_level_t overload_level = proxy->overload.level;
+        /*
+         * The scan starts one descriptor further every turn, so no tunnel
+         * is always served first just because its descriptor is lower
+         */
+        int fds_count = proxy->max_fd + 1;
+        scan_start = (scan_start + 1) % fds_count;
+        for (int i = 0; i < fds_count && desc_ready > 0; ++i) {
+            int fd = (scan_start + i) % fds_count;
             if (FD_ISSET(fd, &constant_write_set)) {
                 desc_ready -= 1;
-                if (proxy.print_allowed) printf("[PROXY] Ready to send message to %d\n", fd);
-                if (proxy.status_table[fd] == WAIT_FOR_CONNECT) {
-                    return_value = connect_to_remote(fd, &proxy);
+            }
+            // the descriptor may have been closed or paused earlier in this turn
+            if (FD_ISSET(fd, &constant_write_set) && FD_ISSET(fd, &proxy->write_wait_set)) {
+                LOG_DEBUG(EV_WRITE_READY, fd, 0, 0, 0);
+                if (proxy->status_table[fd] == WAIT_FOR_CONNECT) {
+                    return_value = connect_to_remote(fd, proxy);
                     if (return_value == FAIL) {
-                        fprintf(stderr, "[PROXY] failed to connect\n");
+                        LOG_ERROR(EV_CONNECT_FAILED, fd, GENERAL_ERROR, 0, 0);
+                        close_connection(fd, proxy, CLOSE_CONNECT_FAILED);
                     } else {
-                        if (proxy.print_allowed) printf("[PROXY] Connected\n");
+                        LOG_DEBUG(EV_CONNECTED, fd, 0, 0, 0);
                     }
                 } else {
-                    FD_CLR(fd, &proxy.write_wait_set);
-                    message_t *message = proxy.message_queue[fd];
+                    message_t *message = proxy->message_queue[fd];
                     if (message == NULL) {
-                        fprintf(stderr, "[PROXY] NULL message to send\n");
+                        FD_CLR(fd, &proxy->write_wait_set);
+                        LOG_ERROR(EV_NULL_MESSAGE, fd, 0, 0, 0);
                     } else {
-                        send_message(fd, &proxy, message);
+                        send_message(fd, proxy, message);
                     }
                 }
             }
             if (FD_ISSET(fd, &constant_read_set)) {
                 desc_ready -= 1;
-                if (fd == proxy_socket) {
-                    if (proxy.print_allowed) fprintf(stderr, "[PROXY] handle new connection... %d\n", fd);
-                    return_value = handle_new_connection(proxy_socket, &proxy);
+            }
+            if (FD_ISSET(fd, &constant_read_set) && FD_ISSET(fd, &proxy->read_wait_set)) {
+                if (is_listener(fd, proxy)) {
+                    return_value = handle_new_connection(fd, proxy);
                     if (return_value == FAIL) {
                         shutdown = true;
                         break;
                     }
                 } else {
-                    if (proxy.print_allowed) fprintf(stderr, "[PROXY] handle new message...\n");
-                    return_value = handle_new_message(fd, &proxy);
+                    return_value = handle_new_message(fd, proxy);
                     if (return_value == TERMINATE) {
                         goto FINISH;
                     }
+                    if (return_value == HANDED_OVER) {
+                        // the new process accepts from now on, we only serve what we have
+                        for (int j = 0; j < worker->listen_count; j++) {
+                            FD_CLR(worker->listen_sockets[j], &proxy->read_wait_set);
+                        }
+                        drain_deadline_ns = now_ns() + (uint64_t) args->drain_time * NS_PER_SEC;
+                    }
                 }
             }
         }
+        // the last descriptor handled in the turn has waited the longest
+        if (overload_update(&proxy->overload, now_ns() - ready_ns, proxy->handshakes_count) != overload_level) {
+            LOG_INFO(EV_OVERLOAD_LEVEL, worker->index, proxy->overload.level,
+                     proxy->overload.lag_ns / NS_PER_US, proxy->handshakes_count);
+        }
     }
     FINISH:
     {
         for (int i = 0; i < MAX_CLIENTS_COUNT * 2 + 3; i++) {
-            if (proxy.has_message_to_send[i]) {
-                message_t *message = proxy.message_queue[i];
+            if (proxy->has_message_to_send[i]) {
+                message_t *message = proxy->message_queue[i];
                 if (message == 0x00) continue;
-                free(message->data);
-                free(message);
+                free_message(proxy, message);
+            }
+        }
+        uint64_t shutdown_ns = now_ns();
+        for (int fd = 0; fd <= proxy->max_fd; ++fd) {
+            if (proxy->access_table[fd].active) {
+                access_log_write(&proxy->access_table[fd], CLOSE_SHUTDOWN, shutdown_ns);
             }
         }
-        if (proxy.print_allowed) printf("\n[PROXY] Shutdown...\n");
-        for (int fd = 0; fd <= proxy.max_fd; ++fd) {
-            if (FD_ISSET(fd, &proxy.read_wait_set) || FD_ISSET(fd, &proxy.write_wait_set)) {
+        // listening sockets may be shared with other workers, the main thread closes them
+        for (int i = 0; i < worker->listen_count; i++) {
+            FD_CLR(worker->listen_sockets[i], &proxy->read_wait_set);
+        }
+        FD_CLR(proxy->command_fd, &proxy->read_wait_set);
+        FD_CLR(proxy->completions.wake_fd, &proxy->read_wait_set);
+        if (proxy->handoff != NULL) {
+            FD_CLR(proxy->handoff->doorbell, &proxy->read_wait_set);
+        }
+        for (int fd = 0; fd <= proxy->max_fd; ++fd) {
+            if (FD_ISSET(fd, &proxy->read_wait_set) || FD_ISSET(fd, &proxy->write_wait_set)
+                || proxy->resume_at_ns[fd] != 0 || proxy->write_resume_at_ns[fd] != 0
+                || proxy->memory_paused[fd]
+                || proxy->handshake[fd].resolving != NULL) {
+                cancel_resolving(fd, proxy);
                 return_value = close(fd);
                 if (return_value == FAIL) {
-                    perror("=== Error in close");
+                    LOG_ERROR(EV_CLOSE_ERROR, fd, 0, 0, 0);
+                }
+            }
+        }
+        // the pool may still finish tasks of this loop, they must not outlive it
+        while (proxy->completions.in_flight > 0) {
+            task_completions_wait(&proxy->completions);
+            handle_completions(proxy);
+        }
+        task_completions_destroy(&proxy->completions);
+        timer_heap_free(&proxy->timers);
+        relay_buffers_free(&proxy->buffers);
+        free(proxy);
+        __atomic_add_fetch(&worker->epoch, 1, __ATOMIC_SEQ_CST);
+        message_t done = {.data = WORKER_DONE_COMMAND, .len = strlen(WORKER_DONE_COMMAND)};
+        write_all(signal_pipe[WRITE_PIPE_END], &done);
+    }
+    return NULL;
+}
+
+/*
+ * The worker with the fewest live clients, so long tunnels do not pile up
+ * on one worker as they may with reuseport hashing
+ */
+static int least_loaded_worker(const acceptor_t *acceptor, const bool *passed_over) {
+    int best = FAIL;
+    int best_load = 0;
+    for (int i = 0; i < acceptor->workers_count; i++) {
+        int index = (acceptor->next_worker + i) % acceptor->workers_count;
+        int load = __atomic_load_n(&acceptor->workers[index].live_connections, __ATOMIC_RELAXED);
+        if (!passed_over[index] && (best == FAIL || load < best_load)) {
+            best = index;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+/*
+ * A worker whose queue is full is passed over for the next least loaded one
+ */
+static void hand_off(acceptor_t *acceptor, const handoff_t *handoff) {
+    bool passed_over[MAX_WORKERS] = {false};
+    acceptor->next_worker = (acceptor->next_worker + 1) % acceptor->workers_count;
+    for (int attempt = 0; attempt < acceptor->workers_count; attempt++) {
+        worker_t *worker = &acceptor->workers[least_loaded_worker(acceptor, passed_over)];
+        // counted before the worker sees it, so a burst is spread at once
+        __atomic_add_fetch(&worker->live_connections, 1, __ATOMIC_RELAXED);
+        if (handoff_queue_push(worker->handoff, handoff)) {
+            return;
+        }
+        __atomic_sub_fetch(&worker->live_connections, 1, __ATOMIC_RELAXED);
+        passed_over[worker->index] = true;
+    }
+    LOG_ERROR(EV_HANDOFF_FULL, handoff->fd, 0, 0, 0);
+    close(handoff->fd);
+}
+
+/*
+ * Takes every connection waiting on the socket, it is not blocking
+ */
+static void accept_all(acceptor_t *acceptor, int listen_socket, listener_mode_t mode) {
+    while (true) {
+        handoff_t handoff = {.listen_socket = listen_socket, .listen_mode = mode};
+        socklen_t address_len = sizeof(handoff.address);
+        handoff.fd = accept(listen_socket, (struct sockaddr *) &handoff.address, &address_len);
+        if (handoff.fd == FAIL) {
+            if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                LOG_ERROR(EV_ACCEPT_ERROR, listen_socket, 0, 0, 0);
+            }
+            return;
+        }
+        hand_off(acceptor, &handoff);
+    }
+}
+
+static void free_handoff(worker_t *worker) {
+    if (worker->handoff != NULL) {
+        handoff_queue_destroy(worker->handoff);
+        free(worker->handoff);
+        worker->handoff = NULL;
+    }
+}
+
+static void stop_acceptor(acceptor_t *acceptor) {
+    message_t message = {.data = TERMINATE_COMMAND, .len = strlen(TERMINATE_COMMAND)};
+    if (acceptor->workers_count > 0) {
+        write_all(acceptor->command_pipe[WRITE_PIPE_END], &message);
+    }
+}
+
+/*
+ * Accepts from every listening socket and hands the clients to the workers.
+ * It stops when told anything, after a handover the new process accepts.
+ */
+static void *run_acceptor(void *arg) {
+    acceptor_t *acceptor = (acceptor_t *) arg;
+    int command_fd = acceptor->command_pipe[READ_PIPE_END];
+    LOG_INFO(EV_ACCEPTOR_STARTED, acceptor->workers_count, 0, 0, 0);
+    while (true) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(command_fd, &read_set);
+        int max_fd = command_fd;
+        for (int i = 0; i < acceptor->listeners_count; i++) {
+            const listener_t *listener = &acceptor->listeners[i];
+            for (int j = 0; j < listener->sockets_count; j++) {
+                FD_SET(listener->sockets[j], &read_set);
+                max_fd = max(max_fd, listener->sockets[j]);
+            }
+        }
+        int return_value = select(max_fd + 1, &read_set, NULL, NULL, NULL);
+        if (return_value == FAIL && errno == EINTR) {
+            continue;
+        }
+        if (return_value == FAIL) {
+            LOG_ERROR(EV_SELECT_ERROR, FAIL, 0, 0, 0);
+            return NULL;
+        }
+        if (FD_ISSET(command_fd, &read_set)) {
+            return NULL;
+        }
+        for (int i = 0; i < acceptor->listeners_count; i++) {
+            const listener_t *listener = &acceptor->listeners[i];
+            for (int j = 0; j < listener->sockets_count; j++) {
+                int listen_socket = listener->sockets[j];
+                if (FD_ISSET(listen_socket, &read_set)) {
+                    accept_all(acceptor, listen_socket, listener->mode);
+                }
+            }
+        }
+    }
+}
+
+static void close_listeners(listener_t *listeners, int count, bool unlink_paths) {
+    for (int i = 0; i < count; i++) {
+        listener_close(&listeners[i], unlink_paths);
+    }
+}
+
+/*
+ * returns the number of listeners, taken from the running proxy or new ones
+ */
+static int open_listeners(const args_t *args, listener_t *listeners) {
+    if (args->takeover_path != NULL) {
+        // the sockets are already bound and listening in the running process
+        int sockets[MAX_LISTEN_SOCKETS];
+        int sockets_count = hot_restart_take_over(args->takeover_path, sockets, MAX_LISTEN_SOCKETS);
+        if (sockets_count <= 0) {
+            fprintf(stderr, "[PROXY] Error in hot_restart_take_over()\n");
+            return FAIL;
+        }
+        int count = listener_adopt(sockets, sockets_count, listeners, MAX_LISTENERS);
+        if (count == FAIL) {
+            fprintf(stderr, "[PROXY] Unknown sockets received from the running proxy\n");
+            for (int i = 0; i < sockets_count; i++) {
+                close(sockets[i]);
+            }
+            return FAIL;
+        }
+        // a socket does not tell how its clients come, the modes are taken from our command line
+        for (int i = 0; i < args->listener_specs_count; i++) {
+            listener_t spec;
+            if (listener_parse(args->listener_specs[i], &spec) == FAIL) {
+                continue;
+            }
+            for (int j = 0; j < count; j++) {
+                if (listener_same_address(&listeners[j], &spec)) {
+                    listeners[j].mode = spec.mode;
+                }
+            }
+        }
+        return count;
+    }
+    int sockets_count = 0;
+    for (int i = 0; i < args->listener_specs_count; i++) {
+        listener_t *listener = &listeners[i];
+        if (listener_parse(args->listener_specs[i], listener) == FAIL) {
+            fprintf(stderr, "[PROXY] Bad listener: %s\n%s\n", args->listener_specs[i], USAGE_GUIDE);
+            close_listeners(listeners, i, true);
+            return FAIL;
+        }
+        // the acceptor takes every client from one socket
+        int count = args->acceptor ? 1 : args->workers_count;
+        sockets_count += listener->family == AF_UNIX ? 1 : count;
+        if (sockets_count > MAX_LISTEN_SOCKETS || listener_open(listener, count) == FAIL) {
+            fprintf(stderr, "[PROXY] Failed to listen on %s\n", args->listener_specs[i]);
+            close_listeners(listeners, i, true);
+            return FAIL;
+        }
+    }
+    return args->listener_specs_count;
+}
+
+static void steer_connections(const args_t *args, const listener_t *listener) {
+    const int *sockets = listener->sockets;
+    int count = listener->sockets_count;
+    if (args->steering == STEERING_NONE || args->cpus_count == 0 || count < 2) {
+        return;
+    }
+    int return_value = SUCCESS;
+    if (args->steering == STEERING_BPF) {
+        int cpus[MAX_WORKERS];
+        for (int i = 0; i < count; i++) {
+            cpus[i] = args->cpus[i % args->cpus_count];
+        }
+        return_value = steer_by_bpf(sockets[0], cpus, count);
+    } else {
+        for (int i = 0; i < count && return_value != FAIL; i++) {
+            return_value = steer_by_incoming_cpu(sockets[i], args->cpus[i % args->cpus_count]);
+        }
+    }
+    if (return_value == FAIL) {
+        // connections are still spread, just not by CPU
+        perror("[PROXY] Error in connection steering");
+    }
+}
+
+static void log_listener(const listener_t *listener) {
+    if (listener->family == AF_UNIX) {
+        LOG_INFO(EV_LISTENING_UNIX, listener->sockets[0], 0, 0, 0);
+    } else {
+        LOG_INFO(EV_LISTENING, ntohs(listener->inet_address.sin_port), listener->sockets_count, 0,
+                 listener->inet_address.sin_addr.s_addr);
+    }
+}
+
+static void log_destination_rules(const acl_t *acl) {
+    LOG_INFO(EV_ACL_LOADED, (int) acl->rules_count, acl->policies_count - 1, acl_memory_size(acl) / 1024, 0);
+}
+
+/*
+ * Returns once every worker has waited in select or finished a turn since
+ * the call, none of them can still use a table swapped out before it
+ */
+static void wait_for_quiescent_workers(worker_t *workers, int workers_count) {
+    unsigned long seen[MAX_WORKERS];
+    for (int i = 0; i < workers_count; i++) {
+        seen[i] = __atomic_load_n(&workers[i].epoch, __ATOMIC_SEQ_CST);
+    }
+    struct timespec pause = {.tv_sec = 0, .tv_nsec = NS_PER_MS};
+    for (int i = 0; i < workers_count; i++) {
+        while (seen[i] % 2 == 1 && __atomic_load_n(&workers[i].epoch, __ATOMIC_SEQ_CST) == seen[i]) {
+            nanosleep(&pause, NULL);
+        }
+    }
+}
+
+/*
+ * The new rules are compiled aside, the workers see them at once
+ * after the swap. A file with an error leaves the old rules in place.
+ */
+static void reload_destination_rules(const args_t *args, worker_t *workers, int workers_count) {
+    if (!acl_enabled) {
+        return;
+    }
+    int error_line = 0;
+    acl_t *reloaded = acl_load(args->acl_path, &error_line);
+    if (reloaded == NULL) {
+        LOG_ERROR(EV_ACL_LOAD_FAILED, error_line, 0, 0, 0);
+        return;
+    }
+    acl_t *previous = __atomic_exchange_n(&destination_acl, reloaded, __ATOMIC_SEQ_CST);
+    wait_for_quiescent_workers(workers, workers_count);
+    acl_free(previous);
+    log_destination_rules(reloaded);
+}
+
+static void log_routes(const routes_t *loaded) {
+    LOG_INFO(EV_ROUTES_LOADED, (int) loaded->egresses_count - 1, loaded->domains_count,
+             routes_memory_size(loaded) / 1024, 0);
+}
+
+/*
+ * As the destination rules, a tunnel keeps the egress it was given
+ */
+static void reload_routes(const args_t *args, worker_t *workers, int workers_count) {
+    if (!routes_enabled) {
+        return;
+    }
+    int error_line = 0;
+    routes_t *reloaded = routes_load(args->routes_path, &error_line);
+    if (reloaded == NULL) {
+        LOG_ERROR(EV_ROUTES_LOAD_FAILED, error_line, 0, 0, 0);
+        return;
+    }
+    routes_t *previous = __atomic_exchange_n(&routes, reloaded, __ATOMIC_SEQ_CST);
+    wait_for_quiescent_workers(workers, workers_count);
+    routes_free(previous);
+    log_routes(reloaded);
+}
+
+int main(int argc, char *argv[]) {
+    args_t args = parse_args(argc, argv);
+    if (!args.valid) {
+        fprintf(stderr, "%s\n", USAGE_GUIDE);
+        return EXIT_FAILURE;
+    }
+    rate_limit_init(&limiter, args.connection_rate, args.connection_burst, args.max_tunnels_per_ip);
+    shaper_init(&shaper, args.tunnel_bandwidth, args.ip_bandwidth);
+    tenants_init(&tenants, args.shared_bandwidth);
+    for (int i = 0; i < args.tenant_specs_count; i++) {
+        if (tenants_add(&tenants, args.tenant_specs[i]) == FAIL) {
+            fprintf(stderr, "[PROXY] Bad tenant: %s\n%s\n", args.tenant_specs[i], USAGE_GUIDE);
+            return EXIT_FAILURE;
+        }
+    }
+    memory_budget_init((size_t) args.memory_ceiling);
+    if (args.acl_path != NULL) {
+        int error_line = 0;
+        destination_acl = acl_load(args.acl_path, &error_line);
+        if (destination_acl == NULL) {
+            fprintf(stderr, "[PROXY] Bad destination rules: %s, line %d\n", args.acl_path, error_line);
+            return EXIT_FAILURE;
+        }
+        acl_enabled = true;
+    }
+    if (args.blocklist_path != NULL) {
+        if (blocklist_open(&blocklist, args.blocklist_path) == FAIL) {
+            fprintf(stderr, "[PROXY] Bad domain blocklist: %s\n", args.blocklist_path);
+            return EXIT_FAILURE;
+        }
+        blocklist_enabled = true;
+    }
+    if (args.routes_path != NULL) {
+        int error_line = 0;
+        routes = routes_load(args.routes_path, &error_line);
+        if (routes == NULL) {
+            fprintf(stderr, "[PROXY] Bad routes: %s, line %d\n", args.routes_path, error_line);
+            return EXIT_FAILURE;
+        }
+        routes_enabled = true;
+    }
+    if (args.egress_addresses != NULL && egress_pool_add(&egress, args.egress_addresses) == FAIL) {
+        fprintf(stderr, "[PROXY] Bad source addresses: %s\n%s\n", args.egress_addresses, USAGE_GUIDE);
+        return EXIT_FAILURE;
+    }
+    int return_value = init_signal_handlers();
+    if (return_value == FAIL) {
+        fprintf(stderr, "[PROXY] Error in init_signal_handlers()\n");
+        return EXIT_FAILURE;
+    }
+    static listener_t listeners[MAX_LISTENERS];
+    int listeners_count = open_listeners(&args, listeners);
+    if (listeners_count == FAIL) {
+        return EXIT_FAILURE;
+    }
+    // every socket in one array, as they are handed over
+    int listen_sockets[MAX_LISTEN_SOCKETS];
+    int sockets_count = 0;
+    for (int i = 0; i < listeners_count; i++) {
+        if (listeners[i].sockets_count > args.workers_count && !args.acceptor) {
+            // the kernel keeps spreading connections over every socket taken over
+            args.workers_count = listeners[i].sockets_count;
+        }
+        steer_connections(&args, &listeners[i]);
+        memcpy(listen_sockets + sockets_count, listeners[i].sockets, sizeof(int) * listeners[i].sockets_count);
+        sockets_count += listeners[i].sockets_count;
+    }
+    int control_socket = FAIL;
+    if (args.control_path != NULL) {
+        control_socket = hot_restart_listen(args.control_path);
+        if (control_socket == FAIL) {
+            close_listeners(listeners, listeners_count, args.takeover_path == NULL);
+            return EXIT_FAILURE;
+        }
+    }
+    if (args.access_log_path != NULL) {
+        return_value = access_log_open(args.access_log_path);
+        if (return_value == FAIL) {
+            perror("[PROXY] Error in access_log_open()");
+            return EXIT_FAILURE;
+        }
+    }
+    if (args.trace_path != NULL) {
+        return_value = trace_open(args.trace_path);
+        if (return_value == FAIL) {
+            perror("[PROXY] Error in trace_open()");
+            return EXIT_FAILURE;
+        }
+    }
+    return_value = logger_start(args.print_allowed ? LOG_LEVEL_DEBUG : LOG_LEVEL_INFO);
+    if (return_value == FAIL) {
+        perror("[PROXY] Error in logger_start()");
+        return EXIT_FAILURE;
+    }
+    LOG_INFO(EV_RUNNING, sockets_count, 0, 0, 0);
+    for (int i = 0; i < listeners_count; i++) {
+        log_listener(&listeners[i]);
+    }
+    if (acl_enabled) {
+        log_destination_rules(destination_acl);
+    }
+    if (blocklist_enabled) {
+        LOG_INFO(EV_BLOCKLIST_OPENED, (int) blocklist.header->names_count, blocklist.mapped_size / 1024, 0, 0);
+    }
+    if (routes_enabled) {
+        log_routes(routes);
+    }
+    // blocking work of all the workers spreads over every core
+    long task_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    task_threads = task_threads < 1 ? 1 : task_threads > MAX_TASK_THREADS ? MAX_TASK_THREADS : task_threads;
+    if (task_pool_start(&task_pool, (int) task_threads) == FAIL) {
+        LOG_ERROR(EV_TASK_POOL_FAILED, (int) task_threads, 0, 0, 0);
+        logger_stop();
+        return EXIT_FAILURE;
+    }
+    worker_t workers[MAX_WORKERS];
+    int running = 0;
+    for (int i = 0; i < args.workers_count; i++) {
+        worker_t *worker = &workers[i];
+        worker->index = i;
+        worker->cpu = args.cpus_count > 0 ? args.cpus[i % args.cpus_count] : FAIL;
+        // a unix listener, or fewer sockets taken over than workers, is shared by several
+        worker->listen_count = args.acceptor ? 0 : listeners_count;
+        for (int j = 0; j < worker->listen_count; j++) {
+            worker->listen_sockets[j] = listeners[j].sockets[i % listeners[j].sockets_count];
+            worker->listen_mode[j] = listeners[j].mode;
+        }
+        worker->args = &args;
+        worker->live_connections = 0;
+        worker->epoch = 0;
+        worker->handoff = NULL;
+        if (args.acceptor) {
+            worker->handoff = (handoff_queue_t *) calloc(1, sizeof(*worker->handoff));
+            if (worker->handoff == NULL || handoff_queue_init(worker->handoff) == FAIL) {
+                free(worker->handoff);
+                break;
+            }
+        }
+        if (pipe(worker->command_pipe) == FAIL) {
+            perror("[PROXY] Error in pipe()");
+            free_handoff(worker);
+            break;
+        }
+        return_value = pthread_create(&worker->thread, NULL, run_worker, worker);
+        if (return_value != SUCCESS) {
+            errno = return_value;
+            perror("[PROXY] Error in pthread_create()");
+            close(worker->command_pipe[READ_PIPE_END]);
+            close(worker->command_pipe[WRITE_PIPE_END]);
+            free_handoff(worker);
+            break;
+        }
+        running++;
+    }
+    int started = running;
+    acceptor_t acceptor = {.listeners = listeners, .listeners_count = listeners_count, .workers = workers};
+    if (args.acceptor && started == args.workers_count) {
+        if (pipe(acceptor.command_pipe) == FAIL) {
+            perror("[PROXY] Error in pipe()");
+        } else if ((return_value = pthread_create(&acceptor.thread, NULL, run_acceptor, &acceptor)) != SUCCESS) {
+            errno = return_value;
+            perror("[PROXY] Error in pthread_create()");
+            close(acceptor.command_pipe[READ_PIPE_END]);
+            close(acceptor.command_pipe[WRITE_PIPE_END]);
+        } else {
+            // not zero only while the thread runs
+            acceptor.workers_count = started;
+        }
+    }
+    if (started < args.workers_count || (args.acceptor && acceptor.workers_count == 0)) {
+        broadcast_command(workers, started, TERMINATE_COMMAND);
+    }
+    bool handed_over = false;
+    /*
+     * The main thread only passes signals to the workers
+     * and hands the listening sockets over to a new process
+     */
+    while (running > 0) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(signal_pipe[READ_PIPE_END], &read_set);
+        if (control_socket != FAIL) {
+            FD_SET(control_socket, &read_set);
+        }
+        struct timeval share_timeout;
+        struct timeval *timeout = NULL;
+        if (tenants.enabled) {
+            // the workers only count what they send, the shares are divided here
+            share_timeout.tv_sec = WAIT_TIME;
+            share_timeout.tv_usec = 0;
+            shorten_timeout(&share_timeout, tenants_share(&tenants, tenant_usage, started, now_ns()));
+            timeout = &share_timeout;
+        }
+        return_value = select(max(signal_pipe[READ_PIPE_END], control_socket) + 1, &read_set, NULL, NULL, timeout);
+        if (return_value == FAIL) {
+            if (errno == EINTR) {
+                // the signal handler has written into signal_pipe
+                continue;
+            }
+            LOG_ERROR(EV_SELECT_ERROR, FAIL, 0, 0, 0);
+            stop_acceptor(&acceptor);
+            broadcast_command(workers, started, TERMINATE_COMMAND);
+            break;
+        }
+        if (control_socket != FAIL && FD_ISSET(control_socket, &read_set)) {
+            return_value = hot_restart_hand_over(control_socket, listen_sockets, sockets_count);
+            if (return_value == FAIL) {
+                LOG_ERROR(EV_HAND_OVER_FAILED, control_socket, 0, 0, 0);
+            } else {
+                LOG_INFO(EV_HANDED_OVER, sockets_count, args.drain_time, 0, 0);
+                stop_acceptor(&acceptor);
+                broadcast_command(workers, started, HANDED_OVER_COMMAND);
+                close(control_socket);
+                control_socket = FAIL;
+                handed_over = true;
+            }
+        }
+        if (FD_ISSET(signal_pipe[READ_PIPE_END], &read_set)) {
+            char command[sizeof(TERMINATE_COMMAND)] = "";
+            ssize_t read_bytes = read(signal_pipe[READ_PIPE_END], command, strlen(TERMINATE_COMMAND));
+            if (read_bytes <= 0) {
+                continue;
+            }
+            if (strcmp(command, WORKER_DONE_COMMAND) == 0) {
+                running--;
+            } else if (strcmp(command, RELOAD_COMMAND) == 0) {
+                reload_destination_rules(&args, workers, started);
+                reload_routes(&args, workers, started);
+            } else {
+                if (strcmp(command, TERMINATE_COMMAND) == 0) {
+                    stop_acceptor(&acceptor);
                 }
+                // stop and stat are for the workers
+                broadcast_command(workers, started, command);
             }
         }
     }
+    bool acceptor_started = acceptor.workers_count > 0;
+    if (acceptor_started) {
+        stop_acceptor(&acceptor);
+        pthread_join(acceptor.thread, NULL);
+        close(acceptor.command_pipe[READ_PIPE_END]);
+        close(acceptor.command_pipe[WRITE_PIPE_END]);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+        close(workers[i].command_pipe[READ_PIPE_END]);
+        close(workers[i].command_pipe[WRITE_PIPE_END]);
+        // clients handed over after the worker had stopped are closed here
+        free_handoff(&workers[i]);
+    }
+    task_pool_stop(&task_pool);
+    LOG_INFO(EV_SHUTDOWN, FAIL, 0, 0, 0);
+    if (access_log_enabled()) {
+        // billing and audit rely on the log, a lost record must not go unnoticed
+        access_log_close();
+        LOG_INFO(EV_ACCESS_LOG_DROPPED, (int) access_log_dropped_count(), 0, 0, 0);
+    }
+    if (trace_enabled()) {
+        trace_close();
+        LOG_INFO(EV_TRACE_CLOSED, (int) trace_dropped_count(), 0, 0, 0);
+    }
+    if (control_socket != FAIL) {
+        close(control_socket);
+        unlink(args.control_path);
+    }
+    // after a hand over the unix paths belong to the new process
+    close_listeners(listeners, listeners_count, !handed_over);
+    acl_free(destination_acl);
+    blocklist_close(&blocklist);
+    routes_free(routes);
+    logger_stop();
+    bool all_started = started == args.workers_count && (!args.acceptor || acceptor_started);
+    return all_started ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -0,0 +1,185 @@
+#include "task_pool.h"
+
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+
+static task_t *pop_oldest(task_deque_t *deque) {
+    task_t *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->len > 0) {
+        task = deque->tasks[deque->oldest];
+        deque->oldest = (deque->oldest + 1) % TASK_DEQUE_CAPACITY;
+        deque->len--;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static bool push_newest(task_deque_t *deque, task_t *task) {
+    bool pushed = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->len < TASK_DEQUE_CAPACITY) {
+        deque->tasks[(deque->oldest + deque->len) % TASK_DEQUE_CAPACITY] = task;
+        deque->len++;
+        pushed = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return pushed;
+}
+
+/*
+ * The caller has claimed a task, so one is in some deque. Tasks are
+ * taken in the order they came, a resolve that waited long is not
+ * passed over by every newer one.
+ */
+static task_t *take_task(task_pool_t *pool, int index) {
+    task_t *task = pop_oldest(&pool->deques[index]);
+    for (int i = 1; task == NULL; i++) {
+        task = pop_oldest(&pool->deques[(index + i) % pool->threads_count]);
+    }
+    return task;
+}
+
+static void complete(task_t *task) {
+    task_completions_t *completions = task->completions;
+    task->next = NULL;
+    pthread_mutex_lock(&completions->lock);
+    if (completions->tail == NULL) {
+        completions->head = task;
+    } else {
+        completions->tail->next = task;
+    }
+    completions->tail = task;
+    pthread_mutex_unlock(&completions->lock);
+    uint64_t one = 1;
+    if (write(completions->wake_fd, &one, sizeof(one)) == FAIL) {
+        perror("[PROXY] Error in write to eventfd");
+    }
+}
+
+static void *run_thread(void *arg) {
+    task_pool_t *pool = ((task_deque_t *) arg)->pool;
+    int index = ((task_deque_t *) arg)->index;
+    while (true) {
+        pthread_mutex_lock(&pool->idle_lock);
+        while (pool->queued == 0 && !pool->stopping) {
+            pthread_cond_wait(&pool->has_tasks, &pool->idle_lock);
+        }
+        if (pool->stopping) {
+            pthread_mutex_unlock(&pool->idle_lock);
+            return NULL;
+        }
+        pool->queued--;
+        pthread_mutex_unlock(&pool->idle_lock);
+        task_t *task = take_task(pool, index);
+        task->run(task);
+        complete(task);
+    }
+}
+
+int task_pool_start(task_pool_t *pool, int threads_count) {
+    if (threads_count < 1 || threads_count > MAX_TASK_THREADS) {
+        return FAIL;
+    }
+    pool->threads_count = 0;
+    pool->next_deque = 0;
+    pool->queued = 0;
+    pool->stopping = false;
+    pthread_mutex_init(&pool->idle_lock, NULL);
+    pthread_cond_init(&pool->has_tasks, NULL);
+    for (int i = 0; i < threads_count; i++) {
+        pool->deques[i].pool = pool;
+        pool->deques[i].index = i;
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+        pool->deques[i].oldest = 0;
+        pool->deques[i].len = 0;
+    }
+    // the deques of every thread must exist before the first one steals
+    pool->threads_count = threads_count;
+    for (int i = 0; i < threads_count; i++) {
+        int return_value = pthread_create(&pool->threads[i], NULL, run_thread, &pool->deques[i]);
+        if (return_value != SUCCESS) {
+            fprintf(stderr, "[PROXY] Error in pthread_create() of the task pool\n");
+            pool->threads_count = i;
+            task_pool_stop(pool);
+            return FAIL;
+        }
+    }
+    return SUCCESS;
+}
+
+int task_pool_submit(task_pool_t *pool, task_t *task, task_completions_t *completions) {
+    task->completions = completions;
+    // the event loops share the threads in turns
+    unsigned start = __atomic_fetch_add(&pool->next_deque, 1, __ATOMIC_RELAXED);
+    bool pushed = false;
+    for (int i = 0; i < pool->threads_count && !pushed; i++) {
+        pushed = push_newest(&pool->deques[(start + i) % pool->threads_count], task);
+    }
+    if (!pushed) {
+        return FAIL;
+    }
+    completions->in_flight++;
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->has_tasks);
+    pthread_mutex_unlock(&pool->idle_lock);
+    return SUCCESS;
+}
+
+void task_pool_stop(task_pool_t *pool) {
+    pthread_mutex_lock(&pool->idle_lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->has_tasks);
+    pthread_mutex_unlock(&pool->idle_lock);
+    for (int i = 0; i < pool->threads_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pool->threads_count = 0;
+}
+
+int task_completions_init(task_completions_t *completions) {
+    completions->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (completions->wake_fd == FAIL) {
+        perror("[PROXY] Error in eventfd()");
+        return FAIL;
+    }
+    pthread_mutex_init(&completions->lock, NULL);
+    completions->head = NULL;
+    completions->tail = NULL;
+    completions->in_flight = 0;
+    return SUCCESS;
+}
+
+task_t *task_completions_take(task_completions_t *completions) {
+    uint64_t count;
+    // resets the counter, tasks finished after this wake the loop again
+    if (read(completions->wake_fd, &count, sizeof(count)) == FAIL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&completions->lock);
+    task_t *tasks = completions->head;
+    completions->head = NULL;
+    completions->tail = NULL;
+    pthread_mutex_unlock(&completions->lock);
+    for (task_t *task = tasks; task != NULL; task = task->next) {
+        completions->in_flight--;
+    }
+    return tasks;
+}
+
+void task_completions_wait(task_completions_t *completions) {
+    struct pollfd wake = {.fd = completions->wake_fd, .events = POLLIN};
+    poll(&wake, 1, FAIL);
+}
+
+void task_completions_destroy(task_completions_t *completions) {
+    close(completions->wake_fd);
+    pthread_mutex_destroy(&completions->lock);
+}
@@ -0,0 +1,84 @@
+#ifndef PROXY_SERVER_TASK_POOL_H
+#define PROXY_SERVER_TASK_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Threads for work that may block, so it never runs on an event loop.
+ * Every thread has its own deque: it takes the oldest task of its own
+ * and, when it has none, steals the oldest task of another thread.
+ * A finished task is put to the completion queue it was submitted with,
+ * and the event loop owning the queue is woken by its eventfd.
+ */
+
+#define MAX_TASK_THREADS (64)
+#define TASK_DEQUE_CAPACITY (256)
+
+typedef struct task_completions_t task_completions_t;
+
+/*
+ * Embedded as the first member of what a task works on
+ */
+typedef struct task_t {
+    void (*run)(struct task_t *task); // on a pool thread
+    task_completions_t *completions;
+    struct task_t *next;
+} task_t;
+
+struct task_completions_t {
+    int wake_fd; // readable while finished tasks wait here
+    pthread_mutex_t lock;
+    task_t *head;
+    task_t *tail;
+    int in_flight; // submitted and not taken back yet, only used by the owner
+};
+
+typedef struct task_deque_t {
+    struct task_pool_t *pool; // of the thread owning the deque
+    int index;
+    pthread_mutex_t lock;
+    task_t *tasks[TASK_DEQUE_CAPACITY];
+    size_t oldest;
+    size_t len;
+} task_deque_t;
+
+typedef struct task_pool_t {
+    int threads_count;
+    pthread_t threads[MAX_TASK_THREADS];
+    task_deque_t deques[MAX_TASK_THREADS];
+    unsigned next_deque; // where the next submitted task goes
+    pthread_mutex_t idle_lock;
+    pthread_cond_t has_tasks;
+    int queued; // tasks in the deques not claimed by a thread
+    bool stopping;
+} task_pool_t;
+
+int task_pool_start(task_pool_t *pool, int threads_count);
+
+/*
+ * Fails if every deque is full
+ */
+int task_pool_submit(task_pool_t *pool, task_t *task, task_completions_t *completions);
+
+/*
+ * Joins the threads, tasks that are still queued are not run
+ */
+void task_pool_stop(task_pool_t *pool);
+
+int task_completions_init(task_completions_t *completions);
+
+/*
+ * Returns the finished tasks linked by next, NULL if there are none
+ */
+task_t *task_completions_take(task_completions_t *completions);
+
+/*
+ * Blocks until a task of the queue finishes
+ */
+void task_completions_wait(task_completions_t *completions);
+
+void task_completions_destroy(task_completions_t *completions);
+
+#endif //PROXY_SERVER_TASK_POOL_H
@@ -0,0 +1,296 @@
+#include "tenants.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define NS_PER_SEC (1000000000ULL)
+#define BURSTS_PER_SEC (20) // the burst is what the share gives in 50 ms
+#define PORT_PREFIX "port:"
+#define MAX_PORT (65535)
+#define MAX_SPEC_LEN (64)
+#define MAX_WEIGHT (1000)
+
+static uint64_t burst_of(uint64_t rate) {
+    uint64_t burst = rate / BURSTS_PER_SEC;
+    return burst < TENANTS_MIN_BURST ? TENANTS_MIN_BURST : burst;
+}
+
+static void set_rate(tenant_t *tenant, uint64_t rate) {
+    tenant->rate = rate == 0 ? 1 : rate;
+}
+
+/*
+ * The bytes the bucket lacks are kept, only the time to refill them changes.
+ * Only the sharing thread writes the rate, the workers take grants meanwhile.
+ */
+static void change_rate(tenant_t *tenant, uint64_t rate, uint64_t now_ns) {
+    rate = rate == 0 ? 1 : rate;
+    uint64_t full_at_ns = __atomic_load_n(&tenant->full_at_ns, __ATOMIC_RELAXED);
+    uint64_t next_ns;
+    do {
+        uint64_t missing = 0;
+        if (full_at_ns > now_ns) {
+            missing = (full_at_ns - now_ns) * tenant->rate / NS_PER_SEC;
+        }
+        next_ns = now_ns + missing * NS_PER_SEC / rate;
+    } while (!__atomic_compare_exchange_n(&tenant->full_at_ns, &full_at_ns, next_ns, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    __atomic_store_n(&tenant->rate, rate, __ATOMIC_RELAXED);
+}
+
+void tenants_init(tenants_t *tenants, long capacity) {
+    memset(tenants, 0, sizeof(*tenants));
+    tenants->enabled = capacity > 0;
+    tenants->capacity = capacity > 0 ? (uint64_t) capacity : 0;
+    tenants->count = 1;
+    tenants->tenants[DEFAULT_TENANT].weight = 1;
+    set_rate(&tenants->tenants[DEFAULT_TENANT], tenants->capacity);
+}
+
+static int parse_number(const char *text, long max, long *value) {
+    char *end = NULL;
+    *value = strtol(text, &end, 10);
+    if (*text == '\0' || *end != '\0' || *value < 0 || *value > max) {
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+static int parse_selector(char *selector, tenant_t *tenant) {
+    long value;
+    if (strncmp(selector, PORT_PREFIX, strlen(PORT_PREFIX)) == 0) {
+        if (parse_number(selector + strlen(PORT_PREFIX), MAX_PORT, &value) == FAIL || value == 0) {
+            return FAIL;
+        }
+        tenant->port = (uint16_t) value;
+        return SUCCESS;
+    }
+    char *slash = strchr(selector, '/');
+    if (slash == NULL) {
+        return FAIL;
+    }
+    *slash = '\0';
+    if (inet_pton(AF_INET, selector, &tenant->network) != 1
+        || parse_number(slash + 1, 32, &value) == FAIL) {
+        return FAIL;
+    }
+    tenant->mask = value == 0 ? 0 : htonl(UINT32_MAX << (32 - value));
+    tenant->network &= tenant->mask;
+    return SUCCESS;
+}
+
+int tenants_add(tenants_t *tenants, const char *spec) {
+    char copy[MAX_SPEC_LEN];
+    if (strlen(spec) >= sizeof(copy) || tenants->count == MAX_TENANTS) {
+        return FAIL;
+    }
+    strcpy(copy, spec);
+    tenant_t tenant;
+    memset(&tenant, 0, sizeof(tenant));
+    char *weight = strchr(copy, ',');
+    if (weight == NULL) {
+        return FAIL;
+    }
+    *weight++ = '\0';
+    char *min_rate = strchr(weight, ',');
+    if (min_rate != NULL) {
+        *min_rate++ = '\0';
+    }
+    long value;
+    if (parse_selector(copy, &tenant) == FAIL
+        || parse_number(weight, MAX_WEIGHT, &value) == FAIL || value == 0) {
+        return FAIL;
+    }
+    tenant.weight = (uint32_t) value;
+    if (min_rate != NULL) {
+        if (parse_number(min_rate, (long) tenants->capacity, &value) == FAIL) {
+            return FAIL;
+        }
+        tenant.min_rate = (uint64_t) value;
+    }
+    set_rate(&tenant, tenant.min_rate);
+    tenants->by_port |= tenant.port != 0;
+    tenants->tenants[tenants->count++] = tenant;
+    return SUCCESS;
+}
+
+int tenants_classify(const tenants_t *tenants, uint16_t port, uint32_t address) {
+    for (int i = DEFAULT_TENANT + 1; i < tenants->count; i++) {
+        const tenant_t *tenant = &tenants->tenants[i];
+        if (tenant->port != 0 ? tenant->port == port : (address & tenant->mask) == tenant->network) {
+            return i;
+        }
+    }
+    return DEFAULT_TENANT;
+}
+
+/*
+ * What a tenant held back may use is unknown, it wants everything. The
+ * others want what they sent in the interval and the headroom to grow.
+ */
+static uint64_t demand_of(const tenant_t *tenant) {
+    if (tenant->held_back) {
+        return UINT64_MAX;
+    }
+    uint64_t rate = tenant->sent * NS_PER_SEC / TENANTS_SHARE_INTERVAL_NS;
+    return rate + rate * TENANTS_HEADROOM_PERCENT / 100;
+}
+
+/*
+ * Weighted max-min fairness: the capacity left after the minimums is
+ * divided by weight between the tenants that want more, a tenant that
+ * wants less than its part takes only what it wants and the rest is
+ * divided again. What nobody wants is divided by weight between the
+ * tenants that sent, so none of it is idle while others could use it.
+ */
+static void share_capacity(tenants_t *tenants, uint64_t now_ns) {
+    uint64_t rates[MAX_TENANTS];
+    uint64_t demands[MAX_TENANTS];
+    uint64_t left = tenants->capacity;
+    for (int i = 0; i < tenants->count; i++) {
+        const tenant_t *tenant = &tenants->tenants[i];
+        demands[i] = demand_of(tenant);
+        // an idle tenant gets its minimum back in the interval after it starts
+        rates[i] = tenant->min_rate < demands[i] ? tenant->min_rate : demands[i];
+        rates[i] = rates[i] < left ? rates[i] : left;
+        left -= rates[i];
+    }
+    // every round satisfies a tenant or gives out what is left
+    for (int round = 0; round < tenants->count && left > 0; round++) {
+        uint64_t weights = 0;
+        for (int i = 0; i < tenants->count; i++) {
+            if (rates[i] < demands[i]) {
+                weights += tenants->tenants[i].weight;
+            }
+        }
+        if (weights == 0) {
+            break;
+        }
+        uint64_t given = 0;
+        for (int i = 0; i < tenants->count; i++) {
+            if (rates[i] >= demands[i]) {
+                continue;
+            }
+            uint64_t part = left / weights * tenants->tenants[i].weight;
+            if (part > demands[i] - rates[i]) {
+                part = demands[i] - rates[i];
+            }
+            rates[i] += part;
+            given += part;
+        }
+        if (given == 0) {
+            break;
+        }
+        left -= given;
+    }
+    // what is left goes to the tenants that sent, to all if nobody did
+    bool active[MAX_TENANTS];
+    uint64_t weights = 0;
+    for (int i = 0; i < tenants->count; i++) {
+        active[i] = tenants->tenants[i].sent > 0 || tenants->tenants[i].held_back;
+        weights += active[i] ? tenants->tenants[i].weight : 0;
+    }
+    for (int i = 0; i < tenants->count; i++) {
+        active[i] |= weights == 0;
+    }
+    if (weights == 0) {
+        for (int i = 0; i < tenants->count; i++) {
+            weights += tenants->tenants[i].weight;
+        }
+    }
+    for (int i = 0; i < tenants->count; i++) {
+        tenant_t *tenant = &tenants->tenants[i];
+        uint64_t part = active[i] ? left / weights * tenant->weight : 0;
+        change_rate(tenant, rates[i] + part, now_ns);
+        tenant->sent = 0;
+        tenant->held_back = false;
+    }
+}
+
+static uint64_t bucket_available(uint64_t rate, uint64_t full_at_ns, uint64_t now_ns) {
+    uint64_t burst = burst_of(rate);
+    if (full_at_ns <= now_ns) {
+        return burst;
+    }
+    uint64_t missing = (full_at_ns - now_ns) * rate / NS_PER_SEC;
+    return missing >= burst ? 0 : burst - missing;
+}
+
+uint64_t tenants_share(tenants_t *tenants, const tenants_usage_t *usages, int usages_count, uint64_t now_ns) {
+    if (now_ns < tenants->next_share_ns) {
+        return tenants->next_share_ns - now_ns;
+    }
+    for (int i = 0; i < tenants->count; i++) {
+        uint64_t sent = 0;
+        uint64_t held_back = 0;
+        for (int j = 0; j < usages_count; j++) {
+            sent += __atomic_load_n(&usages[j].sent[i], __ATOMIC_RELAXED);
+            held_back += __atomic_load_n(&usages[j].held_back[i], __ATOMIC_RELAXED);
+        }
+        tenants->tenants[i].sent = sent - tenants->seen_sent[i];
+        tenants->tenants[i].held_back = held_back != tenants->seen_held_back[i];
+        tenants->seen_sent[i] = sent;
+        tenants->seen_held_back[i] = held_back;
+    }
+    share_capacity(tenants, now_ns);
+    tenants->next_share_ns = now_ns + TENANTS_SHARE_INTERVAL_NS;
+    return TENANTS_SHARE_INTERVAL_NS;
+}
+
+/*
+ * Takes up to wanted bytes from the bucket, other workers may take from it at the same time
+ */
+static uint64_t take_grant(tenant_t *tenant, uint64_t now_ns, uint64_t wanted) {
+    uint64_t rate = __atomic_load_n(&tenant->rate, __ATOMIC_RELAXED);
+    uint64_t full_at_ns = __atomic_load_n(&tenant->full_at_ns, __ATOMIC_RELAXED);
+    uint64_t taken;
+    uint64_t next_ns;
+    do {
+        uint64_t available = bucket_available(rate, full_at_ns, now_ns);
+        taken = available < wanted ? available : wanted;
+        if (taken == 0) {
+            return 0;
+        }
+        next_ns = (full_at_ns > now_ns ? full_at_ns : now_ns) + taken * NS_PER_SEC / rate;
+    } while (!__atomic_compare_exchange_n(&tenant->full_at_ns, &full_at_ns, next_ns, true,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return taken;
+}
+
+size_t tenants_allowance(tenants_t *tenants, tenants_usage_t *usage, int tenant_index, uint64_t now_ns,
+                         size_t limit) {
+    uint64_t granted = usage->granted[tenant_index];
+    if (granted < limit) {
+        // a grant lasts several small writes, so the bucket is not touched by each of them
+        uint64_t wanted = limit - granted < TENANTS_MIN_GRANT ? TENANTS_MIN_GRANT : limit - granted;
+        granted += take_grant(&tenants->tenants[tenant_index], now_ns, wanted);
+        usage->granted[tenant_index] = granted;
+    }
+    if (granted >= limit) {
+        return limit;
+    }
+    __atomic_store_n(&usage->held_back[tenant_index], usage->held_back[tenant_index] + 1, __ATOMIC_RELAXED);
+    // many tiny writes would cost more than waiting for a grant
+    return granted < TENANTS_MIN_GRANT ? 0 : (size_t) granted;
+}
+
+void tenants_consume(tenants_usage_t *usage, int tenant_index, size_t bytes) {
+    uint64_t granted = usage->granted[tenant_index];
+    usage->granted[tenant_index] = bytes < granted ? granted - bytes : 0;
+    __atomic_store_n(&usage->sent[tenant_index], usage->sent[tenant_index] + bytes, __ATOMIC_RELAXED);
+}
+
+uint64_t tenants_wait_ns(const tenants_t *tenants, int tenant_index, uint64_t now_ns) {
+    const tenant_t *tenant = &tenants->tenants[tenant_index];
+    uint64_t rate = __atomic_load_n(&tenant->rate, __ATOMIC_RELAXED);
+    uint64_t full_at_ns = __atomic_load_n(&tenant->full_at_ns, __ATOMIC_RELAXED);
+    // the bucket holds a grant when it lacks no more than burst - grant
+    uint64_t spare_ns = (burst_of(rate) - TENANTS_MIN_GRANT) * NS_PER_SEC / rate;
+    if (full_at_ns <= now_ns + spare_ns) {
+        return 0;
+    }
+    return full_at_ns - spare_ns - now_ns;
+}
@@ -0,0 +1,101 @@
+#ifndef PROXY_SERVER_TENANTS_H
+#define PROXY_SERVER_TENANTS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Weighted fair sharing of relay bandwidth between tenants. A tenant is
+ * the clients of a source network or of a listening port, the rest are
+ * the default tenant. Every TENANTS_SHARE_INTERVAL_NS the capacity is
+ * divided anew by weighted max-min fairness: every tenant gets its
+ * minimum, the rest goes to the tenants that want more in proportion to
+ * their weights, and what a tenant does not use is given to the others.
+ * Writes of a tenant are limited by a token bucket at its share.
+ *
+ * The workers do not take a lock to write. A worker takes grants of
+ * bytes from the bucket of a tenant with compare and swap and spends
+ * them on its writes, it counts what it sent in its own usage. One
+ * thread sums the usage of the workers and publishes the new shares.
+ */
+
+#define MAX_TENANTS (16) // the default tenant included
+#define DEFAULT_TENANT (0)
+#define TENANTS_SHARE_INTERVAL_NS (100 * 1000 * 1000ULL)
+/* a tenant that was not held back may grow by this much in the next interval */
+#define TENANTS_HEADROOM_PERCENT (25)
+#define TENANTS_MIN_BURST (16 * 1024)
+#define TENANTS_MIN_GRANT (4 * 1024) // a paused descriptor is resumed when this much can be written
+
+typedef struct tenant_t {
+    uint16_t port;    // of the listener, 0 if the tenant is selected by network
+    uint32_t network; // IPv4 in network order
+    uint32_t mask;
+    uint32_t weight;
+    uint64_t min_rate;   // bytes per second
+    uint64_t rate;       // share in the current interval, atomic
+    uint64_t full_at_ns; // of the bucket, see shaper_bucket_t, atomic
+    uint64_t sent;       // in the last interval, only used by the sharing thread
+    bool held_back;      // in the last interval, only used by the sharing thread
+} tenant_t;
+
+/*
+ * Of one worker. The counters only grow and are written by the worker alone.
+ */
+typedef struct tenants_usage_t {
+    uint64_t sent[MAX_TENANTS];      // atomic
+    uint64_t held_back[MAX_TENANTS]; // times a write was cut short, atomic
+    uint64_t granted[MAX_TENANTS];   // taken from the buckets and not written yet
+} tenants_usage_t;
+
+typedef struct tenants_t {
+    bool enabled;
+    bool by_port;      // some tenant is selected by the listening port
+    uint64_t capacity; // bytes per second shared by all the tenants
+    int count;
+    tenant_t tenants[MAX_TENANTS];
+    uint64_t next_share_ns;
+    // the usage of all the workers summed at the last sharing
+    uint64_t seen_sent[MAX_TENANTS];
+    uint64_t seen_held_back[MAX_TENANTS];
+} tenants_t;
+
+/*
+ * capacity 0 turns the sharing off. Only the default tenant exists after it.
+ */
+void tenants_init(tenants_t *tenants, long capacity);
+
+/*
+ * Accepts "<ipv4>/<bits>,<weight>[,<min_bytes_per_sec>]" and
+ * "port:<port>,<weight>[,<min_bytes_per_sec>]". The first tenant that
+ * matches a client takes it.
+ */
+int tenants_add(tenants_t *tenants, const char *spec);
+
+/*
+ * port is the local port of the listener the client came to, 0 for a unix listener
+ */
+int tenants_classify(const tenants_t *tenants, uint16_t port, uint32_t address);
+
+/*
+ * Divides the capacity anew if TENANTS_SHARE_INTERVAL_NS has passed since
+ * the last time. Must be called by one thread only, returns the ns until
+ * the next sharing.
+ */
+uint64_t tenants_share(tenants_t *tenants, const tenants_usage_t *usages, int usages_count, uint64_t now_ns);
+
+/*
+ * returns how many bytes the tenant may write now, not more than limit.
+ * Returns 0 if it is less than TENANTS_MIN_GRANT.
+ */
+size_t tenants_allowance(tenants_t *tenants, tenants_usage_t *usage, int tenant, uint64_t now_ns, size_t limit);
+
+void tenants_consume(tenants_usage_t *usage, int tenant, size_t bytes);
+
+/*
+ * returns how long to wait until TENANTS_MIN_GRANT can be written
+ */
+uint64_t tenants_wait_ns(const tenants_t *tenants, int tenant, uint64_t now_ns);
+
+#endif //PROXY_SERVER_TENANTS_H
@@ -0,0 +1,77 @@
+#include "timer_heap.h"
+
+#include <stdlib.h>
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define INITIAL_CAPACITY (64)
+
+static void swap(deadline_t *a, deadline_t *b) {
+    deadline_t temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+int timer_heap_push(timer_heap_t *heap, uint64_t at_ns, int fd) {
+    if (heap->len == heap->capacity) {
+        size_t capacity = heap->capacity == 0 ? INITIAL_CAPACITY : heap->capacity * 2;
+        deadline_t *temp = realloc(heap->items, capacity * sizeof(*temp));
+        if (temp == NULL) {
+            return FAIL;
+        }
+        heap->items = temp;
+        heap->capacity = capacity;
+    }
+    size_t child = heap->len++;
+    heap->items[child].at_ns = at_ns;
+    heap->items[child].fd = fd;
+    while (child > 0) {
+        size_t parent = (child - 1) / 2;
+        if (heap->items[parent].at_ns <= heap->items[child].at_ns) {
+            break;
+        }
+        swap(&heap->items[parent], &heap->items[child]);
+        child = parent;
+    }
+    return SUCCESS;
+}
+
+bool timer_heap_pop_expired(timer_heap_t *heap, uint64_t now_ns, deadline_t *expired) {
+    if (heap->len == 0 || heap->items[0].at_ns > now_ns) {
+        return false;
+    }
+    *expired = heap->items[0];
+    heap->items[0] = heap->items[--heap->len];
+    size_t parent = 0;
+    while (true) {
+        size_t smallest = parent;
+        size_t left = parent * 2 + 1;
+        size_t right = left + 1;
+        if (left < heap->len && heap->items[left].at_ns < heap->items[smallest].at_ns) {
+            smallest = left;
+        }
+        if (right < heap->len && heap->items[right].at_ns < heap->items[smallest].at_ns) {
+            smallest = right;
+        }
+        if (smallest == parent) {
+            break;
+        }
+        swap(&heap->items[parent], &heap->items[smallest]);
+        parent = smallest;
+    }
+    return true;
+}
+
+uint64_t timer_heap_next(const timer_heap_t *heap) {
+    if (heap->len == 0) {
+        return 0;
+    }
+    return heap->items[0].at_ns;
+}
+
+void timer_heap_free(timer_heap_t *heap) {
+    free(heap->items);
+    heap->items = NULL;
+    heap->len = 0;
+    heap->capacity = 0;
+}
@@ -0,0 +1,39 @@
+#ifndef PROXY_SERVER_TIMER_HEAP_H
+#define PROXY_SERVER_TIMER_HEAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary min-heap of deadlines for descriptors. Timers are never removed
+ * from the middle: the owner remembers the deadline it expects for a
+ * descriptor and ignores popped timers that do not match it.
+ */
+
+typedef struct deadline_t {
+    uint64_t at_ns;
+    int fd;
+} deadline_t;
+
+typedef struct timer_heap_t {
+    deadline_t *items;
+    size_t len;
+    size_t capacity;
+} timer_heap_t;
+
+int timer_heap_push(timer_heap_t *heap, uint64_t at_ns, int fd);
+
+/*
+ * Takes the earliest deadline if it is not later than now_ns
+ */
+bool timer_heap_pop_expired(timer_heap_t *heap, uint64_t now_ns, deadline_t *expired);
+
+/*
+ * returns the earliest deadline or 0 if the heap is empty
+ */
+uint64_t timer_heap_next(const timer_heap_t *heap);
+
+void timer_heap_free(timer_heap_t *heap);
+
+#endif //PROXY_SERVER_TIMER_HEAP_H
@@ -0,0 +1,183 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io_operations.h"
+
+#define FAIL (-1)
+#define SUCCESS (0)
+#define NS_PER_SEC (1000000000ULL)
+#define NS_PER_MS (1000000ULL)
+
+/*
+ * Single producer (the owning thread), single consumer (the writer).
+ * head is only written by the producer and tail only by the consumer.
+ */
+typedef struct trace_ring_t {
+    trace_record_t records[TRACE_RING_SIZE];
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    struct trace_ring_t *next;
+} trace_ring_t;
+
+static __thread trace_ring_t *thread_ring = NULL;
+static trace_ring_t *rings = NULL;
+static int trace_fd = FAIL;
+static uint64_t start_ns = 0;
+static pthread_t writer_thread;
+static bool stop_requested = false;
+static uint32_t next_tunnel = 0;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * NS_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+static trace_ring_t *register_thread_ring() {
+    trace_ring_t *ring = (trace_ring_t *) calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    thread_ring = ring;
+    return ring;
+}
+
+/*
+ * The records between tail and head are written straight from the ring,
+ * the producer does not reuse them until tail is moved past them
+ */
+static void drain_ring(trace_ring_t *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+    while (tail != head) {
+        uint64_t offset = tail & (TRACE_RING_SIZE - 1);
+        // up to the end of the array, the rest is at its beginning
+        uint64_t count = head - tail;
+        if (count > TRACE_RING_SIZE - offset) {
+            count = TRACE_RING_SIZE - offset;
+        }
+        message_t chunk = {
+                .data = (char *) (ring->records + offset),
+                .len = count * sizeof(trace_record_t)
+        };
+        if (!write_all(trace_fd, &chunk)) {
+            perror("[PROXY] Error in trace write");
+        }
+        tail += count;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+static void drain_rings() {
+    for (trace_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        drain_ring(ring);
+    }
+}
+
+static void *run_writer(__attribute__((unused)) void *arg) {
+    struct timespec interval = {
+            .tv_sec = 0,
+            .tv_nsec = TRACE_FLUSH_INTERVAL_MS * NS_PER_MS
+    };
+    while (!__atomic_load_n(&stop_requested, __ATOMIC_ACQUIRE)) {
+        nanosleep(&interval, NULL);
+        drain_rings();
+    }
+    drain_rings();
+    return NULL;
+}
+
+int trace_open(const char *path) {
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd == FAIL) {
+        return FAIL;
+    }
+    struct timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record_t);
+    header.start_wall_ms = (uint64_t) wall.tv_sec * 1000 + (uint64_t) wall.tv_nsec / NS_PER_MS;
+    message_t header_message = {
+            .data = (char *) &header,
+            .len = sizeof(header)
+    };
+    if (!write_all(trace_fd, &header_message)) {
+        close(trace_fd);
+        trace_fd = FAIL;
+        return FAIL;
+    }
+    start_ns = now_ns();
+    stop_requested = false;
+    int return_value = pthread_create(&writer_thread, NULL, run_writer, NULL);
+    if (return_value != SUCCESS) {
+        close(trace_fd);
+        trace_fd = FAIL;
+        errno = return_value;
+        return FAIL;
+    }
+    return SUCCESS;
+}
+
+bool trace_enabled() {
+    return trace_fd != FAIL;
+}
+
+uint32_t trace_next_tunnel() {
+    return __atomic_fetch_add(&next_tunnel, 1, __ATOMIC_RELAXED);
+}
+
+void trace_record(trace_event_t event, uint32_t tunnel, trace_side_t side, uint32_t value, uint16_t port) {
+    trace_ring_t *ring = thread_ring;
+    if (ring == NULL) {
+        ring = register_thread_ring();
+        if (ring == NULL) {
+            return;
+        }
+    }
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail == TRACE_RING_SIZE) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    trace_record_t *record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->at_ns = now_ns() - start_ns;
+    record->tunnel = tunnel;
+    record->value = value;
+    record->port = port;
+    record->event = (uint8_t) event;
+    record->side = (uint8_t) side;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_close() {
+    if (trace_fd == FAIL) {
+        return;
+    }
+    __atomic_store_n(&stop_requested, true, __ATOMIC_RELEASE);
+    pthread_join(writer_thread, NULL);
+    close(trace_fd);
+    trace_fd = FAIL;
+}
+
+uint64_t trace_dropped_count() {
+    uint64_t dropped = 0;
+    for (trace_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
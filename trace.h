@@ -0,0 +1,77 @@
+#ifndef PROXY_SERVER_TRACE_H
+#define PROXY_SERVER_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Binary trace of what tunnels do: accept, greeting, request, every read
+ * and write with its size, and close. It is recorded to reproduce the
+ * timing and sizes of real traffic with the replay scenario of the load
+ * generator. Like the logger, every thread appends fixed size records to
+ * a ring of its own, a background thread copies the rings to the file
+ * every TRACE_FLUSH_INTERVAL_MS. Neither side takes a lock.
+ *
+ * The file is a trace_header_t followed by trace_record_t records in
+ * host byte order. Records of one tunnel are in the order they happened,
+ * records of different threads may be interleaved.
+ */
+
+#define TRACE_MAGIC "PXTR"
+#define TRACE_VERSION (1)
+#define TRACE_RING_SIZE (64 * 1024) // records per thread, must be a power of two
+#define TRACE_FLUSH_INTERVAL_MS (20)
+
+typedef enum trace_event_t {
+    TRACE_ACCEPT,
+    TRACE_GREETING, // a SOCKS5 greeting is accepted
+    TRACE_REQUEST,  // value is the IPv4 of the target, 0 for a name
+    TRACE_READ,     // value is the number of bytes
+    TRACE_WRITE,
+    TRACE_CLOSE     // value is the close_reason_t
+} trace_event_t;
+
+/*
+ * The socket of the tunnel an event happened on
+ */
+typedef enum trace_side_t {
+    TRACE_CLIENT,
+    TRACE_UPSTREAM
+} trace_side_t;
+
+typedef struct trace_header_t {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t start_wall_ms;
+} trace_header_t;
+
+typedef struct __attribute__((packed)) trace_record_t {
+    uint64_t at_ns;  // since the trace was opened
+    uint32_t tunnel; // unique in the trace
+    uint32_t value;
+    uint16_t port;   // target port of a request
+    uint8_t event;   // trace_event_t
+    uint8_t side;    // trace_side_t
+} trace_record_t;
+
+int trace_open(const char *path);
+
+bool trace_enabled();
+
+uint32_t trace_next_tunnel();
+
+/*
+ * Never blocks. If the writer is so far behind that the ring is full,
+ * the record is dropped and counted.
+ */
+void trace_record(trace_event_t event, uint32_t tunnel, trace_side_t side, uint32_t value, uint16_t port);
+
+/*
+ * Writes what the rings hold and joins the writer, nothing may be recorded after it
+ */
+void trace_close();
+
+uint64_t trace_dropped_count();
+
+#endif //PROXY_SERVER_TRACE_H